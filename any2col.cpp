@@ -18,13 +18,35 @@
  */
 
 #include <QCoreApplication>
+#ifndef A2C_HEADLESS
+#include <QGuiApplication>
+#endif
 #include <QCommandLineParser>
 #include <QCommandLineOption>
-#include <QTimer>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QJsonDocument>
 
 #include <QDebug>
 
+#include <memory>
+
+#include <cstdio>
+#include <cstdlib>
+
 #include "any2col.hpp"
+#include "batch.hpp"
+#include "engine.hpp"
+#include "palette_cache.hpp"
+#include "palette_file.hpp"
+#include "parallel.hpp"
+#include "preview.hpp"
+#include "raster.hpp"
+#include "quantize.hpp"
+#include "result_cache.hpp"
+#include "serve.hpp"
+#include "stats.hpp"
+#include "sweep.hpp"
 
 void printMissingOption(char const *str)
 {
@@ -33,10 +55,26 @@ void printMissingOption(char const *str)
             str);
 }
 
+// Once the outputs are written: skip the teardown of the engine, G'MIC
+// interpreters and Qt, nothing is left to save
+[[noreturn]] void quickExit(int status)
+{
+    fflush(stdout);
+    fflush(stderr);
+    std::_Exit(status);
+}
+
 int main(int argc, char *argv[])
 {
-    // QApp
+    // QApp: QPainter text (qt PDF writer, raster labels) needs a
+    // QGuiApplication, drawing into files needs no display
+#ifdef A2C_HEADLESS
     QCoreApplication app(argc, argv);
+#else
+    if (!qEnvironmentVariableIsSet("QT_QPA_PLATFORM"))
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    QGuiApplication app(argc, argv);
+#endif
     QCoreApplication::setApplicationName("PixArtGen");
     QCoreApplication::setApplicationVersion("0.0.1");
     QLocale locale;
@@ -47,6 +85,10 @@ int main(int argc, char *argv[])
     QString paletteFile;
     QString inputFile;
     QString outputFile;
+    QString outputDir;
+    QVector<struct batch_job> batchJobs;
+    QVector<struct sweep_job> sweepJobs;
+    int jobs = 0;
     bool needColour = false;
 
     // Command line parsing
@@ -58,12 +100,35 @@ int main(int argc, char *argv[])
     parser.addOptions({
                           // color palette (mandatory)
                           {{"p", "palette"},
-                           QCoreApplication::translate("main", "Set color palette to <palette.csv> (mandatory)"),
+                           QCoreApplication::translate("main", "Set color palette to <palette.csv> (mandatory, may be repeated in server mode)"),
                            QCoreApplication::translate("main", "palette.csv")},
                           // Input file (mandatory)
                           {{"i", "input"},
-                           QCoreApplication::translate("main", "Input picture (mandatory)"),
+                           QCoreApplication::translate("main", "Input picture (mandatory, may be repeated in batch mode)"),
                            QCoreApplication::translate("main", "file")},
+                          // Batch manifest
+                          {"batch",
+                           QCoreApplication::translate("main", "Process every picture listed in <manifest>, one \"input [output]\" per line"),
+                           QCoreApplication::translate("main", "manifest")},
+                          // Batch output directory
+                          {"output-dir",
+                           QCoreApplication::translate("main", "Output directory for batch jobs without explicit output (default: current directory)"),
+                           QCoreApplication::translate("main", "directory")},
+                          // Parameter sweep
+                          {"sweep",
+                           QCoreApplication::translate("main", "Color the picture for every \"page:pixel-size\" of the comma separated <list>, one file each, named after -o"),
+                           QCoreApplication::translate("main", "list")},
+                          // Worker threads
+                          {{"j", "jobs"},
+                           QCoreApplication::translate("main", "Number of worker threads in batch, sweep and server modes (default: one per core)"),
+                           QCoreApplication::translate("main", "integer")},
+                          // Render daemon
+                          {"serve",
+                           QCoreApplication::translate("main", "Serve render jobs on the local socket <socket>, palettes being the -p ones"),
+                           QCoreApplication::translate("main", "socket")},
+                          {"serve-queue",
+                           QCoreApplication::translate("main", "Jobs waiting for a worker in server mode before rejecting new ones (default: 4 per worker)"),
+                           QCoreApplication::translate("main", "integer")},
                           // Output file (mandatory)
                           {{"o", "output"},
                            QCoreApplication::translate("main", "Output file (mandatory)"),
@@ -106,21 +171,217 @@ int main(int argc, char *argv[])
                            QCoreApplication::translate("main", "float")},
                           // Coloured output
                           {{"c", "color-output"},
-                           QCoreApplication::translate("main", "Coloured output")}
+                           QCoreApplication::translate("main", "Coloured output")},
+                          // Sheet and solution from one run
+                          {"with-solution",
+                           QCoreApplication::translate("main", "Append the coloured solution pages to the numbered sheet, in the same document")},
+                          {"solution",
+                           QCoreApplication::translate("main", "Also write the coloured solution to <file>, rendered along with the -o sheet"),
+                           QCoreApplication::translate("main", "file")},
+                          // Decoding memory
+                          {"max-memory",
+                           QCoreApplication::translate("main", "Stream the input picture, using at most <size> MiB of picture buffers"),
+                           QCoreApplication::translate("main", "size")},
+                          // Poster
+                          {"poster-pages",
+                           QCoreApplication::translate("main", "Poster mode: spread the picture over <columns>x<rows> pages"),
+                           QCoreApplication::translate("main", "columnsxrows")},
+                          {"poster-size",
+                           QCoreApplication::translate("main", "Poster mode: picture size in millimeters, spread over as many pages as needed"),
+                           QCoreApplication::translate("main", "widthxheight")},
+                          {"poster-overlap",
+                           QCoreApplication::translate("main", "Poster mode: cells repeated on adjacent pages (default: 2)"),
+                           QCoreApplication::translate("main", "integer")},
+                          {"no-marks",
+                           QCoreApplication::translate("main", "Poster mode: no registration marks nor page captions")},
+                          // Paint by number
+                          {"regions",
+                           QCoreApplication::translate("main", "Paint by number: outline regions of same color cells and label each once; regions under <min-cells> cells are merged into a neighbour"),
+                           QCoreApplication::translate("main", "min-cells")},
+                          // Coloured output emission
+                          {"no-merge",
+                           QCoreApplication::translate("main", "Coloured output: draw every cell on its own instead of merged same-color rectangles")},
+                          // PDF backend
+                          {"pdf-writer",
+#ifdef A2C_HEADLESS
+                           QCoreApplication::translate("main", "PDF output, \"direct\" (minimal compressed PDF), the only one in headless builds (default: direct)"),
+#else
+                           QCoreApplication::translate("main", "PDF output, \"qt\" (QPainter) or \"direct\" (minimal compressed PDF) (default: qt)"),
+#endif
+                           QCoreApplication::translate("main", "writer")},
+                          // Raster preview
+                          {"preview",
+                           QCoreApplication::translate("main", "Write a PNG preview of the grid (coloured with -c/--color-output) to <file> instead of the PDF"),
+                           QCoreApplication::translate("main", "file")},
+                          {"preview-size",
+                           QCoreApplication::translate("main", "Longest side of the preview in pixels (default: %1)").arg(PREVIEW_SIZE),
+                           QCoreApplication::translate("main", "pixels")},
+                          // Print resolution raster
+                          {"raster",
+                           QCoreApplication::translate("main", "Write the pages (coloured with -c/--color-output) as a print resolution picture to <file> instead of the PDF: TIFF for .tif and .tiff files, PNG otherwise"),
+                           QCoreApplication::translate("main", "file")},
+                          {"dpi",
+                           QCoreApplication::translate("main", "Raster resolution in dots per inch (default: %1)").arg(RASTER_DPI),
+                           QCoreApplication::translate("main", "integer")},
+                          // Report
+                          {{"V", "verbose"},
+                           QCoreApplication::translate("main", "Report PDF generation time and size")},
+                          {"stats",
+                           QCoreApplication::translate("main", "Print the time, CPU time, peak memory and item counts of every stage as JSON")},
+                          // Resize
+                          {"resize",
+                           QCoreApplication::translate("main", "Fit-to-page resize, \"native\" (area averaging) or \"gmic\" (G'MIC linear interpolation) (default: native)"),
+                           QCoreApplication::translate("main", "method")},
+                          {"linear-light",
+                           QCoreApplication::translate("main", "Native resize: average colors in linear light instead of sRGB values")},
+                          // Quantizer
+                          {"quantizer",
+                           QCoreApplication::translate("main", "Palette mapping engine, \"native\" or \"gmic\" (default: native)"),
+                           QCoreApplication::translate("main", "engine")},
+                          // Color distance
+                          {"metric",
+                           QCoreApplication::translate("main", "Color distance used by the native quantizer, \"rgb\" or \"lab\" (default: rgb)"),
+                           QCoreApplication::translate("main", "metric")},
+                          // Nearest color search
+                          {"nearest",
+                           QCoreApplication::translate("main", "Nearest color search of the native quantizer, \"auto\", \"brute\", \"kdtree\", \"vptree\" or \"grid\" (default: auto)"),
+                           QCoreApplication::translate("main", "method")},
+                          // Dithering
+                          {"no-dither",
+                           QCoreApplication::translate("main", "Disable error diffusion, map every pixel to its nearest color")},
+                          {"dither",
+                           QCoreApplication::translate("main", "Error diffusion kernel of the native quantizer, \"fs\" (Floyd-Steinberg) or \"sierra\" (default: fs)"),
+                           QCoreApplication::translate("main", "kernel")},
+                          {"serpentine",
+                           QCoreApplication::translate("main", "Native quantizer: scan odd rows from right to left when dithering (serial)")},
+                          // Lookup table
+                          {"lut-bits",
+                           QCoreApplication::translate("main", "Native quantizer lookup table resolution, 1-8 bits per channel, 0 to disable (default: automatic)"),
+                           QCoreApplication::translate("main", "integer")},
+                          // Palette cache
+                          {"cache",
+                           QCoreApplication::translate("main", "Use the compiled palette cache")},
+                          {"cache-dir",
+                           QCoreApplication::translate("main", "Compiled palette cache directory, implies --cache (default: %1)").arg(PaletteCache::default_directory()),
+                           QCoreApplication::translate("main", "directory")},
+                          {"cache-check",
+                           QCoreApplication::translate("main", "Check the compiled palette cache, remove invalid entries and exit")},
+                          {"cache-clear",
+                           QCoreApplication::translate("main", "Remove every compiled palette from the cache and exit")},
+                          // Result cache
+                          {"result-cache",
+                           QCoreApplication::translate("main", "Reuse the index maps of earlier runs with the same picture, palette and grid options")},
+                          {"result-cache-dir",
+                           QCoreApplication::translate("main", "Result cache directory, implies --result-cache (default: %1)").arg(ResultCache::default_directory()),
+                           QCoreApplication::translate("main", "directory")},
+                          {"result-cache-size",
+                           QCoreApplication::translate("main", "Result cache size limit in MiB, least recently used entries are removed above (default: 256)"),
+                           QCoreApplication::translate("main", "size")},
+                          {"result-cache-clear",
+                           QCoreApplication::translate("main", "Remove every entry from the result cache and exit")},
+                          // Compiled palette
+                          {"compile-palette",
+                           QCoreApplication::translate("main", "Write the palette given with -p as a compiled palette <file> and exit"),
+                           QCoreApplication::translate("main", "file")}
                       });
 
     // Parse command line
     parser.process(app);
 
+    // Palette cache maintenance
+    QString cacheDir = parser.isSet("cache-dir") ? parser.value("cache-dir") : PaletteCache::default_directory();
+    bool useCache = parser.isSet("cache") || parser.isSet("cache-dir");
+    if (parser.isSet("cache-check")) {
+        int valid, invalid;
+        if (!PaletteCache(cacheDir).check(true, valid, invalid))
+            exit(EXIT_FAILURE);
+        printf("%s: %d valid, %d invalid (removed)\n", qPrintable(cacheDir), valid, invalid);
+        return invalid ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    if (parser.isSet("cache-clear")) {
+        return PaletteCache(cacheDir).clear() ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // Result cache
+    QString resultCacheDir = parser.isSet("result-cache-dir") ? parser.value("result-cache-dir") : ResultCache::default_directory();
+    bool useResultCache = parser.isSet("result-cache") || parser.isSet("result-cache-dir");
+    double resultCacheSize = 256;
+    if (parser.isSet("result-cache-clear")) {
+        return ResultCache(resultCacheDir, 0).clear() ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (parser.isSet("result-cache-size")) {
+        QString str = parser.value("result-cache-size");
+        bool ok;
+        resultCacheSize = locale.toDouble(str, &ok);
+        if (!ok || resultCacheSize <= 0) {
+            fprintf(stderr, "%s: %s\n",
+                    qPrintable(QCoreApplication::translate("main", "Invalid result cache size")),
+                    qPrintable(str));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Palette errors, with their position in text palettes
+    auto printPaletteError = [](QString const &file, struct palette_error const &error) {
+        if (error.line > 0)
+            fprintf(stderr, "%s: %s:%d:%d: %s\n",
+                    qPrintable(QCoreApplication::translate("main", "Unable to read palette")),
+                    qPrintable(file), error.line, error.column, qPrintable(error.message));
+        else
+            fprintf(stderr, "%s: %s\n",
+                    qPrintable(QCoreApplication::translate("main", "Unable to read palette")),
+                    qPrintable(file));
+    };
+
+    if (parser.isSet("compile-palette")) {
+        QVector<struct color> palette;
+        struct palette_error error;
+        if (!parser.isSet("palette")) {
+            printMissingOption("palette");
+            exit(EXIT_FAILURE);
+        }
+        if (!read_palette(parser.value("palette").toLocal8Bit().constData(), palette, &error)) {
+            printPaletteError(parser.value("palette"), error);
+            exit(EXIT_FAILURE);
+        }
+        if (!write_compiled_palette(parser.value("compile-palette").toLocal8Bit().constData(), palette)) {
+            fprintf(stderr, "%s: %s\n",
+                    qPrintable(QCoreApplication::translate("main", "Unable to write compiled palette")),
+                    qPrintable(parser.value("compile-palette")));
+            exit(EXIT_FAILURE);
+        }
+        return EXIT_SUCCESS;
+    }
+
     if (!parser.isSet("palette")) {
         printMissingOption("palette");
         mandatoryOptionsMissing = true;
     }
-    if (!parser.isSet("input")) {
+    bool serveMode = parser.isSet("serve");
+    bool batchMode = parser.isSet("batch") || parser.values("input").size() > 1;
+    if (!parser.isSet("input") && !parser.isSet("batch") && !serveMode) {
         printMissingOption("input");
         mandatoryOptionsMissing = true;
     }
-    if (!parser.isSet("output")) {
+    bool previewMode = parser.isSet("preview");
+    if (previewMode && (batchMode || serveMode)) {
+        fprintf(stderr, "%s\n",
+                qPrintable(QCoreApplication::translate("main", "--preview is only available for a single picture")));
+        exit(EXIT_FAILURE);
+    }
+    bool rasterMode = parser.isSet("raster");
+    if (rasterMode && (batchMode || serveMode || previewMode)) {
+        fprintf(stderr, "%s\n",
+                qPrintable(QCoreApplication::translate("main", "--raster is only available for a single picture, without --preview")));
+        exit(EXIT_FAILURE);
+    }
+    bool sweepMode = parser.isSet("sweep");
+    if (sweepMode && (batchMode || serveMode || previewMode || rasterMode)) {
+        fprintf(stderr, "%s\n",
+                qPrintable(QCoreApplication::translate("main", "--sweep is only available for a single picture and PDF output")));
+        exit(EXIT_FAILURE);
+    }
+    if (!parser.isSet("output") && !batchMode && !serveMode && !previewMode && !rasterMode) {
         printMissingOption("output");
         mandatoryOptionsMissing = true;
     }
@@ -133,6 +394,47 @@ int main(int argc, char *argv[])
     paletteFile = parser.value("palette");
     inputFile = parser.value("input");
     outputFile = parser.value("output");
+    outputDir = parser.isSet("output-dir") ? parser.value("output-dir") : QString(".");
+    if (batchMode) {
+        if (parser.isSet("batch")
+                && !read_manifest(parser.value("batch").toLocal8Bit().constData(), outputDir, batchJobs)) {
+            fprintf(stderr, "%s: %s\n",
+                    qPrintable(QCoreApplication::translate("main", "Unable to read batch manifest")),
+                    qPrintable(parser.value("batch")));
+            exit(EXIT_FAILURE);
+        }
+        for (QString const &input: parser.values("input")) {
+            struct batch_job job;
+            job.input = input;
+            job.output = batch_output_name(input, outputDir);
+            batchJobs.push_back(job);
+        }
+    }
+    if (parser.isSet("jobs")) {
+        QString str = parser.value("jobs");
+        bool ok;
+        int value = locale.toInt(str, &ok);
+        if (!ok || value <= 0) {
+            fprintf(stderr, "%s: %s\n",
+                    qPrintable(QCoreApplication::translate("main", "Invalid number of jobs")),
+                    qPrintable(str));
+            exit(EXIT_FAILURE);
+        }
+        jobs = value;
+    }
+    int serveQueue = 0;
+    if (parser.isSet("serve-queue")) {
+        QString str = parser.value("serve-queue");
+        bool ok;
+        int value = locale.toInt(str, &ok);
+        if (!ok || value <= 0) {
+            fprintf(stderr, "%s: %s\n",
+                    qPrintable(QCoreApplication::translate("main", "Invalid queue length")),
+                    qPrintable(str));
+            exit(EXIT_FAILURE);
+        }
+        serveQueue = value;
+    }
     if (parser.isSet("line-color")) {
         QString str = parser.value("line-color");
         bool ok;
@@ -335,23 +637,430 @@ int main(int argc, char *argv[])
     } else {
         opts.px_size = 2;
     }
+    if (sweepMode) {
+        QString error;
+        if (!parse_sweep(parser.value("sweep"), outputFile, opts, sweepJobs, error)) {
+            fprintf(stderr, "%s: %s\n",
+                    qPrintable(QCoreApplication::translate("main", "Invalid sweep")),
+                    qPrintable(error));
+            exit(EXIT_FAILURE);
+        }
+    }
     if (parser.isSet("color-output")) {
         needColour = true;
     } else {
         needColour = false;
     }
+    if ((parser.isSet("with-solution") || parser.isSet("solution")) && (needColour || previewMode || rasterMode)) {
+        fprintf(stderr, "%s\n",
+                qPrintable(QCoreApplication::translate("main", "--with-solution and --solution need the numbered sheet output")));
+        exit(EXIT_FAILURE);
+    }
+    if (parser.isSet("solution") && (batchMode || sweepMode || serveMode)) {
+        fprintf(stderr, "%s\n",
+                qPrintable(QCoreApplication::translate("main", "--solution is only available for a single picture, use --with-solution")));
+        exit(EXIT_FAILURE);
+    }
+    enum pdf_content content = needColour ? pdf_content::Soluce : pdf_content::Sheet;
+    if (parser.isSet("with-solution"))
+        content = pdf_content::Both;
+    if (parser.isSet("quantizer")) {
+        QString str = parser.value("quantizer");
+        if (str == "native") {
+            opts.quantizer.native = true;
+        } else if (str == "gmic") {
+            opts.quantizer.native = false;
+        } else {
+            fprintf(stderr, "%s: %s\n",
+                    qPrintable(QCoreApplication::translate("main", "Invalid quantizer (expected: native, gmic)")),
+                    qPrintable(str));
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (parser.isSet("resize")) {
+        QString str = parser.value("resize");
+        if (str == "native") {
+            opts.resize.method = resize_method::Native;
+        } else if (str == "gmic") {
+            opts.resize.method = resize_method::Gmic;
+        } else {
+            fprintf(stderr, "%s: %s\n",
+                    qPrintable(QCoreApplication::translate("main", "Invalid resize method (expected: native, gmic)")),
+                    qPrintable(str));
+            exit(EXIT_FAILURE);
+        }
+    }
+    opts.resize.linear = parser.isSet("linear-light");
+    if (opts.resize.linear && opts.resize.method != resize_method::Native) {
+        fprintf(stderr, "%s\n",
+                qPrintable(QCoreApplication::translate("main", "Linear light averaging needs the native resize")));
+        exit(EXIT_FAILURE);
+    }
+    if (parser.isSet("pdf-writer")) {
+        QString str = parser.value("pdf-writer");
+        if (str == "qt") {
+#ifdef A2C_HEADLESS
+            fprintf(stderr, "%s\n",
+                    qPrintable(QCoreApplication::translate("main", "The qt PDF writer is not available in headless builds")));
+            exit(EXIT_FAILURE);
+#endif
+            opts.pdf = pdf_backend::Qt;
+        } else if (str == "direct") {
+            opts.pdf = pdf_backend::Direct;
+        } else {
+            fprintf(stderr, "%s: %s\n",
+                    qPrintable(QCoreApplication::translate("main", "Invalid PDF writer (expected: qt, direct)")),
+                    qPrintable(str));
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (parser.isSet("metric")) {
+        QString str = parser.value("metric");
+        if (str == "rgb") {
+            opts.quantizer.metric = color_metric::RGB;
+        } else if (str == "lab") {
+            opts.quantizer.metric = color_metric::Lab;
+        } else {
+            fprintf(stderr, "%s: %s\n",
+                    qPrintable(QCoreApplication::translate("main", "Invalid color metric (expected: rgb, lab)")),
+                    qPrintable(str));
+            exit(EXIT_FAILURE);
+        }
+        if (!opts.quantizer.native && opts.quantizer.metric != color_metric::RGB) {
+            fprintf(stderr, "%s\n",
+                    qPrintable(QCoreApplication::translate("main", "The gmic quantizer only supports the rgb metric")));
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (parser.isSet("nearest")) {
+        static const struct {
+            const char *name;
+            enum nearest_search search;
+        } searches[] = {
+            {"auto", nearest_search::Auto},
+            {"brute", nearest_search::BruteForce},
+            {"kdtree", nearest_search::KdTree},
+            {"vptree", nearest_search::VpTree},
+            {"grid", nearest_search::Grid},
+        };
+        QString str = parser.value("nearest");
+        bool found = false;
+        for (auto const &search: searches) {
+            if (str == search.name) {
+                opts.quantizer.search = search.search;
+                found = true;
+            }
+        }
+        if (!found) {
+            fprintf(stderr, "%s: %s\n",
+                    qPrintable(QCoreApplication::translate("main", "Invalid nearest color search (expected: auto, brute, kdtree, vptree, grid)")),
+                    qPrintable(str));
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (parser.isSet("max-memory")) {
+        QString str = parser.value("max-memory");
+        bool ok;
+        double value = locale.toDouble(str, &ok);
+        if (!ok || value <= 0) {
+            fprintf(stderr, "%s: %s\n",
+                    qPrintable(QCoreApplication::translate("main", "Invalid memory limit")),
+                    qPrintable(str));
+            exit(EXIT_FAILURE);
+        }
+        opts.max_memory = value * 1048576.0;
+    }
+    int previewSize = PREVIEW_SIZE;
+    if (previewMode) {
+        if (parser.isSet("preview-size")) {
+            QString str = parser.value("preview-size");
+            bool ok;
+            previewSize = locale.toInt(str, &ok);
+            if (!ok || previewSize <= 0) {
+                fprintf(stderr, "%s: %s\n",
+                        qPrintable(QCoreApplication::translate("main", "Invalid preview size")),
+                        qPrintable(str));
+                exit(EXIT_FAILURE);
+            }
+        }
+        // Streamed decoding is much faster than G'MIC on large pictures
+        // (reduced scale JPEG decoding, no full size resize)
+        if (!opts.max_memory)
+            opts.max_memory = PREVIEW_MEMORY;
+    }
+    int rasterDpi = RASTER_DPI;
+    if (parser.isSet("dpi")) {
+        QString str = parser.value("dpi");
+        bool ok;
+        rasterDpi = locale.toInt(str, &ok);
+        if (!ok || rasterDpi <= 0) {
+            fprintf(stderr, "%s: %s\n",
+                    qPrintable(QCoreApplication::translate("main", "Invalid resolution")),
+                    qPrintable(str));
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (parser.isSet("poster-pages") && parser.isSet("poster-size")) {
+        fprintf(stderr, "%s\n",
+                qPrintable(QCoreApplication::translate("main", "--poster-pages and --poster-size are exclusive")));
+        exit(EXIT_FAILURE);
+    }
+    if (parser.isSet("poster-pages")) {
+        QString str = parser.value("poster-pages");
+        QStringList values = str.split('x');
+        bool ok = values.size() == 2;
+        int columns = ok ? locale.toInt(values.at(0), &ok) : 0;
+        int rows = ok ? locale.toInt(values.at(1), &ok) : 0;
+        if (!ok || columns <= 0 || rows <= 0) {
+            fprintf(stderr, "%s: %s\n",
+                    qPrintable(QCoreApplication::translate("main", "Invalid poster page count (expected: <columns>x<rows>)")),
+                    qPrintable(str));
+            exit(EXIT_FAILURE);
+        }
+        opts.poster.columns = columns;
+        opts.poster.rows = rows;
+    }
+    if (parser.isSet("poster-size")) {
+        QString str = parser.value("poster-size");
+        QStringList values = str.split('x');
+        bool ok = values.size() == 2;
+        double width = ok ? locale.toDouble(values.at(0), &ok) : 0;
+        double height = ok ? locale.toDouble(values.at(1), &ok) : 0;
+        if (!ok || width < opts.px_size || height < opts.px_size) {
+            fprintf(stderr, "%s: %s\n",
+                    qPrintable(QCoreApplication::translate("main", "Invalid poster size (expected: <width>x<height>, in millimeters)")),
+                    qPrintable(str));
+            exit(EXIT_FAILURE);
+        }
+        opts.poster.width = width;
+        opts.poster.height = height;
+    }
+    if (parser.isSet("poster-overlap")) {
+        QString str = parser.value("poster-overlap");
+        bool ok;
+        int value = locale.toInt(str, &ok);
+        if (!ok || value < 0) {
+            fprintf(stderr, "%s: %s\n",
+                    qPrintable(QCoreApplication::translate("main", "Invalid poster overlap")),
+                    qPrintable(str));
+            exit(EXIT_FAILURE);
+        }
+        opts.poster.overlap = value;
+    }
+    opts.poster.marks = !parser.isSet("no-marks");
+    opts.merge_cells = !parser.isSet("no-merge");
+    opts.quantizer.dithering = !parser.isSet("no-dither");
+    if (parser.isSet("dither")) {
+        QString str = parser.value("dither");
+        if (str == "fs") {
+            opts.quantizer.kernel = dither_kernel::FloydSteinberg;
+        } else if (str == "sierra") {
+            opts.quantizer.kernel = dither_kernel::Sierra;
+        } else {
+            fprintf(stderr, "%s: %s\n",
+                    qPrintable(QCoreApplication::translate("main", "Invalid dithering kernel (expected: fs, sierra)")),
+                    qPrintable(str));
+            exit(EXIT_FAILURE);
+        }
+    }
+    opts.quantizer.serpentine = parser.isSet("serpentine");
+    if (!opts.quantizer.native && (opts.quantizer.kernel != dither_kernel::FloydSteinberg || opts.quantizer.serpentine)) {
+        fprintf(stderr, "%s\n",
+                qPrintable(QCoreApplication::translate("main", "The gmic quantizer only supports Floyd-Steinberg dithering, without serpentine scanning")));
+        exit(EXIT_FAILURE);
+    }
+    if (parser.isSet("lut-bits")) {
+        QString str = parser.value("lut-bits");
+        bool ok;
+        int value = locale.toInt(str, &ok);
+        if (!ok || value < 0 || value > 8) {
+            fprintf(stderr, "%s: %s\n",
+                    qPrintable(QCoreApplication::translate("main", "Invalid lookup table resolution (valid range: 0-8)")),
+                    qPrintable(str));
+            exit(EXIT_FAILURE);
+        }
+        opts.quantizer.lut_bits = value;
+    }
+    if (parser.isSet("regions")) {
+        QString str = parser.value("regions");
+        bool ok;
+        int value = locale.toInt(str, &ok);
+        if (!ok || value < 1) {
+            fprintf(stderr, "%s: %s\n",
+                    qPrintable(QCoreApplication::translate("main", "Invalid minimal region size")),
+                    qPrintable(str));
+            exit(EXIT_FAILURE);
+        }
+        opts.regions.enabled = true;
+        opts.regions.min_cells = value;
+    }
 
-    make_coloring(paletteFile.toLocal8Bit().constData(),
-                  inputFile.toLocal8Bit().constData(),
-                  opts,
-                  coloring);
-    coloring2pdf(outputFile.toLocal8Bit().constData(),
-                 coloring,
-                 opts,
-                 needColour);
+    // Palette, and its compiled form for the native quantizer
+    auto loadPalette = [&](QString const &file, QVector<struct color> &palette, std::shared_ptr<const Quantizer> &quantizer) {
+        bool paletteOk;
+        struct palette_error error;
+        if (opts.quantizer.native && useCache) {
+            // A cached lookup table is free, build one if it can be used
+            int lut_bits = opts.quantizer.lut_bits;
+            if (lut_bits < 0)
+                lut_bits = 8;
+            if (opts.quantizer.dithering)
+                lut_bits = 0;
+            quantizer = PaletteCache(cacheDir).load(file.toLocal8Bit().constData(),
+                                                    opts.quantizer.metric, lut_bits, palette, &error, opts.quantizer.search);
+            paletteOk = quantizer != nullptr;
+        } else {
+            paletteOk = read_palette(file.toLocal8Bit().constData(), palette, &error);
+            if (paletteOk && opts.quantizer.native) {
+                std::shared_ptr<Quantizer> newQuantizer = std::make_shared<Quantizer>(palette, opts.quantizer.metric);
+                if (opts.quantizer.search != nearest_search::Auto)
+                    newQuantizer->set_search(opts.quantizer.search);
+                if (opts.quantizer.lut_bits > 0 && !opts.quantizer.dithering)
+                    newQuantizer->build_lut(opts.quantizer.lut_bits);
+                quantizer = newQuantizer;
+            }
+        }
+        if (!paletteOk || palette.isEmpty()) {
+            printPaletteError(file, error);
+            exit(EXIT_FAILURE);
+        }
+    };
 
-    QTimer::singleShot(0, &app, &QCoreApplication::quit);
+    // Pictures colored at once share the cores: without it, every worker
+    // would run its parallel stages (dithering...) on all of them
+    if (serveMode || batchMode || sweepMode) {
+        int workers = jobs > 0 ? jobs : ideal_thread_count();
+        if (batchMode)
+            workers = std::min(workers, std::max(1, batchJobs.size()));
+        if (sweepMode)
+            workers = std::min(workers, std::max(1, sweepJobs.size()));
+        opts.threads = std::max(1, ideal_thread_count() / workers);
+    }
 
-    return app.exec();
-}
+    std::shared_ptr<ResultCache> resultCache;
+    if (useResultCache)
+        resultCache = std::make_shared<ResultCache>(resultCacheDir, (qint64)(resultCacheSize * 1048576.0));
+
+    if (serveMode) {
+        // Palettes are named after their file
+        QVector<struct served_palette> palettes;
+        for (QString const &file: parser.values("palette")) {
+            struct served_palette palette;
+            palette.id = QFileInfo(file).completeBaseName();
+            loadPalette(file, palette.palette, palette.quantizer);
+            palettes.push_back(palette);
+        }
+        return run_server(parser.value("serve"), palettes, opts, jobs, serveQueue, resultCache);
+    }
+
+    if (rasterMode && is_poster(opts) && raster_format_of(parser.value("raster")) != raster_format::Tiff) {
+        fprintf(stderr, "%s\n",
+                qPrintable(QCoreApplication::translate("main", "Posters need a TIFF raster (.tif or .tiff), PNG holds a single page")));
+        exit(EXIT_FAILURE);
+    }
+
+    QVector<struct color> palette;
+    std::shared_ptr<const Quantizer> quantizer;
+    loadPalette(paletteFile, palette, quantizer);
 
+    ColoringEngine engine(opts);
+    engine.set_palette(palette, quantizer);
+    engine.set_result_cache(resultCache);
+
+    if (batchMode) {
+        int failed = run_batch(batchJobs, engine, content, jobs);
+        if (resultCache && parser.isSet("verbose"))
+            fprintf(stderr, "Result cache: %lld hits, %lld misses\n",
+                    (long long)resultCache->hits(), (long long)resultCache->misses());
+        quickExit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+    if (sweepMode) {
+        int failed = run_sweep(inputFile, sweepJobs, engine, content, jobs);
+        if (resultCache && parser.isSet("verbose"))
+            fprintf(stderr, "Result cache: %lld hits, %lld misses\n",
+                    (long long)resultCache->hits(), (long long)resultCache->misses());
+        quickExit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+
+    QString error;
+    if (engine.make_coloring(inputFile.toLocal8Bit().constData(), coloring, &error) != coloring_status::Ok) {
+        fprintf(stderr, "%s: %s: %s\n",
+                qPrintable(QCoreApplication::translate("main", "Unable to process picture")),
+                qPrintable(inputFile), qPrintable(error));
+        exit(EXIT_FAILURE);
+    }
+    if (parser.isSet("verbose")) {
+        if (resultCache)
+            fprintf(stderr, "Result cache: %s\n", resultCache->hits() ? "hit" : "miss");
+        fprintf(stderr, "Decoding: %.1f MiB of picture buffers\n", coloring.decode_peak / 1048576.0);
+        fprintf(stderr, "Index map: %.1f KiB\n", coloring.indexes.bytes() / 1024.0);
+    }
+    if (previewMode) {
+        QString previewFile = parser.value("preview");
+        QElapsedTimer previewTimer;
+        previewTimer.start();
+        if (!coloring2preview(previewFile.toLocal8Bit().constData(), coloring, opts, needColour, previewSize, &coloring.stats)) {
+            fprintf(stderr, "%s: %s\n",
+                    qPrintable(QCoreApplication::translate("main", "Unable to write")),
+                    qPrintable(previewFile));
+            exit(EXIT_FAILURE);
+        }
+        if (parser.isSet("verbose")) {
+            fprintf(stderr, "Preview: %dx%d cells, %.1f ms, %lld bytes\n",
+                    coloring.indexes.width(), coloring.indexes.height(),
+                    previewTimer.nsecsElapsed() / 1e6, (long long)QFileInfo(previewFile).size());
+        }
+        if (parser.isSet("stats")) {
+            QByteArray json = QJsonDocument(stats2json(coloring.stats)).toJson();
+            fwrite(json.constData(), 1, json.size(), stdout);
+        }
+        quickExit(EXIT_SUCCESS);
+    }
+
+    if (rasterMode) {
+        QString rasterFile = parser.value("raster");
+        QElapsedTimer rasterTimer;
+        rasterTimer.start();
+        if (!coloring2raster(rasterFile.toLocal8Bit().constData(), coloring, opts, needColour, rasterDpi, &coloring.stats)) {
+            fprintf(stderr, "%s: %s\n",
+                    qPrintable(QCoreApplication::translate("main", "Unable to write")),
+                    qPrintable(rasterFile));
+            exit(EXIT_FAILURE);
+        }
+        if (parser.isSet("verbose")) {
+            fprintf(stderr, "Raster: %d dpi, %.1f ms, %lld bytes\n",
+                    rasterDpi, rasterTimer.nsecsElapsed() / 1e6, (long long)QFileInfo(rasterFile).size());
+        }
+        if (parser.isSet("stats")) {
+            QByteArray json = QJsonDocument(stats2json(coloring.stats)).toJson();
+            fwrite(json.constData(), 1, json.size(), stdout);
+        }
+        quickExit(EXIT_SUCCESS);
+    }
+
+    QElapsedTimer pdfTimer;
+    pdfTimer.start();
+    enum coloring_status written;
+    if (parser.isSet("solution"))
+        written = engine.write_pdf(outputFile.toLocal8Bit().constData(), parser.value("solution").toLocal8Bit().constData(),
+                                   coloring, &coloring.stats);
+    else
+        written = engine.write_pdf(outputFile.toLocal8Bit().constData(), coloring, content, &coloring.stats);
+    if (written != coloring_status::Ok) {
+        fprintf(stderr, "%s: %s\n",
+                qPrintable(QCoreApplication::translate("main", "Unable to write")),
+                qPrintable(outputFile));
+        exit(EXIT_FAILURE);
+    }
+    if (parser.isSet("verbose")) {
+        fprintf(stderr, "PDF: %dx%d cells, %.1f ms, %lld bytes\n",
+                coloring.indexes.width(), coloring.indexes.height(),
+                pdfTimer.nsecsElapsed() / 1e6, (long long)QFileInfo(outputFile).size());
+    }
+    if (parser.isSet("stats")) {
+        QByteArray json = QJsonDocument(stats2json(coloring.stats)).toJson();
+        fwrite(json.constData(), 1, json.size(), stdout);
+    }
+
+    quickExit(EXIT_SUCCESS);
+}
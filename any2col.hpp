@@ -20,9 +20,19 @@
  * any2coloring. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <QIODevice>
+#include <QLineF>
+#include <QPoint>
+#include <QPointF>
+#include <QRect>
 #include <QString>
 #include <QVector>
 
+#ifndef A2C_HEADLESS
+#include <QImage>
+#endif
+
+#include <functional>
 #include <iostream>
 #include <vector>
 
@@ -30,6 +40,11 @@
 
 #include <CImg.h>
 
+#include "stats.hpp"
+
+struct gmic;
+class Quantizer;
+
 struct color {
 	struct {
 		uint8_t R;
@@ -39,6 +54,42 @@ struct color {
 	QString name;
 };
 
+enum class color_metric {
+	RGB,	// euclidean distance in sRGB, like G'MIC
+	Lab	// euclidean distance in CIELAB (CIE76)
+};
+
+enum class nearest_search {
+	Auto,		// brute force for small palettes, k-d tree otherwise
+	BruteForce,
+	KdTree,
+	VpTree,
+	Grid		// uniform grid of color buckets
+};
+
+enum class dither_kernel {
+	FloydSteinberg,	// 4 neighbours, like G'MIC
+	Sierra		// 10 neighbours over 3 rows
+};
+
+enum class pdf_backend {
+	Qt,	// QPdfWriter and QPainter
+	Direct	// minimal PDF written from the index map (pdf_writer.hpp)
+};
+
+// Fit-to-page resize of fully decoded pictures
+enum class resize_method {
+	Native,	// area averaging, rotation in place (resize.hpp)
+	Gmic	// G'MIC "-rotate 90" and "-r2dy"/"-r2dx" (linear interpolation)
+};
+
+// Pages of a PDF document
+enum class pdf_content {
+	Sheet,	// numbered grid
+	Soluce,	// coloured cells
+	Both	// numbered grid pages, followed by the coloured ones
+};
+
 struct col_opt {
 	struct {
 		double width;
@@ -54,17 +105,231 @@ struct col_opt {
 	// Lines and text colors, as 0-255 gray level
 	uint8_t lineColor;
 	uint8_t textColor;
+	// Coloured output: draw maximal same-color rectangles, one path per color,
+	// instead of one rectangle per cell
+	bool merge_cells = true;
+#ifdef A2C_HEADLESS
+	enum pdf_backend pdf = pdf_backend::Direct;	// the only one in headless builds
+#else
+	enum pdf_backend pdf = pdf_backend::Qt;
+#endif
+	// Memory allowed for decoding buffers (bytes). 0: no limit, the picture
+	// is decoded at once and resized as below; otherwise it is streamed and
+	// box filtered straight to the grid size.
+	size_t max_memory = 0;
+	// Threads of the parallel stages of a picture (resize, quantizer,
+	// regions, page recording and rendering). 0: one per core; pictures
+	// colored at once (batch, sweep and server workers) share the cores.
+	int threads = 0;
+	struct {
+		enum resize_method method = resize_method::Native;
+		bool linear = false;	// average in linear light (native resize only)
+	} resize;
+	// Poster: the grid is sized for the whole poster and split over pages of
+	// the above size and margins
+	struct {
+		int columns = 0;	// poster size in pages...
+		int rows = 0;
+		double width = 0;	// ... or in millimeters
+		double height = 0;
+		int overlap = 2;	// cells repeated on adjacent pages
+		bool marks = true;	// registration marks and page captions
+	} poster;
+	// Palette mapping
+	struct {
+		bool native = true;	// native quantizer instead of G'MIC "-index"
+		enum color_metric metric = color_metric::RGB;
+		enum nearest_search search = nearest_search::Auto;
+		bool dithering = true;
+		enum dither_kernel kernel = dither_kernel::FloydSteinberg;	// native quantizer only
+		bool serpentine = false;	// odd rows scanned from right to left (serial), native quantizer only
+		int lut_bits = -1;	// lookup table resolution, 0: none, -1: automatic (only from the palette cache)
+	} quantizer;
+	// Paint by number: region outlines and one label per region on the
+	// numbered sheet, instead of the grid and one label per cell
+	struct {
+		bool enabled = false;
+		int min_cells = 1;	// smaller regions are merged into a neighbour (palette index changed)
+	} regions;
+};
+
+/*
+ * Palette index of every grid cell, stored row by row without padding: one
+ * byte per cell for palettes of up to 256 colors, two bytes otherwise.
+ */
+class IndexMap {
+public:
+	IndexMap() : w(0), h(0), wide(false) {}
+
+	void assign(int width, int height, int palette_size)
+	{
+		w = width;
+		h = height;
+		wide = palette_size > 256;
+		data.assign((size_t)w * h * (wide ? 2 : 1), 0);
+	}
+
+	int width() const { return w; }
+	int height() const { return h; }
+	bool is_empty() const { return data.empty(); }
+	// Two bytes per index
+	bool is_wide() const { return wide; }
+	size_t bytes() const { return data.size(); }
+
+	// Row y, T being uint8_t or uint16_t according to is_wide()
+	template <typename T>
+	T *row(int y) { return reinterpret_cast<T *>(data.data()) + (size_t)y * w; }
+	template <typename T>
+	const T *row(int y) const { return reinterpret_cast<const T *>(data.data()) + (size_t)y * w; }
+
+	int at(int x, int y) const { return wide ? row<uint16_t>(y)[x] : row<uint8_t>(y)[x]; }
+	void set(int x, int y, int index)
+	{
+		if (wide)
+			row<uint16_t>(y)[x] = index;
+		else
+			row<uint8_t>(y)[x] = index;
+	}
+
+private:
+	int w;
+	int h;
+	bool wide;
+	std::vector<uint8_t> data;
+};
+
+/*
+ * Paint by number regions (regions.hpp): 4-connected cells of the same
+ * palette index, each labelled once.
+ */
+struct region_map {
+	int width = 0;
+	std::vector<int32_t> labels;	// region of every cell, row by row
+	QVector<QPoint> label_cells;	// label position of every region
+
+	bool is_empty() const { return labels.empty(); }
+	int count() const { return label_cells.size(); }
+	int at(int x, int y) const { return labels[(size_t)y * width + x]; }
 };
 
 struct Coloring {
-	cimg_library::CImg<float> picture;
+	IndexMap indexes;
+	struct region_map regions;	// region mode only (opts.regions)
 	QVector<struct color> palette;
+	size_t decode_peak = 0;	// bytes of picture buffers used while decoding
+	struct run_stats stats;	// make_coloring() stages
+};
+
+// Picture to color: exactly one of a file, encoded data in any format Qt
+// reads (PNG or JPEG in headless builds), or decoded pixels (QtGui builds)
+struct picture_source {
+	const char *filename = nullptr;
+	QIODevice *device = nullptr;
+#ifndef A2C_HEADLESS
+	QImage const *image = nullptr;
+#endif
 };
 
+enum class coloring_status {
+	Ok,
+	BadPalette,		// unreadable, empty or not matching the quantizer
+	BadPicture,		// unreadable, or over the memory budget
+	ProcessingFailed,	// G'MIC or CImg error
+	OutputFailed		// PDF not written
+};
+
+// Part of the grid printed on a page
+struct page_tile {
+	QRect area;		// cells
+	QPointF origin;		// page position of the area top-left corner (mm)
+	int column;
+	int row;
+	int overlap;		// cells shared with neighbour pages
+	// Neighbour pages, for posters
+	bool left;
+	bool right;
+	bool top;
+	bool bottom;
+};
+
+// Label font size of every output (QPainter and direct PDF, raster), in
+// points per millimeter of cell side: 0.035 point per unit of the 1200 dpi
+// QPdfWriter device, as labels were first drawn. Captions use a 3 mm cell.
+const double LABEL_POINTS_PER_MM = 1200 / 25.4 * 0.035;
+
+// Rectangle of cells sharing the same palette index, in cells
+struct cell_rect {
+	int x;
+	int y;
+	int width;
+	int height;
+	int index;
+};
+
+
+bool is_poster(struct col_opt const &opts);
+// Number of whole cells of px_size fitting in length (at least one)
+int page_cells(double length, double px_size);
+// Area available to the picture (mm): the page minus its margins, or the
+// whole poster
+void picture_area(struct col_opt const &opts, double &width, double &height);
+// Grid size of a width x height picture, rotated by 90 degrees if landscape
+// (grid size given after rotation)
+void grid_size(int width, int height, struct col_opt const &opts, bool &rotate, int &grid_width, int &grid_height);
+
+// Single centered page, or the pages of a poster
+QVector<struct page_tile> page_tiles(struct Coloring const &coloring, struct col_opt const &opts);
+// Registration marks of a poster page, and its caption (mm, from the page
+// top-left corner)
+void poster_marks(struct col_opt const &opts, struct page_tile const &tile, QVector<QLineF> &lines, QPointF &caption_pos, QString &caption);
+
+// Palette file error; line and column start from 1, 0 if not relevant (I/O
+// errors, compiled palettes)
+struct palette_error {
+	int line = 0;
+	int column = 0;
+	QString message;
+};
 
-bool read_palette(const char *filename, QVector<struct color> &palette);
+// Text or compiled palette (palette_file.hpp). Files are mapped rather than
+// read. On error, palette is left empty and error (if not null) filled.
+bool read_palette(const char *filename, QVector<struct color> &palette, struct palette_error *error = nullptr);
+bool read_palette(QIODevice *device, QVector<struct color> &palette, struct palette_error *error = nullptr);
 void palette2CImg(QVector<struct color> const &palette, cimg_library::CImg<float> &cimg_palette);
-void make_coloring(const char *palette_csv_file, const char *original_picture, struct col_opt const &opts, struct Coloring &coloring);
-void coloring2pdf(const char *filename, struct Coloring const &coloring, struct col_opt const &opts, bool soluce = false);
+// Return false if the picture can't be read or processed
+bool make_coloring(const char *palette_csv_file, const char *original_picture, struct col_opt const &opts, struct Coloring &coloring);
+// Same as above, with an already parsed palette and a caller-owned G'MIC
+// interpreter, so that both can be reused across pictures. The interpreter
+// must not be shared between threads.
+bool make_coloring(QVector<struct color> const &palette, const char *original_picture, struct col_opt const &opts, struct Coloring &coloring, gmic &gmic_obj);
+// Same as above, with a prepared native quantizer (e.g. from the palette
+// cache) built from palette. opts.quantizer.native is not checked.
+bool make_coloring(Quantizer const &quantizer, QVector<struct color> const &palette, const char *original_picture, struct col_opt const &opts, struct Coloring &coloring, gmic &gmic_obj);
+// Full form of the functions above: the picture may be in memory, quantizer
+// is null to leave palette mapping to G'MIC. error, if not null, receives a
+// message on failure. Nothing is printed but debug messages, and nothing is
+// shared between calls but the arguments: concurrent calls are safe as long as
+// each one has its own G'MIC interpreter and output coloring.
+enum coloring_status make_coloring(struct picture_source const &source, QVector<struct color> const &palette, Quantizer const *quantizer, struct col_opt const &opts, struct Coloring &coloring, gmic &gmic_obj, QString *error = nullptr);
+// Same as above, the interpreter being asked for only when G'MIC is needed:
+// not when the picture is decoded at the grid size (max_memory) and mapped by
+// the native quantizer
+enum coloring_status make_coloring(struct picture_source const &source, QVector<struct color> const &palette, Quantizer const *quantizer, struct col_opt const &opts, struct Coloring &coloring, std::function<gmic &()> const &interpreter, QString *error = nullptr);
+// Cover width x height cells of indexes, from (x, y), with same-index
+// rectangles: horizontal runs, merged with identical runs of the following
+// rows. Rectangles don't overlap, their position is relative to (x, y).
+void merge_cell_runs(IndexMap const &indexes, int x, int y, int width, int height, QVector<struct cell_rect> &rects);
+// Write the coloring as a PDF: one page, or every page of a poster. Return
+// false if the output can't be written. Stages are added to stats if not null.
+bool coloring2pdf(const char *filename, struct Coloring const &coloring, struct col_opt const &opts, bool soluce = false, struct run_stats *stats = nullptr);
+// Same as above, to an open device (file, buffer, socket)
+bool coloring2pdf(QIODevice *device, struct Coloring const &coloring, struct col_opt const &opts, bool soluce = false, struct run_stats *stats = nullptr);
+// Sheet, solution or both in one document; the pages of both are recorded at
+// once, then written in order
+bool coloring2pdf(const char *filename, struct Coloring const &coloring, struct col_opt const &opts, enum pdf_content content, struct run_stats *stats = nullptr);
+bool coloring2pdf(QIODevice *device, struct Coloring const &coloring, struct col_opt const &opts, enum pdf_content content, struct run_stats *stats = nullptr);
+// Sheet and solution to two files, written concurrently. The solution stages
+// and counts are added to stats with a "soluce_" prefix.
+bool coloring2pdf(const char *sheet_filename, const char *soluce_filename, struct Coloring const &coloring, struct col_opt const &opts, struct run_stats *stats = nullptr);
 
 #endif /* _ANY2COL_H_ */
@@ -0,0 +1,21 @@
+# Command line program
+TEMPLATE = app
+TARGET = any2coloring
+
+include(common.pri)
+QT += network
+
+# Input
+HEADERS += \
+    batch.hpp \
+    serve.hpp \
+    sweep.hpp
+
+SOURCES += \
+    any2col.cpp \
+    batch.cpp \
+    serve.cpp \
+    sweep.cpp
+
+LIBS = -L$$OUT_PWD -lany2col $$LIBS
+PRE_TARGETDEPS += $$OUT_PWD/libany2col.a
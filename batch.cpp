@@ -0,0 +1,117 @@
+/*
+ * Copyright 2017-2022 - Geoffrey Brun <geoffrey@spekadyon.org>
+ *
+ * This file is part of any2coloring.
+ *
+ * any2coloring is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * any2coloring is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * any2coloring. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QDebug>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QTextStream>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <cstdio>
+
+#include "batch.hpp"
+#include "parallel.hpp"
+
+QString batch_output_name(QString const &input, QString const &output_dir)
+{
+	QFileInfo fileInfo(input);
+
+	return QDir(output_dir).filePath(fileInfo.completeBaseName() + ".pdf");
+}
+
+bool read_manifest(const char *filename, QString const &output_dir, QVector<struct batch_job> &jobs)
+{
+	QFile qfile(filename);
+
+	if (!qfile.open(QIODevice::ReadOnly)) {
+		qDebug() << Q_FUNC_INFO << "unable to open" << filename << qfile.errorString();
+		return false;
+	}
+
+	QTextStream textStream(&qfile);
+	QRegExp regExp("\\s+");
+	while (!textStream.atEnd()) {
+		struct batch_job job;
+		QString str = textStream.readLine().trimmed();
+		if (str.isEmpty() || str.startsWith('#'))
+			continue;
+		QStringList strList = str.split(regExp);
+		job.input = strList.at(0);
+		if (strList.size() >= 2)
+			job.output = strList.at(1);
+		else
+			job.output = batch_output_name(job.input, output_dir);
+		jobs.push_back(job);
+	}
+
+	return true;
+}
+
+int run_batch(QVector<struct batch_job> const &jobs, ColoringEngine const &engine, enum pdf_content content, int threads)
+{
+	std::atomic<int> failed(0);
+	std::vector<std::thread> workers;
+	QElapsedTimer timer;
+
+	if (threads <= 0)
+		threads = ideal_thread_count();
+	threads = std::min(threads, std::max(1, jobs.size()));
+
+	JobQueue<struct batch_job> queue(2 * threads);
+
+	timer.start();
+	for (int i = 0; i < threads; i += 1) {
+		workers.emplace_back([&]() {
+			struct batch_job job;
+			while (queue.pop(job)) {
+				struct Coloring coloring;
+				QString error;
+				if (engine.make_coloring(job.input.toLocal8Bit().constData(), coloring, &error) != coloring_status::Ok) {
+					qDebug() << Q_FUNC_INFO << job.input << "failed:" << error;
+					failed += 1;
+					continue;
+				}
+				if (engine.write_pdf(job.output.toLocal8Bit().constData(), coloring, content) != coloring_status::Ok) {
+					qDebug() << Q_FUNC_INFO << job.output << "failed";
+					failed += 1;
+				}
+			}
+		});
+	}
+
+	for (auto const &job: jobs)
+		queue.push(job);
+	queue.close();
+
+	for (auto &worker: workers)
+		worker.join();
+
+	double seconds = timer.nsecsElapsed() / 1e9;
+	int done = jobs.size() - failed.load();
+	fprintf(stderr, "%d pages in %.3f s (%.2f pages/s, %d threads), %d failed\n",
+	        done, seconds, done / seconds, threads, failed.load());
+
+	return failed.load();
+}
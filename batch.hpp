@@ -0,0 +1,45 @@
+#ifndef _BATCH_H_
+#define _BATCH_H_
+
+/*
+ * Copyright 2017-2022 - Geoffrey Brun <geoffrey@spekadyon.org>
+ *
+ * This file is part of any2coloring.
+ *
+ * any2coloring is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * any2coloring is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * any2coloring. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QString>
+#include <QVector>
+
+#include "any2col.hpp"
+#include "engine.hpp"
+
+struct batch_job {
+	QString input;
+	QString output;
+};
+
+// Read a batch manifest: one job per line, "input [output]", separated by
+// blanks. Empty lines and lines starting with '#' are ignored. Jobs without an
+// explicit output are written to output_dir, named after the input file.
+bool read_manifest(const char *filename, QString const &output_dir, QVector<struct batch_job> &jobs);
+// Output file used for an input picture when none is given
+QString batch_output_name(QString const &input, QString const &output_dir);
+
+// Process every job with a pool of worker threads (threads <= 0 means one per
+// core) sharing the engine. Returns the number of failed jobs.
+int run_batch(QVector<struct batch_job> const &jobs, ColoringEngine const &engine, enum pdf_content content, int threads);
+
+#endif /* _BATCH_H_ */
@@ -0,0 +1,1066 @@
+/*
+ * Copyright 2017-2022 - Geoffrey Brun <geoffrey@spekadyon.org>
+ *
+ * This file is part of any2coloring.
+ *
+ * any2coloring is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * any2coloring is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * any2coloring. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Pipeline benchmark: every stage is run on generated pictures and palettes,
+ * the timings are written as JSON.
+ */
+
+#include <QBuffer>
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QGuiApplication>
+#include <QImage>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#ifndef A2C_HEADLESS
+#include <QPainter>
+#include <QPdfWriter>
+#include <QStaticText>
+#endif
+#include <QProcess>
+#include <QTemporaryDir>
+#include <QTextStream>
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include <CImg.h>
+#include <gmic.h>
+
+#include "any2col.hpp"
+#include "decode.hpp"
+#include "nearest.hpp"
+#include "palette_file.hpp"
+#include "preview.hpp"
+#include "parallel.hpp"
+#include "quantize.hpp"
+#include "raster.hpp"
+#include "regions.hpp"
+#include "resize.hpp"
+#include "render.hpp"
+
+#ifndef BENCH_DATA_DIR
+#define BENCH_DATA_DIR "."
+#endif
+
+using namespace cimg_library;
+
+namespace {
+
+// Deterministic pseudo-random numbers (xorshift32)
+class Random {
+public:
+	explicit Random(uint32_t seed) : state(seed ? seed : 1) {}
+
+	uint32_t next()
+	{
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return state;
+	}
+
+private:
+	uint32_t state;
+};
+
+#ifdef A2C_HEADLESS
+// The library's image2cimg() needs QtGui, which only the benchmark links in
+// headless builds
+void image2cimg(QImage const &image, CImg<float> &picture)
+{
+	picture.assign(image.width(), image.height(), 1, 3);
+	for (int y = 0; y < image.height(); y += 1) {
+		const QRgb *line = reinterpret_cast<const QRgb *>(image.constScanLine(y));
+		for (int x = 0; x < image.width(); x += 1) {
+			picture(x, y, 0, 0) = qRed(line[x]);
+			picture(x, y, 0, 1) = qGreen(line[x]);
+			picture(x, y, 0, 2) = qBlue(line[x]);
+		}
+	}
+}
+#endif
+
+struct bench_picture {
+	QString name;
+	QImage image;
+};
+
+struct bench_palette {
+	QString name;
+	QString file;
+	QVector<struct color> palette;
+};
+
+// "smooth": gradients, like a photograph; "noise": random
+// pixels, the worst case for merged cells
+QImage make_picture(QString const &kind, int width, int height)
+{
+	QImage image(width, height, QImage::Format_RGB32);
+	Random random(width * 31 + height);
+
+	for (int y = 0; y < height; y += 1) {
+		QRgb *line = reinterpret_cast<QRgb *>(image.scanLine(y));
+		for (int x = 0; x < width; x += 1) {
+			if (kind == "noise") {
+				uint32_t value = random.next();
+				line[x] = qRgb(value & 0xff, (value >> 8) & 0xff, (value >> 16) & 0xff);
+			} else {
+				double u = (double)x / width;
+				double v = (double)y / height;
+				int R = 255 * u;
+				int G = 127.5 + 127.5 * std::sin(6.0 * v + 3.0 * u);
+				int B = 127.5 + 127.5 * std::cos(9.0 * u * v);
+				line[x] = qRgb(R, G, B);
+			}
+		}
+	}
+
+	return image;
+}
+
+// count colors spread over the RGB cube
+QVector<struct color> random_palette(int count)
+{
+	QVector<struct color> palette;
+	Random random(count);
+
+	for (int i = 0; i < count; i += 1) {
+		uint32_t value = random.next() & 0xffffff;
+		struct color Color;
+		Color.rgb.R = value >> 16;
+		Color.rgb.G = (value >> 8) & 0xff;
+		Color.rgb.B = value & 0xff;
+		Color.name = QString("%1").arg(i + 1, 3, 10, QChar('0'));
+		palette.push_back(Color);
+	}
+
+	return palette;
+}
+
+// Palette file of random_palette(count)
+bool write_palette(QString const &filename, int count)
+{
+	QFile file(filename);
+
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Text))
+		return false;
+	QTextStream stream(&file);
+	for (auto const &Color: random_palette(count)) {
+		uint32_t value = Color.rgb.R << 16 | Color.rgb.G << 8 | Color.rgb.B;
+		stream << QString("%1\t%2\n").arg(value, 6, 16, QChar('0')).arg(Color.name);
+	}
+
+	return true;
+}
+
+class Bench {
+public:
+	explicit Bench(int repeat) : repeat(repeat) {}
+
+	// Run fn repeat times (after a warm-up run if warm_up), record the
+	// timings under the given keys
+	void run(QJsonObject const &keys, std::function<void()> fn, bool warm_up = true)
+	{
+		std::vector<double> ms;
+
+		if (warm_up)
+			fn();
+		for (int i = 0; i < repeat; i += 1) {
+			QElapsedTimer timer;
+			timer.start();
+			fn();
+			ms.push_back(timer.nsecsElapsed() / 1e6);
+		}
+		std::sort(ms.begin(), ms.end());
+		double total = 0;
+		for (double value: ms)
+			total += value;
+
+		QJsonObject result = keys;
+		result["runs"] = repeat;
+		result["min_ms"] = ms.front();
+		result["median_ms"] = ms[ms.size() / 2];
+		result["mean_ms"] = total / ms.size();
+		results.append(result);
+
+		fprintf(stderr, "%-16s %-10s %-18s %10.3f ms\n",
+		        qPrintable(keys["stage"].toString()),
+		        qPrintable(keys["palette"].toString()),
+		        qPrintable(keys["picture"].toString()),
+		        ms[ms.size() / 2]);
+	}
+
+	// Add a member to the last result
+	void note(QString const &key, QJsonValue const &value)
+	{
+		QJsonObject result = results.last().toObject();
+		result[key] = value;
+		results[results.size() - 1] = result;
+	}
+
+	QJsonArray results;
+
+private:
+	int repeat;
+};
+
+QJsonObject keys(const char *stage, QString const &palette = QString(), QString const &picture = QString())
+{
+	QJsonObject json;
+
+	json["stage"] = stage;
+	if (!palette.isEmpty())
+		json["palette"] = palette;
+	if (!picture.isEmpty())
+		json["picture"] = picture;
+
+	return json;
+}
+
+/*
+ * Area averaging in linear light, in double precision and without rotation:
+ * every cell is the mean of the linear values of the source pixels it covers,
+ * weighted by the covered area, converted back to sRGB. Reference of
+ * area_resize() with linear set.
+ */
+void linear_resize_reference(CImg<float> const &picture, int width, int height, CImg<double> &grid)
+{
+	auto to_linear = [](double c) {
+		c /= 255;
+		return c <= 0.04045 ? c / 12.92 : std::pow((c + 0.055) / 1.055, 2.4);
+	};
+	auto to_srgb = [](double c) {
+		return 255 * (c <= 0.0031308 ? c * 12.92 : 1.055 * std::pow(c, 1 / 2.4) - 0.055);
+	};
+
+	CImg<double> linear(picture.width(), picture.height(), 1, picture.spectrum());
+	for (int c = 0; c < picture.spectrum(); c += 1)
+		for (int y = 0; y < picture.height(); y += 1)
+			for (int x = 0; x < picture.width(); x += 1)
+				linear(x, y, 0, c) = to_linear(picture(x, y, 0, c));
+
+	double cellWidth = (double)picture.width() / width;
+	double cellHeight = (double)picture.height() / height;
+	grid.assign(width, height, 1, picture.spectrum());
+	for (int j = 0; j < height; j += 1) {
+		double y0 = j * cellHeight, y1 = (j + 1) * cellHeight;
+		for (int i = 0; i < width; i += 1) {
+			double x0 = i * cellWidth, x1 = (i + 1) * cellWidth;
+			for (int c = 0; c < picture.spectrum(); c += 1) {
+				double sum = 0;
+				for (int y = (int)y0; y < y1 && y < picture.height(); y += 1) {
+					double wy = std::min(y1, y + 1.0) - std::max(y0, (double)y);
+					for (int x = (int)x0; x < x1 && x < picture.width(); x += 1) {
+						double wx = std::min(x1, x + 1.0) - std::max(x0, (double)x);
+						sum += wx * wy * linear(x, y, 0, c);
+					}
+				}
+				grid(i, j, 0, c) = to_srgb(sum / (cellWidth * cellHeight));
+			}
+		}
+	}
+}
+
+/*
+ * The single page of coloring rasterized at RASTER_DPI and decoded back: every
+ * cell of the solution has its palette color at its center, every cell of the
+ * sheet has a label within its borders, the same for every cell of a color,
+ * as large as the PDF one.
+ */
+bool check_raster(struct Coloring const &coloring, struct col_opt const &opts, QString &error)
+{
+	QVector<struct page_tile> tiles = page_tiles(coloring, opts);
+	QImage pages[2];
+
+	if (tiles.size() != 1) {
+		error = "not a single page";
+		return false;
+	}
+	for (bool soluce: {false, true}) {
+		QByteArray png;
+		QBuffer buffer(&png);
+		buffer.open(QIODevice::WriteOnly);
+		if (!coloring2raster(&buffer, coloring, opts, soluce, RASTER_DPI, raster_format::Png)) {
+			error = "raster failed";
+			return false;
+		}
+		pages[soluce] = QImage::fromData(png, "PNG").convertToFormat(QImage::Format_RGB32);
+	}
+
+	struct page_tile const &tile = tiles.at(0);
+	auto mm2px = [](double mm) { return (int)std::lround(mm / 25.4 * RASTER_DPI); };
+	int line = std::max(1, mm2px(opts.px_size / 20.0));
+	double cell = opts.px_size / 25.4 * RASTER_DPI;
+#ifndef A2C_HEADLESS
+	// Pixel size of the PDF font, digits are about 0.7 of it
+	double font = opts.px_size * LABEL_POINTS_PER_MM / 72.0 * RASTER_DPI;
+#endif
+	QVector<QRect> labels(coloring.palette.size());
+
+	for (int y = 0; y < tile.area.height(); y += 1) {
+		int y0 = mm2px(tile.origin.y() + y * opts.px_size);
+		int y1 = mm2px(tile.origin.y() + (y + 1) * opts.px_size);
+		for (int x = 0; x < tile.area.width(); x += 1) {
+			int x0 = mm2px(tile.origin.x() + x * opts.px_size);
+			int x1 = mm2px(tile.origin.x() + (x + 1) * opts.px_size);
+			int index = coloring.indexes.at(tile.area.x() + x, tile.area.y() + y);
+			struct color const &Color = coloring.palette.at(index);
+			QString where = QString(" at cell %1,%2").arg(x).arg(y);
+
+			QRgb center = reinterpret_cast<const QRgb *>(pages[1].constScanLine((y0 + y1) / 2))[(x0 + x1) / 2];
+			if (center != qRgb(Color.rgb.R, Color.rgb.G, Color.rgb.B)) {
+				error = "wrong solution color" + where;
+				return false;
+			}
+
+			// Label ink: anything but white past the grid lines
+			QRect ink;
+			for (int py = y0 + line; py < y1; py += 1) {
+				const QRgb *row = reinterpret_cast<const QRgb *>(pages[0].constScanLine(py));
+				for (int px = x0 + line; px < x1; px += 1) {
+					if (row[px] != qRgb(255, 255, 255))
+						ink |= QRect(px - x0, py - y0, 1, 1);
+				}
+			}
+			if (ink.isEmpty() || ink.right() >= x1 - x0 - 1 || ink.bottom() >= y1 - y0 - 1) {
+				error = "label missing or clipped" + where;
+				return false;
+			}
+			if (labels[index].isNull()) {
+#ifdef A2C_HEADLESS
+				QRect expected;
+				for (QPoint const &p: label_pixels(Color.name, std::max(1, (int)std::lround(cell))))
+					expected |= QRect(p, QSize(1, 1));
+				if (ink != expected) {
+#else
+				if (ink.height() < 0.5 * font || ink.height() > font || std::abs(ink.center().x() - cell / 2) > cell / 8) {
+#endif
+					error = QString("label of %1 out of bounds").arg(Color.name) + where;
+					return false;
+				}
+				labels[index] = ink;
+			} else if (ink != labels[index]) {
+				error = QString("label of %1 differs").arg(Color.name) + where;
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+	// Fonts for the QPainter text, without display
+	if (!qEnvironmentVariableIsSet("QT_QPA_PLATFORM"))
+		qputenv("QT_QPA_PLATFORM", "offscreen");
+	QGuiApplication app(argc, argv);
+	QCoreApplication::setApplicationName("any2coloring-bench");
+
+	QCommandLineParser parser;
+	parser.setApplicationDescription("any2coloring pipeline benchmark");
+	parser.addHelpOption();
+	parser.addOptions({
+		{{"o", "output"}, "Write the JSON results to <file> instead of the standard output", "file"},
+		{{"n", "repeat"}, "Timed runs per measurement (default: 5)", "integer"},
+		{"quick", "Small pictures only"},
+		{"quantizer", "Palette mapping engine, \"native\" or \"gmic\" (default: native)", "engine"},
+	});
+	parser.process(app);
+
+	int repeat = parser.isSet("repeat") ? parser.value("repeat").toInt() : 5;
+	if (repeat <= 0) {
+		fprintf(stderr, "Invalid repeat count\n");
+		return EXIT_FAILURE;
+	}
+
+	struct col_opt opts;
+	opts.page.width = 210;
+	opts.page.height = 297;
+	opts.margin.top = opts.margin.bottom = opts.margin.left = opts.margin.right = 5;
+	opts.px_size = 2;
+	opts.lineColor = 176;
+	opts.textColor = 80;
+	opts.quantizer.native = parser.value("quantizer") != "gmic";
+
+	QTemporaryDir tmp;
+	if (!tmp.isValid()) {
+		fprintf(stderr, "Unable to create a temporary directory\n");
+		return EXIT_FAILURE;
+	}
+
+	// Palettes: the 36 colors one shipped with the sources, generated ones
+	// for the others
+	QVector<struct bench_palette> palettes;
+	for (int count: {8, 36, 500, 2000}) {
+		struct bench_palette palette;
+		palette.name = QString::number(count);
+		palette.file = QDir(BENCH_DATA_DIR).filePath("art_grip_aquarelle_36.csv");
+		if (count != 36 || !QFile::exists(palette.file)) {
+			palette.file = tmp.filePath(QString("palette_%1.csv").arg(count));
+			if (!write_palette(palette.file, count)) {
+				fprintf(stderr, "Unable to write %s\n", qPrintable(palette.file));
+				return EXIT_FAILURE;
+			}
+		}
+		palettes.push_back(palette);
+	}
+
+	QVector<struct bench_picture> pictures;
+	QVector<QSize> sizes = {{640, 480}, {1920, 1080}};
+	if (!parser.isSet("quick"))
+		sizes.push_back(QSize(4000, 3000));
+	for (QString kind: {"smooth", "noise"}) {
+		for (QSize const &size: sizes) {
+			struct bench_picture picture;
+			picture.name = QString("%1-%2x%3").arg(kind).arg(size.width()).arg(size.height());
+			picture.image = make_picture(kind, size.width(), size.height());
+			pictures.push_back(picture);
+		}
+	}
+
+	Bench bench(repeat);
+	std::unique_ptr<gmic> gmic_obj;
+
+	bench.run(keys("gmic_init"), [&]() { gmic_obj.reset(new gmic); }, false);
+
+	// Cold start of the program, built next to the benchmark: process
+	// creation, dynamic loading and Qt initialization (--version), then a
+	// small job that needs no G'MIC interpreter (native quantizer, picture
+	// decoded at the grid size)
+	QString program = QDir(QCoreApplication::applicationDirPath()).filePath("any2coloring");
+	if (QFile::exists(program)) {
+		QString tiny = tmp.filePath("tiny.png");
+		if (!make_picture("smooth", 64, 48).save(tiny)) {
+			fprintf(stderr, "Unable to write %s\n", qPrintable(tiny));
+			return EXIT_FAILURE;
+		}
+		QStringList tinyJob = {"-p", palettes.at(1).file, "-i", tiny, "-o", tmp.filePath("tiny.pdf"),
+		                       "--pdf-writer", "direct", "--max-memory", "16"};
+		for (auto const &run: {qMakePair("cold_start_version", QStringList("--version")),
+		                       qMakePair("cold_start_job", tinyJob)}) {
+			bool ok = true;
+			bench.run(keys(run.first), [&]() {
+				QProcess process;
+				process.start(program, run.second);
+				ok = process.waitForFinished(-1) && process.exitStatus() == QProcess::NormalExit
+				     && process.exitCode() == 0 && ok;
+			});
+			if (!ok) {
+				fprintf(stderr, "%s failed\n", run.first);
+				return EXIT_FAILURE;
+			}
+		}
+	} else {
+		fprintf(stderr, "%s not found, cold start not measured\n", qPrintable(program));
+	}
+
+	// Fit-to-page resize: the native one, checked against G'MIC's moving
+	// average (the same area averaging) and identical whatever the thread
+	// count, in linear light checked against a double precision reference,
+	// and the former G'MIC interpolating chain, its difference reported
+	for (auto const &picture: pictures) {
+		CImg<float> cimg;
+		image2cimg(picture.image, cimg);
+		bool rotate;
+		int grid_width, grid_height;
+		grid_size(cimg.width(), cimg.height(), opts, rotate, grid_width, grid_height);
+
+		CImg<float> serial, grid;
+		for (int threads: {1, ideal_thread_count()}) {
+			bench.run(keys("resize_native", QString(), picture.name), [&]() {
+				area_resize(cimg, grid_width, grid_height, rotate, false, grid, threads);
+			});
+			bench.note("threads", threads);
+			if (threads == 1)
+				serial = grid;
+			else if (serial != grid) {
+				fprintf(stderr, "Resize differs with %d threads: %s\n", threads, qPrintable(picture.name));
+				return EXIT_FAILURE;
+			}
+		}
+		CImg<float> linear;
+		bench.run(keys("resize_native_linear", QString(), picture.name), [&]() {
+			area_resize(cimg, grid_width, grid_height, rotate, true, linear);
+		});
+		CImg<double> linearReference;
+		linear_resize_reference(rotate ? cimg.get_rotate(90) : cimg, grid_width, grid_height, linearReference);
+		double linearDiff = linear.is_sameXYZC(linearReference) ? (CImg<double>(linear) - linearReference).abs().max() : 1e9;
+		bench.note("max_diff", linearDiff);
+		if (linearDiff > 0.05) {
+			fprintf(stderr, "Linear light resize differs from the reference by %g: %s\n", linearDiff, qPrintable(picture.name));
+			return EXIT_FAILURE;
+		}
+
+		QByteArray reference = QString::asprintf("-local[0] -if {w>h} -rotate 90 -endif -resize %d,%d,1,3,2 -endlocal",
+		                                         grid_width, grid_height).toUtf8();
+		CImgList<float> list(1);
+		CImgList<char> names(1);
+		bench.run(keys("resize_gmic_average", QString(), picture.name), [&]() {
+			list[0] = cimg;
+			gmic_obj->run(reference.constData(), list, names);
+		});
+		double diff = list[0].is_sameXYZC(grid) ? (list[0] - grid).abs().max() : 1e9;
+		bench.note("max_diff", diff);
+		if (diff > 0.05) {
+			fprintf(stderr, "Native resize differs from G'MIC by %g: %s\n", diff, qPrintable(picture.name));
+			return EXIT_FAILURE;
+		}
+
+		double pic_width, pic_height;
+		picture_area(opts, pic_width, pic_height);
+		QByteArray chain = QString::asprintf("-local[0] -if {w>h} -rotate 90 -endif -if {h/w>%g} -r2dy {int(%g)} -else -r2dx {int(%g)} -endif -endlocal",
+		                                     pic_height/pic_width, pic_height/opts.px_size, pic_width/opts.px_size).toUtf8();
+		bench.run(keys("resize_gmic", QString(), picture.name), [&]() {
+			list[0] = cimg;
+			gmic_obj->run(chain.constData(), list, names);
+		});
+		// Interpolation instead of averaging: reported, not checked
+		if (list[0].is_sameXYZC(grid))
+			bench.note("max_diff", (list[0] - grid).abs().max());
+		else
+			bench.note("size", QString("%1x%2").arg(list[0].width()).arg(list[0].height()));
+	}
+
+	static const struct {
+		const char *name;
+		enum nearest_search search;
+	} searches[] = {
+		{"brute", nearest_search::BruteForce},
+		{"kdtree", nearest_search::KdTree},
+		{"vptree", nearest_search::VpTree},
+		{"grid", nearest_search::Grid},
+	};
+
+	// Nearest color searches against brute force on the hard cases: both
+	// metrics, plain and dithered, inputs on, between and off the 8-bit
+	// levels, palettes with duplicate colors and with colors equidistant
+	// from many inputs (a 16 levels lattice, inputs halfway)
+	{
+		QVector<struct color> lattice, duplicates;
+		for (int i = 0; i < 16 * 16 * 16; i += 1) {
+			struct color Color;
+			Color.rgb.R = (i >> 8) * 16;
+			Color.rgb.G = ((i >> 4) & 15) * 16;
+			Color.rgb.B = (i & 15) * 16;
+			Color.name = QString::number(i);
+			lattice.push_back(Color);
+		}
+		// Every color twice, ties go to the first one
+		duplicates = random_palette(150);
+		duplicates += random_palette(150);
+
+		Random random(3);
+		CImg<float> input(256, 256, 1, 3);
+		for (int c = 0; c < 3; c += 1) {
+			for (int y = 0; y < input.height(); y += 1) {
+				for (int x = 0; x < input.width(); x += 1) {
+					uint32_t value = random.next();
+					switch (value % 3) {
+					case 0: input(x, y, 0, c) = (value >> 8) % 15 * 16 + 8; break;	// halfway
+					case 1: input(x, y, 0, c) = (value >> 8) % 16 * 16; break;	// on a level
+					default: input(x, y, 0, c) = (value >> 8) % 25500 / 100.0f + 0.005f; break;
+					}
+				}
+			}
+		}
+
+		for (enum color_metric metric: {color_metric::RGB, color_metric::Lab}) {
+			for (auto const &palette: {qMakePair(QString("lattice"), lattice), qMakePair(QString("duplicates"), duplicates)}) {
+				for (bool dithering: {false, true}) {
+					IndexMap reference;
+					for (auto const &search: searches) {
+						Quantizer quantizer(palette.second, metric);
+						quantizer.set_search(search.search);
+						IndexMap indexes;
+						quantizer.index(input, indexes, dithering);
+						if (search.search == nearest_search::BruteForce) {
+							reference = indexes;
+						} else if (memcmp(reference.row<uint8_t>(0), indexes.row<uint8_t>(0), indexes.bytes())) {
+							fprintf(stderr, "Nearest color search %s differs from brute force: %s palette, %s%s\n", search.name,
+							        qPrintable(palette.first), metric == color_metric::Lab ? "Lab" : "RGB", dithering ? ", dithered" : "");
+							return EXIT_FAILURE;
+						}
+					}
+				}
+			}
+		}
+	}
+
+	// Brute force against the k-d tree by palette size: KDTREE_MIN_COLORS
+	// should be about the smallest size where the tree is faster
+	{
+		CImg<float> cimg;
+		image2cimg(pictures.first().image, cimg);
+		int crossover = 0;
+		for (int count: {32, 64, 128, 256, 512, 1024}) {
+			QVector<struct color> colors = random_palette(count);
+			double ms[2];
+			for (int tree = 0; tree < 2; tree += 1) {
+				Quantizer quantizer(colors, opts.quantizer.metric);
+				quantizer.set_search(tree ? nearest_search::KdTree : nearest_search::BruteForce);
+				IndexMap indexes;
+				bench.run(keys("nearest_crossover", QString::number(count), pictures.first().name), [&]() {
+					quantizer.index(cimg, indexes, false);
+				});
+				bench.note("search", tree ? "kdtree" : "brute");
+				ms[tree] = bench.results.last().toObject()["median_ms"].toDouble();
+			}
+			if (!crossover && ms[1] < ms[0])
+				crossover = count;
+		}
+		bench.note("crossover", crossover);
+		bench.note("kdtree_min_colors", KDTREE_MIN_COLORS);
+		fprintf(stderr, "k-d tree faster from %d colors (KDTREE_MIN_COLORS: %d)\n", crossover, KDTREE_MIN_COLORS);
+	}
+
+	// Palette parser: "#" starts a color only before 6 hexadecimal digits and
+	// a blank, other "#" lines are comments
+	{
+		const char text[] =
+			"#add more colors\n"
+			"#face colors first\n"
+			"#Blue pencils\n"
+			"#ff0000 red\n"
+			"00ff00 green\n"
+			"0x0000ff blue\n";
+		QVector<struct color> colors;
+		struct palette_error error;
+		bool ok = parse_palette(text, sizeof(text) - 1, colors, &error)
+		          && colors.size() == 3
+		          && colors[0].name == "red" && colors[0].rgb.R == 0xff && colors[0].rgb.G == 0 && colors[0].rgb.B == 0
+		          && colors[1].name == "green" && colors[1].rgb.G == 0xff
+		          && colors[2].name == "blue" && colors[2].rgb.B == 0xff;
+		if (!ok) {
+			fprintf(stderr, "Palette comments parsed as colors (%d colors, line %d: %s)\n",
+			        colors.size(), error.line, qPrintable(error.message));
+			return EXIT_FAILURE;
+		}
+	}
+
+	for (auto &palette: palettes) {
+		bench.run(keys("read_palette", palette.name), [&]() {
+			palette.palette.clear();
+			read_palette(palette.file.toLocal8Bit().constData(), palette.palette);
+		});
+		QString compiled = tmp.filePath(QString("palette_%1.a2cpal").arg(palette.name));
+		if (!write_compiled_palette(compiled.toLocal8Bit().constData(), palette.palette)) {
+			fprintf(stderr, "Unable to write %s\n", qPrintable(compiled));
+			return EXIT_FAILURE;
+		}
+		bench.run(keys("read_palette_compiled", palette.name), [&]() {
+			QVector<struct color> colors;
+			read_palette(compiled.toLocal8Bit().constData(), colors);
+		});
+		CImg<float> cimg_palette;
+		bench.run(keys("palette2CImg", palette.name), [&]() { palette2CImg(palette.palette, cimg_palette); });
+
+		std::unique_ptr<Quantizer> quantizer;
+		if (opts.quantizer.native)
+			quantizer.reset(new Quantizer(palette.palette, opts.quantizer.metric));
+
+		// Nearest color search methods, checked against brute force
+		if (quantizer) {
+			for (auto const &picture: pictures) {
+				if (picture.image.width() * picture.image.height() > 1920 * 1080)
+					continue;
+				CImg<float> cimg;
+				image2cimg(picture.image, cimg);
+				IndexMap reference;
+				for (auto const &search: searches) {
+					Quantizer searchQuantizer(palette.palette, opts.quantizer.metric);
+					searchQuantizer.set_search(search.search);
+					IndexMap indexes;
+					bench.run(keys("nearest", palette.name, picture.name), [&]() {
+						searchQuantizer.index(cimg, indexes, false);
+					});
+					bench.note("search", search.name);
+					if (search.search == nearest_search::BruteForce) {
+						reference = indexes;
+					} else if (memcmp(reference.row<uint8_t>(0), indexes.row<uint8_t>(0), indexes.bytes())) {
+						fprintf(stderr, "Nearest color search %s differs from brute force: %s\n", search.name, qPrintable(picture.name));
+						return EXIT_FAILURE;
+					}
+				}
+			}
+		}
+
+		// Native quantizer against G'MIC "-index", with and without dithering:
+		// same indexes with the RGB metric
+		for (auto const &picture: pictures) {
+			if (picture.image.width() * picture.image.height() > 640 * 480)
+				continue;
+			CImg<float> cimg;
+			image2cimg(picture.image, cimg);
+			Quantizer rgbQuantizer(palette.palette, color_metric::RGB);
+			for (bool dithering: {false, true}) {
+				CImgList<float> list(2);
+				CImgList<char> names(2);
+				list[0] = cimg;
+				list[1] = cimg_palette;
+				QByteArray command = QString::asprintf("-index.. .,%d", dithering ? 1 : 0).toUtf8();
+				gmic_obj->run(command.constData(), list, names);
+				IndexMap reference, indexes;
+				reference.assign(list[0].width(), list[0].height(), palette.palette.size());
+				for (int y = 0; y < list[0].height(); y += 1) {
+					for (int x = 0; x < list[0].width(); x += 1)
+						reference.set(x, y, list[0](x, y, 0));
+				}
+				rgbQuantizer.index(cimg, indexes, dithering);
+				if (reference.width() != indexes.width() || reference.height() != indexes.height()
+				    || memcmp(reference.row<uint8_t>(0), indexes.row<uint8_t>(0), indexes.bytes())) {
+					fprintf(stderr, "Native quantizer differs from G'MIC%s: %s palette, %s\n",
+					        dithering ? " (dithered)" : "", qPrintable(palette.name), qPrintable(picture.name));
+					return EXIT_FAILURE;
+				}
+			}
+		}
+
+		// Preview, end to end: from a JPEG photo to the PNG
+		if (palette.name == "36") {
+			for (auto const &picture: pictures) {
+				if (!picture.name.startsWith("smooth"))
+					continue;
+				QByteArray jpeg;
+				QBuffer jpegBuffer(&jpeg);
+				jpegBuffer.open(QIODevice::WriteOnly);
+				picture.image.save(&jpegBuffer, "JPEG", 90);
+				struct col_opt previewOpts = opts;
+				previewOpts.max_memory = PREVIEW_MEMORY;
+				bool ok = true;
+				QByteArray png;
+				bench.run(keys("preview", palette.name, picture.name), [&]() {
+					struct picture_source source;
+					struct Coloring coloring;
+					QBuffer input;
+					QBuffer output(&png);
+					input.setData(jpeg);
+					input.open(QIODevice::ReadOnly);
+					source.device = &input;
+					png.clear();
+					output.open(QIODevice::WriteOnly);
+					ok = make_coloring(source, palette.palette, quantizer.get(), previewOpts, coloring, *gmic_obj) == coloring_status::Ok
+					     && coloring2preview(&output, coloring, previewOpts, true, PREVIEW_SIZE) && ok;
+				});
+				bench.note("bytes", png.size());
+				if (!ok) {
+					fprintf(stderr, "Preview failed: %s\n", qPrintable(picture.name));
+					return EXIT_FAILURE;
+				}
+			}
+		}
+
+		// Dithering alone, at picture size: one thread against all cores, and
+		// against plain quantization (plain_ratio: dithering time over plain
+		// quantization time, same thread count)
+		if (quantizer && palette.name == "36") {
+			for (auto const &picture: pictures) {
+				CImg<float> cimg;
+				image2cimg(picture.image, cimg);
+				double plainMs[2];
+				for (int threads: {1, ideal_thread_count()}) {
+					IndexMap indexes;
+					bench.run(keys("quantize_plain", palette.name, picture.name), [&]() {
+						quantizer->index(cimg, indexes, false, dither_kernel::FloydSteinberg, false, threads);
+					});
+					bench.note("threads", threads);
+					plainMs[threads != 1] = bench.results.last().toObject()["median_ms"].toDouble();
+				}
+				for (enum dither_kernel kernel: {dither_kernel::FloydSteinberg, dither_kernel::Sierra}) {
+					IndexMap serial;
+					for (int threads: {1, ideal_thread_count()}) {
+						IndexMap indexes;
+						bench.run(keys("dither", palette.name, picture.name), [&]() {
+							quantizer->index(cimg, indexes, true, kernel, false, threads);
+						});
+						bench.note("kernel", kernel == dither_kernel::Sierra ? "sierra" : "fs");
+						bench.note("threads", threads);
+						double ratio = bench.results.last().toObject()["median_ms"].toDouble() / plainMs[threads != 1];
+						bench.note("plain_ratio", ratio);
+						fprintf(stderr, "Dithering (%s, %d threads): %.2f times plain quantization\n",
+						        kernel == dither_kernel::Sierra ? "sierra" : "fs", threads, ratio);
+						// The wavefront must not depend on the thread count
+						if (threads == 1) {
+							serial = indexes;
+						} else if (memcmp(serial.row<uint8_t>(0), indexes.row<uint8_t>(0), indexes.bytes())) {
+							fprintf(stderr, "Dithering differs with %d threads: %s\n", threads, qPrintable(picture.name));
+							return EXIT_FAILURE;
+						}
+					}
+				}
+			}
+		}
+
+		for (auto const &picture: pictures) {
+			struct picture_source source;
+			struct Coloring coloring;
+			bool ok = true;
+#ifdef A2C_HEADLESS
+			// Decoded pictures need QtGui: from a PNG, decoded at the grid
+			// size, instead
+			QByteArray png;
+			QBuffer pngBuffer(&png);
+			pngBuffer.open(QIODevice::WriteOnly);
+			picture.image.save(&pngBuffer, "PNG");
+			bench.run(keys("make_coloring", palette.name, picture.name), [&]() {
+				QBuffer input;
+				input.setData(png);
+				input.open(QIODevice::ReadOnly);
+				source.device = &input;
+				ok = make_coloring(source, palette.palette, quantizer.get(), opts, coloring, *gmic_obj) == coloring_status::Ok && ok;
+			});
+			bench.note("input", "png");
+#else
+			source.image = &picture.image;
+			bench.run(keys("make_coloring", palette.name, picture.name), [&]() {
+				ok = make_coloring(source, palette.palette, quantizer.get(), opts, coloring, *gmic_obj) == coloring_status::Ok && ok;
+			});
+#endif
+			if (!ok) {
+				fprintf(stderr, "Coloring failed: %s\n", qPrintable(picture.name));
+				return EXIT_FAILURE;
+			}
+
+			for (enum pdf_backend backend: {pdf_backend::Qt, pdf_backend::Direct}) {
+				struct col_opt pdfOpts = opts;
+				pdfOpts.pdf = backend;
+				for (bool soluce: {false, true}) {
+					QByteArray pdf;
+					bench.run(keys(soluce ? "coloring2pdf_color" : "coloring2pdf_grid", palette.name, picture.name), [&]() {
+						QBuffer buffer(&pdf);
+						pdf.clear();
+						buffer.open(QIODevice::WriteOnly);
+						coloring2pdf(&buffer, coloring, pdfOpts, soluce);
+					});
+					bench.note("writer", backend == pdf_backend::Qt ? "qt" : "direct");
+					bench.note("bytes", pdf.size());
+				}
+				// Sheet and solution pages recorded at once, in one document
+				QByteArray pdf;
+				bench.run(keys("coloring2pdf_both", palette.name, picture.name), [&]() {
+					QBuffer buffer(&pdf);
+					pdf.clear();
+					buffer.open(QIODevice::WriteOnly);
+					coloring2pdf(&buffer, coloring, pdfOpts, pdf_content::Both);
+				});
+				bench.note("writer", backend == pdf_backend::Qt ? "qt" : "direct");
+				bench.note("bytes", pdf.size());
+			}
+
+			// Print resolution rasters, streamed to memory
+			for (enum raster_format format: {raster_format::Png, raster_format::Tiff}) {
+				QByteArray raster;
+				bench.run(keys("coloring2raster", palette.name, picture.name), [&]() {
+					QBuffer buffer(&raster);
+					raster.clear();
+					buffer.open(QIODevice::WriteOnly);
+					coloring2raster(&buffer, coloring, opts, false, RASTER_DPI, format);
+				});
+				bench.note("format", format == raster_format::Png ? "png" : "tiff");
+				bench.note("bytes", raster.size());
+			}
+			QString error;
+			if (!check_raster(coloring, opts, error)) {
+				fprintf(stderr, "Raster check failed, %s: %s\n", qPrintable(error), qPrintable(picture.name));
+				return EXIT_FAILURE;
+			}
+
+#ifndef A2C_HEADLESS
+			// Page bands, identical whatever the thread count: the speedup
+			// of the QPdfWriter recording stage
+			{
+				QVector<struct page_tile> tiles = page_tiles(coloring, opts);
+				std::vector<std::vector<struct page_drawing>> serial, pages;
+				for (int threads: {1, ideal_thread_count()}) {
+					int bands = 0;
+					bench.run(keys("pdf_record", palette.name, picture.name), [&]() {
+						bands = record_pages(pages, tiles, coloring, opts, pdf_content::Both, 1200, threads);
+					});
+					bench.note("threads", threads);
+					bench.note("bands", bands);
+					if (threads == 1) {
+						serial = pages;
+						continue;
+					}
+					bool same = serial.size() == pages.size();
+					for (size_t i = 0; same && i < pages.size(); i += 1) {
+						same = serial[i].size() == pages[i].size();
+						for (size_t b = 0; same && b < pages[i].size(); b += 1) {
+							struct page_drawing const &a = serial[i][b], &d = pages[i][b];
+							same = a.fills == d.fills && a.cells == d.cells && a.grid == d.grid
+							       && a.labels == d.labels && a.marks == d.marks && a.captions == d.captions;
+						}
+					}
+					if (!same) {
+						fprintf(stderr, "Page bands differ with %d threads: %s\n", threads, qPrintable(picture.name));
+						return EXIT_FAILURE;
+					}
+				}
+
+				// Merged cells joined across bands: the rectangles of the
+				// whole page merged at once
+				auto before = [](struct cell_rect const &a, struct cell_rect const &b) {
+					return a.y != b.y ? a.y < b.y : a.x < b.x;
+				};
+				int rects = 0;
+				for (size_t i = tiles.size(); opts.merge_cells && i < serial.size(); i += 1) {
+					struct page_tile const &tile = tiles.at(i % tiles.size());
+					QVector<struct cell_rect> joined = serial[i].front().rects, whole;
+					merge_cell_runs(coloring.indexes, tile.area.x(), tile.area.y(), tile.area.width(), tile.area.height(), whole);
+					std::sort(joined.begin(), joined.end(), before);
+					std::sort(whole.begin(), whole.end(), before);
+					bool same = joined.size() == whole.size();
+					for (int k = 0; same && k < joined.size(); k += 1)
+						same = joined[k].x == whole[k].x && joined[k].y == whole[k].y && joined[k].width == whole[k].width
+						       && joined[k].height == whole[k].height && joined[k].index == whole[k].index;
+					if (!same) {
+						fprintf(stderr, "Merged cells differ from the whole page merge (%d rectangles, %d expected): %s\n",
+						        joined.size(), whole.size(), qPrintable(picture.name));
+						return EXIT_FAILURE;
+					}
+					rects += joined.size();
+				}
+				bench.note("rects", rects);
+
+				// Labels of the page with the most, as QStaticText (laid out
+				// again by the PDF engine for every cell) against the glyph
+				// runs of replay_page()
+				size_t largest = 0;
+				auto page_labels = [&](size_t i) {
+					int count = 0;
+					for (auto const &band: serial[i])
+						count += band.labels.size();
+					return count;
+				};
+				for (size_t i = 1; i < serial.size(); i += 1) {
+					if (page_labels(i) > page_labels(largest))
+						largest = i;
+				}
+				for (bool glyphRuns: {false, true}) {
+					QByteArray pdf;
+					bench.run(keys("pdf_labels", palette.name, picture.name), [&]() {
+						QBuffer buffer(&pdf);
+						pdf.clear();
+						buffer.open(QIODevice::WriteOnly);
+						QPdfWriter writer(&buffer);
+						writer.setPageSize(QPageSize(QSizeF(opts.page.width, opts.page.height), QPageSize::Millimeter));
+						QPainter painter(&writer);
+						struct render_style style;
+						prepare_style(style, coloring, opts, writer.resolution(), painter);
+						// Prepared once per palette entry, as before
+						QVector<QStaticText> texts;
+						for (auto const &Color: coloring.palette) {
+							texts.push_back(QStaticText(Color.name));
+							texts.back().setTextFormat(Qt::PlainText);
+							texts.back().prepare(painter.transform(), style.font);
+						}
+						painter.setFont(style.font);
+						painter.setPen(style.penFonts);
+						for (auto const &band: serial[largest]) {
+							if (glyphRuns) {
+								struct page_drawing labels;
+								labels.labels = band.labels;
+								replay_page(painter, labels, style);
+								continue;
+							}
+							for (auto const &label: band.labels)
+								painter.drawStaticText(label.first + style.labelOffsets.at(label.second), texts.at(label.second));
+						}
+					});
+					bench.note("labels", glyphRuns ? "glyph_runs" : "static_text");
+					bench.note("count", page_labels(largest));
+					bench.note("bytes", pdf.size());
+				}
+			}
+#endif
+
+			// Paint by number regions, identical whatever the thread count
+			struct Coloring regions = coloring;
+			struct col_opt regionOpts = opts;
+			regionOpts.pdf = pdf_backend::Direct;
+			regionOpts.regions.enabled = true;
+			regionOpts.regions.min_cells = 4;
+			struct region_map serial;
+			for (int threads: {1, ideal_thread_count()}) {
+				bench.run(keys("regions", palette.name, picture.name), [&]() {
+					regions.indexes = coloring.indexes;
+					find_regions(regions.indexes, regionOpts.regions.min_cells, regions.regions, threads);
+				});
+				bench.note("threads", threads);
+				bench.note("regions", regions.regions.count());
+				if (threads == 1)
+					serial = regions.regions;
+				else if (serial.labels != regions.regions.labels || serial.label_cells != regions.regions.label_cells) {
+					fprintf(stderr, "Regions differ with %d threads: %s\n", threads, qPrintable(picture.name));
+					return EXIT_FAILURE;
+				}
+			}
+			QByteArray pdf;
+			bench.run(keys("coloring2pdf_regions", palette.name, picture.name), [&]() {
+				QBuffer buffer(&pdf);
+				pdf.clear();
+				buffer.open(QIODevice::WriteOnly);
+				coloring2pdf(&buffer, regions, regionOpts, false);
+			});
+			bench.note("writer", "direct");
+			bench.note("bytes", pdf.size());
+		}
+	}
+
+	QJsonObject json;
+	json["version"] = 1;
+	json["date"] = QDateTime::currentDateTimeUtc().toString(Qt::ISODate);
+	json["threads"] = ideal_thread_count();
+	json["quantizer"] = opts.quantizer.native ? "native" : "gmic";
+#ifdef A2C_HEADLESS
+	json["headless"] = true;
+#else
+	json["headless"] = false;
+#endif
+	json["results"] = bench.results;
+	QByteArray data = QJsonDocument(json).toJson();
+
+	if (parser.isSet("output")) {
+		QFile file(parser.value("output"));
+		if (!file.open(QIODevice::WriteOnly) || file.write(data) != data.size()) {
+			fprintf(stderr, "Unable to write %s\n", qPrintable(parser.value("output")));
+			return EXIT_FAILURE;
+		}
+	} else {
+		fwrite(data.constData(), 1, data.size(), stdout);
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,16 @@
+# Pipeline benchmark
+TEMPLATE = app
+TARGET = any2coloring-bench
+
+include(common.pri)
+# Test pictures are drawn with QImage, even in headless builds
+QT += gui
+
+DEFINES += BENCH_DATA_DIR=\\\"$$PWD\\\"
+
+# Input
+SOURCES += \
+    bench.cpp
+
+LIBS = -L$$OUT_PWD -lany2col $$LIBS
+PRE_TARGETDEPS += $$OUT_PWD/libany2col.a
@@ -0,0 +1,26 @@
+# Settings shared by the library and the program
+INCLUDEPATH += $$PWD
+QT += core gui
+
+CONFIG += \
+    link_pkgconfig \
+    c++17
+
+
+DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
+
+# qmake CONFIG+=no_stats: no per stage instrumentation
+no_stats: DEFINES += A2C_NO_STATS
+
+# qmake CONFIG+=headless: no X11 (CImg display), QtGui nor QPainter PDF
+# output, for servers and containers. Pictures are decoded by libpng, libjpeg
+# and CImg.
+headless {
+    QT -= gui
+    DEFINES += A2C_HEADLESS cimg_display=0
+} else {
+    PKGCONFIG += x11
+}
+
+LIBS += -lgmic
+PKGCONFIG += libpng libjpeg
@@ -0,0 +1,614 @@
+/*
+ * Copyright 2017-2022 - Geoffrey Brun <geoffrey@spekadyon.org>
+ *
+ * This file is part of any2coloring.
+ *
+ * any2coloring is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * any2coloring is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * any2coloring. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QObject>
+
+#ifndef A2C_HEADLESS
+#include <QBuffer>
+#include <QImage>
+#include <QImageIOHandler>
+#include <QImageReader>
+#endif
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include <csetjmp>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include <jpeglib.h>
+#include <png.h>
+
+#include "decode.hpp"
+#include "parallel.hpp"
+
+using namespace cimg_library;
+
+namespace {
+
+/*
+ * Box filter: every source pixel is added to the grid cells it covers (one
+ * cell when downscaling). Sums are kept in the grid orientation of the source.
+ */
+class BoxAccumulator {
+public:
+	BoxAccumulator(int width, int height, int grid_width, int grid_height) :
+		gridWidth(grid_width),
+		gridHeight(grid_height),
+		sums((size_t)grid_width * grid_height * 3),
+		counts((size_t)grid_width * grid_height),
+		cellX0(width), cellX1(width),
+		cellY0(height), cellY1(height)
+	{
+		cover(width, grid_width, cellX0, cellX1);
+		cover(height, grid_height, cellY0, cellY1);
+	}
+
+	size_t bytes() const
+	{
+		return sums.size() * sizeof(double) + counts.size() * sizeof(uint32_t)
+				+ (cellX0.size() + cellX1.size() + cellY0.size() + cellY1.size()) * sizeof(int);
+	}
+
+	// pixel(x, R, G, B) gives the color of pixel x of row y
+	template <typename Pixel>
+	void add_row(int y, Pixel pixel)
+	{
+		for (int x = 0; x < (int)cellX0.size(); x += 1) {
+			int R, G, B;
+			pixel(x, R, G, B);
+			for (int cy = cellY0[y]; cy < cellY1[y]; cy += 1) {
+				for (int cx = cellX0[x]; cx < cellX1[x]; cx += 1) {
+					size_t cell = (size_t)cy * gridWidth + cx;
+					sums[3*cell] += R;
+					sums[3*cell + 1] += G;
+					sums[3*cell + 2] += B;
+					counts[cell] += 1;
+				}
+			}
+		}
+	}
+
+	// Averages, rotated by 90 degrees clockwise if asked
+	void result(CImg<float> &grid, bool rotate) const
+	{
+		if (rotate)
+			grid.assign(gridHeight, gridWidth, 1, 3);
+		else
+			grid.assign(gridWidth, gridHeight, 1, 3);
+		for (int cy = 0; cy < gridHeight; cy += 1) {
+			for (int cx = 0; cx < gridWidth; cx += 1) {
+				size_t cell = (size_t)cy * gridWidth + cx;
+				int x = rotate ? gridHeight - 1 - cy : cx;
+				int y = rotate ? cx : cy;
+				for (int c = 0; c < 3; c += 1)
+					grid(x, y, 0, c) = counts[cell] ? sums[3*cell + c] / counts[cell] : 0;
+			}
+		}
+	}
+
+private:
+	// Cells [first[i], last[i]) covered by source pixel i
+	static void cover(int length, int cells, std::vector<int> &first, std::vector<int> &last)
+	{
+		for (int i = 0; i < length; i += 1) {
+			first[i] = (int)((int64_t)i * cells / length);
+			last[i] = std::max(first[i] + 1, (int)((int64_t)(i + 1) * cells / length));
+		}
+	}
+
+	int gridWidth;
+	int gridHeight;
+	std::vector<double> sums;
+	std::vector<uint32_t> counts;
+	std::vector<int> cellX0;
+	std::vector<int> cellX1;
+	std::vector<int> cellY0;
+	std::vector<int> cellY1;
+};
+
+enum load_status {
+	LOAD_OK,
+	LOAD_FAILED,
+	LOAD_UNSUPPORTED	// not handled here, try another decoder
+};
+
+QString budget_error(size_t needed, size_t budget)
+{
+	return QObject::tr("decoding needs %1 MiB, more than the %2 MiB allowed")
+			.arg(needed / 1048576.0, 0, 'f', 1)
+			.arg(budget / 1048576.0, 0, 'f', 1);
+}
+
+// Encoded picture in memory, read from offset
+struct memory_data {
+	const uchar *data;
+	size_t size;
+	size_t offset;
+};
+
+// State modified after setjmp() lives on the heap
+struct png_state {
+	std::unique_ptr<BoxAccumulator> accumulator;
+	std::vector<png_byte> rows;
+	std::vector<png_bytep> pointers;
+	bool rotate;
+};
+
+void png_read_memory(png_structp png, png_bytep data, png_size_t length)
+{
+	struct memory_data *memory = static_cast<struct memory_data *>(png_get_io_ptr(png));
+
+	if (length > memory->size - memory->offset)
+		png_error(png, "truncated PNG");
+	memcpy(data, memory->data + memory->offset, length);
+	memory->offset += length;
+}
+
+// PNG from fp or memory (the other one is null): read row by row, or at once
+// if interlaced
+enum load_status load_png(FILE *fp, struct memory_data *memory, struct col_opt const &opts, size_t budget, CImg<float> &grid, size_t &peak, int64_t &pixels, QString &error)
+{
+	png_byte signature[8];
+	if (memory) {
+		if (memory->size < sizeof(signature))
+			return LOAD_UNSUPPORTED;
+		memcpy(signature, memory->data, sizeof(signature));
+		memory->offset = sizeof(signature);
+	} else if (fread(signature, 1, sizeof(signature), fp) != sizeof(signature)) {
+		return LOAD_UNSUPPORTED;
+	}
+	if (png_sig_cmp(signature, 0, sizeof(signature)))
+		return LOAD_UNSUPPORTED;
+
+	png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+	png_infop info = png ? png_create_info_struct(png) : nullptr;
+	std::unique_ptr<png_state> state(new png_state);
+	if (!info) {
+		png_destroy_read_struct(&png, nullptr, nullptr);
+		error = QObject::tr("out of memory");
+		return LOAD_FAILED;
+	}
+	if (setjmp(png_jmpbuf(png))) {
+		png_destroy_read_struct(&png, &info, nullptr);
+		error = QObject::tr("PNG decoding error");
+		return LOAD_FAILED;
+	}
+
+	if (memory)
+		png_set_read_fn(png, memory, png_read_memory);
+	else
+		png_init_io(png, fp);
+	png_set_sig_bytes(png, sizeof(signature));
+	png_read_info(png, info);
+	bool interlaced = png_get_interlace_type(png, info) != PNG_INTERLACE_NONE;
+	// 8-bit RGB, like CImg drops the alpha channel
+	png_set_expand(png);
+	png_set_strip_16(png);
+	png_set_strip_alpha(png);
+	png_set_gray_to_rgb(png);
+	png_set_interlace_handling(png);
+	png_read_update_info(png, info);
+
+	int width = png_get_image_width(png, info);
+	int height = png_get_image_height(png, info);
+	size_t rowBytes = png_get_rowbytes(png, info);
+	size_t rows = interlaced ? height : 1;
+	pixels = (int64_t)width * height;
+	int grid_width, grid_height;
+	grid_size(width, height, opts, state->rotate, grid_width, grid_height);
+	if (state->rotate)
+		std::swap(grid_width, grid_height);
+	state->accumulator.reset(new BoxAccumulator(width, height, grid_width, grid_height));
+	size_t needed = state->accumulator->bytes() + rowBytes * rows;
+	if (needed > budget) {
+		png_destroy_read_struct(&png, &info, nullptr);
+		error = budget_error(needed, budget);
+		return LOAD_FAILED;
+	}
+	peak = needed;
+
+	state->rows.resize(rowBytes * rows);
+	if (interlaced) {
+		// Every pass goes through the whole picture
+		for (int y = 0; y < height; y += 1)
+			state->pointers.push_back(state->rows.data() + y * rowBytes);
+		png_read_image(png, state->pointers.data());
+	}
+	for (int y = 0; y < height; y += 1) {
+		const png_byte *row = state->rows.data();
+		if (interlaced)
+			row += y * rowBytes;
+		else
+			png_read_row(png, state->rows.data(), nullptr);
+		state->accumulator->add_row(y, [row](int x, int &R, int &G, int &B) {
+			R = row[3*x];
+			G = row[3*x + 1];
+			B = row[3*x + 2];
+		});
+	}
+	png_destroy_read_struct(&png, &info, nullptr);
+
+	state->accumulator->result(grid, state->rotate);
+	return LOAD_OK;
+}
+
+// libjpeg errors jump back to the decoder
+struct jpeg_failure {
+	struct jpeg_error_mgr manager;
+	jmp_buf jump;
+};
+
+void jpeg_fail(j_common_ptr cinfo)
+{
+	longjmp(reinterpret_cast<struct jpeg_failure *>(cinfo->err)->jump, 1);
+}
+
+void jpeg_quiet(j_common_ptr)
+{
+}
+
+struct jpeg_state {
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_failure failure;
+	std::unique_ptr<BoxAccumulator> accumulator;
+	std::vector<JSAMPLE> row;
+	bool rotate;
+};
+
+/*
+ * JPEG from fp or memory (the other one is null), decoded at the smallest
+ * DCT scale (1/2, 1/4 or 1/8) that leaves four samples per cell, row by row.
+ * CMYK pictures are left to other decoders.
+ */
+enum load_status load_jpeg(FILE *fp, struct memory_data *memory, struct col_opt const &opts, size_t budget, CImg<float> &grid, size_t &peak, int64_t &pixels, QString &error)
+{
+	uchar marker[3];
+	if (memory) {
+		if (memory->size < sizeof(marker))
+			return LOAD_UNSUPPORTED;
+		memcpy(marker, memory->data, sizeof(marker));
+	} else if (fread(marker, 1, sizeof(marker), fp) != sizeof(marker) || fseek(fp, 0, SEEK_SET)) {
+		return LOAD_UNSUPPORTED;
+	}
+	if (marker[0] != 0xFF || marker[1] != 0xD8 || marker[2] != 0xFF)
+		return LOAD_UNSUPPORTED;
+
+	std::unique_ptr<jpeg_state> state(new jpeg_state);
+	struct jpeg_decompress_struct &cinfo = state->cinfo;
+	cinfo.err = jpeg_std_error(&state->failure.manager);
+	state->failure.manager.error_exit = jpeg_fail;
+	state->failure.manager.output_message = jpeg_quiet;
+	if (setjmp(state->failure.jump)) {
+		char message[JMSG_LENGTH_MAX];
+		(*cinfo.err->format_message)(reinterpret_cast<j_common_ptr>(&cinfo), message);
+		jpeg_destroy_decompress(&cinfo);
+		error = QObject::tr("JPEG decoding error: %1").arg(message);
+		return LOAD_FAILED;
+	}
+
+	jpeg_create_decompress(&cinfo);
+	if (memory)
+		jpeg_mem_src(&cinfo, const_cast<uchar *>(memory->data), memory->size);
+	else
+		jpeg_stdio_src(&cinfo, fp);
+	jpeg_read_header(&cinfo, TRUE);
+	if (cinfo.jpeg_color_space == JCS_CMYK || cinfo.jpeg_color_space == JCS_YCCK) {
+		jpeg_destroy_decompress(&cinfo);
+		return LOAD_UNSUPPORTED;
+	}
+
+	int width = cinfo.image_width;
+	int height = cinfo.image_height;
+	pixels = (int64_t)width * height;
+	int grid_width, grid_height;
+	grid_size(width, height, opts, state->rotate, grid_width, grid_height);
+	if (state->rotate)
+		std::swap(grid_width, grid_height);
+	cinfo.scale_num = 1;
+	cinfo.scale_denom = 1;
+	for (int denom = 8; denom > 1; denom /= 2) {
+		if ((width + denom - 1) / denom >= 4 * grid_width && (height + denom - 1) / denom >= 4 * grid_height) {
+			cinfo.scale_denom = denom;
+			break;
+		}
+	}
+	cinfo.out_color_space = JCS_RGB;
+	jpeg_calc_output_dimensions(&cinfo);
+
+	state->accumulator.reset(new BoxAccumulator(cinfo.output_width, cinfo.output_height, grid_width, grid_height));
+	size_t rowBytes = (size_t)cinfo.output_width * cinfo.output_components;
+	size_t needed = state->accumulator->bytes() + rowBytes;
+	// Progressive pictures are buffered whole, as DCT coefficients
+	if (cinfo.progressive_mode)
+		needed += (size_t)width * height * cinfo.num_components * sizeof(JCOEF);
+	if (needed > budget) {
+		jpeg_destroy_decompress(&cinfo);
+		error = budget_error(needed, budget);
+		return LOAD_FAILED;
+	}
+	peak = needed;
+
+	jpeg_start_decompress(&cinfo);
+	state->row.resize(rowBytes);
+	while (cinfo.output_scanline < cinfo.output_height) {
+		int y = cinfo.output_scanline;
+		JSAMPROW row = state->row.data();
+		jpeg_read_scanlines(&cinfo, &row, 1);
+		state->accumulator->add_row(y, [row](int x, int &R, int &G, int &B) {
+			R = row[3*x];
+			G = row[3*x + 1];
+			B = row[3*x + 2];
+		});
+	}
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+
+	state->accumulator->result(grid, state->rotate);
+	return LOAD_OK;
+}
+
+#ifdef A2C_HEADLESS
+// Other formats, through CImg (natively or with an external converter): the
+// picture is decoded at once, its size is only known afterwards
+enum load_status load_cimg(const char *filename, struct col_opt const &opts, size_t budget, CImg<float> &grid, size_t &peak, int64_t &pixels, QString &error)
+{
+	CImg<float> picture;
+
+	try {
+		picture.load(filename);
+	} catch (CImgException &e) {
+		error = e.what();
+		return LOAD_FAILED;
+	}
+	if (picture.is_empty())
+		return LOAD_UNSUPPORTED;
+
+	bool rotate;
+	int grid_width, grid_height;
+	pixels = (int64_t)picture.width() * picture.height();
+	grid_size(picture.width(), picture.height(), opts, rotate, grid_width, grid_height);
+	if (rotate)
+		std::swap(grid_width, grid_height);
+	BoxAccumulator accumulator(picture.width(), picture.height(), grid_width, grid_height);
+	size_t needed = picture.size() * sizeof(float) + accumulator.bytes();
+	if (needed > budget) {
+		error = budget_error(needed, budget);
+		return LOAD_FAILED;
+	}
+	peak = needed;
+
+	// Gray pictures have one channel
+	int G = std::min(1, picture.spectrum() - 1), B = std::min(2, picture.spectrum() - 1);
+	for (int y = 0; y < picture.height(); y += 1) {
+		accumulator.add_row(y, [&](int x, int &r, int &g, int &b) {
+			r = picture(x, y, 0, 0);
+			g = picture(x, y, 0, G);
+			b = picture(x, y, 0, B);
+		});
+	}
+
+	accumulator.result(grid, rotate);
+	return LOAD_OK;
+}
+#else
+// Any format Qt reads
+enum load_status load_qt(QImageReader &reader, struct col_opt const &opts, size_t budget, CImg<float> &grid, size_t &peak, int64_t &pixels, QString &error)
+{
+	QSize size = reader.size();
+	if (!size.isValid()) {
+		error = reader.errorString();
+		return LOAD_UNSUPPORTED;
+	}
+	pixels = (int64_t)size.width() * size.height();
+
+	bool rotate;
+	int grid_width, grid_height;
+	grid_size(size.width(), size.height(), opts, rotate, grid_width, grid_height);
+	if (rotate)
+		std::swap(grid_width, grid_height);
+
+	QSize decoded = size;
+	size_t needed;
+	if (reader.supportsOption(QImageIOHandler::ScaledSize)) {
+		// Four samples per cell are plenty; the decoder may go through an
+		// intermediate scale up to twice as large in each direction
+		decoded = QSize(std::min(size.width(), 4 * grid_width), std::min(size.height(), 4 * grid_height));
+		reader.setScaledSize(decoded);
+		needed = (size_t)decoded.width() * decoded.height() * 4 * 5;
+	} else {
+		// Decoded image, and a converted copy
+		needed = (size_t)size.width() * size.height() * 4 * 2;
+	}
+	BoxAccumulator accumulator(decoded.width(), decoded.height(), grid_width, grid_height);
+	needed += accumulator.bytes();
+	if (needed > budget) {
+		error = budget_error(needed, budget);
+		return LOAD_FAILED;
+	}
+	peak = needed;
+
+	QImage image = reader.read();
+	if (image.isNull()) {
+		error = reader.errorString();
+		return LOAD_FAILED;
+	}
+	if (image.format() != QImage::Format_RGB32 && image.format() != QImage::Format_ARGB32)
+		image = image.convertToFormat(QImage::Format_RGB32);
+	if (image.size() != decoded) {
+		error = QObject::tr("unexpected decoded size");
+		return LOAD_FAILED;
+	}
+	for (int y = 0; y < image.height(); y += 1) {
+		const QRgb *line = reinterpret_cast<const QRgb *>(image.constScanLine(y));
+		accumulator.add_row(y, [line](int x, int &R, int &G, int &B) {
+			R = qRed(line[x]);
+			G = qGreen(line[x]);
+			B = qBlue(line[x]);
+		});
+	}
+
+	accumulator.result(grid, rotate);
+	return LOAD_OK;
+}
+#endif
+
+// PNG, then JPEG, then the generic decoder
+enum load_status load_memory(struct memory_data &memory, struct col_opt const &opts, size_t budget, CImg<float> &grid, size_t &peak, int64_t &pixels, QString &error)
+{
+	enum load_status status = load_png(nullptr, &memory, opts, budget, grid, peak, pixels, error);
+	if (status == LOAD_UNSUPPORTED)
+		status = load_jpeg(nullptr, &memory, opts, budget, grid, peak, pixels, error);
+#ifndef A2C_HEADLESS
+	if (status == LOAD_UNSUPPORTED) {
+		QByteArray data = QByteArray::fromRawData(reinterpret_cast<const char *>(memory.data), memory.size);
+		QBuffer buffer(&data);
+		buffer.open(QIODevice::ReadOnly);
+		QImageReader reader(&buffer);
+		status = load_qt(reader, opts, budget, grid, peak, pixels, error);
+	}
+#endif
+
+	return status;
+}
+
+}
+
+bool load_downscaled(const char *filename, struct col_opt const &opts, size_t budget, CImg<float> &grid, size_t &peak, int64_t &pixels, QString &error)
+{
+	enum load_status status = LOAD_UNSUPPORTED;
+
+	peak = 0;
+	pixels = 0;
+	FILE *fp = fopen(filename, "rb");
+	if (fp) {
+		status = load_png(fp, nullptr, opts, budget, grid, peak, pixels, error);
+		if (status == LOAD_UNSUPPORTED && !fseek(fp, 0, SEEK_SET))
+			status = load_jpeg(fp, nullptr, opts, budget, grid, peak, pixels, error);
+		fclose(fp);
+	}
+	if (status == LOAD_UNSUPPORTED) {
+#ifdef A2C_HEADLESS
+		status = load_cimg(filename, opts, budget, grid, peak, pixels, error);
+#else
+		QImageReader reader(QString::fromLocal8Bit(filename));
+		status = load_qt(reader, opts, budget, grid, peak, pixels, error);
+#endif
+	}
+	if (status == LOAD_UNSUPPORTED && error.isEmpty())
+		error = QObject::tr("unsupported picture format");
+
+	return status == LOAD_OK;
+}
+
+bool load_downscaled(QIODevice *device, struct col_opt const &opts, size_t budget, CImg<float> &grid, size_t &peak, int64_t &pixels, QString &error)
+{
+	QByteArray data = device->readAll();
+	struct memory_data memory = {reinterpret_cast<const uchar *>(data.constData()), (size_t)data.size(), 0};
+	enum load_status status;
+
+	peak = 0;
+	pixels = 0;
+	status = load_memory(memory, opts, budget, grid, peak, pixels, error);
+	if (status == LOAD_UNSUPPORTED && error.isEmpty())
+		error = QObject::tr("unsupported picture format");
+
+	return status == LOAD_OK;
+}
+
+#ifndef A2C_HEADLESS
+void image2cimg(QImage const &image, CImg<float> &picture)
+{
+	QImage rgb = image;
+
+	if (rgb.format() != QImage::Format_RGB32 && rgb.format() != QImage::Format_ARGB32)
+		rgb = rgb.convertToFormat(QImage::Format_RGB32);
+	picture.assign(rgb.width(), rgb.height(), 1, 3);
+	for (int y = 0; y < rgb.height(); y += 1) {
+		const QRgb *line = reinterpret_cast<const QRgb *>(rgb.constScanLine(y));
+		for (int x = 0; x < rgb.width(); x += 1) {
+			picture(x, y, 0, 0) = qRed(line[x]);
+			picture(x, y, 0, 1) = qGreen(line[x]);
+			picture(x, y, 0, 2) = qBlue(line[x]);
+		}
+	}
+}
+
+QVector<QImage> downscale_pyramid(QImage const &image, int min_side, int threads)
+{
+	QVector<QImage> levels;
+
+	if (image.isNull())
+		return levels;
+	levels.push_back(image.convertToFormat(QImage::Format_RGB32));
+	min_side = std::max(1, min_side);
+
+	for (;;) {
+		QImage const &src = levels.last();
+		int width = src.width() / 2;
+		int height = src.height() / 2;
+		if (std::min(width, height) < min_side)
+			break;
+
+		QImage dst(width, height, QImage::Format_RGB32);
+		if (dst.isNull())
+			break;
+		// Rows are written from worker threads: no scanLine() calls (detach) there
+		uchar *bits = dst.bits();
+		int stride = dst.bytesPerLine();
+		parallel_for(0, height, [&](int y) {
+			const QRgb *top = reinterpret_cast<const QRgb *>(src.constScanLine(2 * y));
+			const QRgb *bottom = reinterpret_cast<const QRgb *>(src.constScanLine(2 * y + 1));
+			QRgb *line = reinterpret_cast<QRgb *>(bits + (size_t)y * stride);
+			for (int x = 0; x < width; x += 1) {
+				QRgb a = top[2 * x], b = top[2 * x + 1], c = bottom[2 * x], d = bottom[2 * x + 1];
+				line[x] = qRgb((qRed(a) + qRed(b) + qRed(c) + qRed(d) + 2) / 4,
+				               (qGreen(a) + qGreen(b) + qGreen(c) + qGreen(d) + 2) / 4,
+				               (qBlue(a) + qBlue(b) + qBlue(c) + qBlue(d) + 2) / 4);
+			}
+		}, threads);
+		levels.push_back(dst);
+	}
+
+	return levels;
+}
+
+QImage const &pyramid_level(QVector<QImage> const &levels, struct col_opt const &opts, int oversample)
+{
+	bool rotate;
+	int grid_width, grid_height;
+
+	grid_size(levels.first().width(), levels.first().height(), opts, rotate, grid_width, grid_height);
+	if (rotate)
+		std::swap(grid_width, grid_height);
+
+	// Levels get smaller: keep the last one large enough
+	int chosen = 0;
+	for (int i = 1; i < levels.size(); i += 1) {
+		if (levels.at(i).width() < oversample * grid_width || levels.at(i).height() < oversample * grid_height)
+			break;
+		chosen = i;
+	}
+
+	return levels.at(chosen);
+}
+#endif
@@ -0,0 +1,69 @@
+#ifndef _DECODE_H_
+#define _DECODE_H_
+
+/*
+ * Copyright 2017-2022 - Geoffrey Brun <geoffrey@spekadyon.org>
+ *
+ * This file is part of any2coloring.
+ *
+ * any2coloring is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * any2coloring is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * any2coloring. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QIODevice>
+#include <QString>
+#include <QVector>
+
+#ifndef A2C_HEADLESS
+#include <QImage>
+#endif
+
+#include <cstdint>
+
+#include <CImg.h>
+
+#include "any2col.hpp"
+
+/*
+ * Memory bounded decoding: the picture is read by rows (PNG, through libpng),
+ * decoded at a reduced scale (JPEG, DCT scaling through libjpeg) or, for
+ * other formats, read at once if it fits in the budget (by Qt, or by CImg in
+ * headless builds, which only check the budget once decoded and read PNG and
+ * JPEG data only). Pixels are box filtered straight into the grid, which is
+ * rotated like G'MIC's "-rotate 90" for landscape pictures.
+ *
+ * Returns false, with an error message, if the picture can't be read or
+ * would need more than budget bytes of pixel buffers. The peak size of these
+ * buffers is returned in peak, the number of source pixels in pixels.
+ */
+bool load_downscaled(const char *filename, struct col_opt const &opts, size_t budget, cimg_library::CImg<float> &grid, size_t &peak, int64_t &pixels, QString &error);
+// Same as above, from encoded data
+bool load_downscaled(QIODevice *device, struct col_opt const &opts, size_t budget, cimg_library::CImg<float> &grid, size_t &peak, int64_t &pixels, QString &error);
+
+#ifndef A2C_HEADLESS
+// RGB channels of image, alpha is dropped
+void image2cimg(QImage const &image, cimg_library::CImg<float> &picture);
+
+/*
+ * Downscale pyramid, to derive several grids from one decoded picture: level
+ * 0 is the picture (RGB32), every other level is the previous one halved with
+ * a 2x2 box filter (odd last row and column dropped). Levels are added while
+ * the shortest side of the next one is at least min_side pixels.
+ */
+QVector<QImage> downscale_pyramid(QImage const &image, int min_side, int threads = 0);
+// Smallest level with at least oversample pixels per grid cell, in both
+// directions, for the grid of opts (sized from level 0)
+QImage const &pyramid_level(QVector<QImage> const &levels, struct col_opt const &opts, int oversample);
+#endif
+
+#endif /* _DECODE_H_ */
@@ -0,0 +1,321 @@
+/*
+ * Copyright 2017-2022 - Geoffrey Brun <geoffrey@spekadyon.org>
+ *
+ * This file is part of any2coloring.
+ *
+ * any2coloring is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * any2coloring is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * any2coloring. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QBuffer>
+#include <QCryptographicHash>
+#include <QDebug>
+#include <QFile>
+
+#include <exception>
+#include <functional>
+
+#include <gmic.h>
+
+#include "engine.hpp"
+#include "regions.hpp"
+
+namespace {
+
+// Interpreter borrowed from the engine for one call, on first use: calls
+// that don't need G'MIC never create one
+class InterpreterLease {
+public:
+	InterpreterLease(std::function<gmic *()> acquire, std::function<void(gmic *)> release) :
+		gmic_obj(nullptr), acquire(acquire), release(release) {}
+	~InterpreterLease() { if (gmic_obj) release(gmic_obj); }
+
+	gmic &get()
+	{
+		if (!gmic_obj)
+			gmic_obj = acquire();
+		return *gmic_obj;
+	}
+
+private:
+	gmic *gmic_obj;
+	std::function<gmic *()> acquire;
+	std::function<void(gmic *)> release;
+};
+
+// Digest of the picture bytes. A device is read into data, source then reads
+// from buffer instead.
+bool picture_digest(struct picture_source &source, QByteArray &data, QBuffer &buffer, QByteArray &digest)
+{
+	QCryptographicHash hash(QCryptographicHash::Sha1);
+
+#ifndef A2C_HEADLESS
+	if (source.image) {
+		QImage const &image = *source.image;
+		hash.addData(QString::asprintf("image %d %d %d", image.width(), image.height(), (int)image.format()).toLatin1());
+		for (QRgb color: image.colorTable())
+			hash.addData(reinterpret_cast<const char *>(&color), sizeof(color));
+		int lineBytes = (image.width() * image.depth() + 7) / 8;
+		for (int y = 0; y < image.height(); y += 1)
+			hash.addData(reinterpret_cast<const char *>(image.constScanLine(y)), lineBytes);
+	} else
+#endif
+	if (source.device) {
+		data = source.device->readAll();
+		buffer.setData(data);
+		buffer.open(QIODevice::ReadOnly);
+		source.device = &buffer;
+		hash.addData(data);
+	} else if (source.filename) {
+		QFile file(source.filename);
+		if (!file.open(QIODevice::ReadOnly))
+			return false;
+		const uchar *bytes = file.size() > 0 ? file.map(0, file.size()) : nullptr;
+		if (bytes)
+			hash.addData(reinterpret_cast<const char *>(bytes), file.size());
+		else if (!hash.addData(&file))
+			return false;
+	} else {
+		return false;
+	}
+	digest = hash.result();
+
+	return true;
+}
+
+}
+
+ColoringEngine::ColoringEngine(struct col_opt const &opts) :
+	opts(opts)
+{
+}
+
+ColoringEngine::~ColoringEngine()
+{
+}
+
+enum coloring_status ColoringEngine::set_palette(QVector<struct color> const &palette)
+{
+	if (palette.isEmpty())
+		return coloring_status::BadPalette;
+
+	std::shared_ptr<Quantizer> newQuantizer;
+	if (opts.quantizer.native) {
+		newQuantizer = std::make_shared<Quantizer>(palette, opts.quantizer.metric);
+		if (opts.quantizer.search != nearest_search::Auto)
+			newQuantizer->set_search(opts.quantizer.search);
+		// Dithered values are not 8-bit, the lookup table is useless then
+		if (opts.quantizer.lut_bits > 0 && !opts.quantizer.dithering)
+			newQuantizer->build_lut(opts.quantizer.lut_bits);
+	}
+	set_palette(palette, newQuantizer);
+
+	return coloring_status::Ok;
+}
+
+enum coloring_status ColoringEngine::set_palette(const char *palette_csv_file)
+{
+	QVector<struct color> palette;
+
+	if (!read_palette(palette_csv_file, palette))
+		return coloring_status::BadPalette;
+
+	return set_palette(palette);
+}
+
+enum coloring_status ColoringEngine::set_palette(QIODevice *palette_csv)
+{
+	QVector<struct color> palette;
+
+	if (!read_palette(palette_csv, palette))
+		return coloring_status::BadPalette;
+
+	return set_palette(palette);
+}
+
+void ColoringEngine::set_palette(QVector<struct color> const &palette, std::shared_ptr<const Quantizer> const &quantizer)
+{
+	colors = palette;
+	this->quantizer = quantizer;
+}
+
+void ColoringEngine::warm_up(int count)
+{
+	std::vector<gmic *> created;
+
+	while (idle_interpreters() + (int)created.size() < count)
+		created.push_back(new gmic);
+	for (auto gmic_obj: created)
+		release(gmic_obj);
+}
+
+int ColoringEngine::idle_interpreters() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	return idle.size();
+}
+
+gmic *ColoringEngine::acquire() const
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!idle.empty()) {
+			gmic *gmic_obj = idle.back().release();
+			idle.pop_back();
+			return gmic_obj;
+		}
+	}
+
+	// Created outside of the lock, it takes a while
+	return new gmic;
+}
+
+void ColoringEngine::release(gmic *gmic_obj) const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	idle.emplace_back(gmic_obj);
+}
+
+enum coloring_status ColoringEngine::make_coloring(struct picture_source const &source, struct Coloring &coloring, QString *error) const
+{
+	return make_coloring(source, opts, coloring, error);
+}
+
+enum coloring_status ColoringEngine::make_coloring(struct picture_source const &source, struct col_opt const &opts, struct Coloring &coloring, QString *error) const
+{
+	if (!results)
+		return compute(source, opts, coloring, error);
+
+	struct picture_source cached = source;
+	QByteArray data;
+	QBuffer buffer;
+	QByteArray key;
+	struct run_stats lookup;
+	bool hit = false;
+	{
+		StageTimer timer(&lookup, "result_cache");
+		QByteArray digest;
+		if (picture_digest(cached, data, buffer, digest)) {
+			// The quantizer actually used, whatever the options say
+			struct col_opt keyOpts = opts;
+			keyOpts.quantizer.native = quantizer != nullptr;
+			keyOpts.quantizer.lut_bits = quantizer ? quantizer->lut_bits() : 0;
+			key = ResultCache::key(digest, colors, keyOpts);
+			hit = results->load(key, colors.size(), coloring.indexes);
+		}
+	}
+
+	if (hit) {
+		coloring.palette = colors;
+		coloring.decode_peak = 0;
+		coloring.stats = lookup;
+		// Small regions were merged before storing, this only labels them
+		coloring.regions = region_map();
+		if (opts.regions.enabled) {
+			StageTimer timer(&coloring.stats, "regions");
+			find_regions(coloring.indexes, opts.regions.min_cells, coloring.regions, opts.threads);
+			coloring.stats.count("regions", coloring.regions.count());
+		}
+		coloring.stats.count("result_cache_hit", 1);
+		coloring.stats.count("grid_cells", (int64_t)coloring.indexes.width() * coloring.indexes.height());
+		coloring.stats.count("palette_colors", colors.size());
+		return coloring_status::Ok;
+	}
+
+	enum coloring_status status = compute(cached, opts, coloring, error);
+	if (status == coloring_status::Ok) {
+		if (!key.isEmpty())
+			results->store(key, coloring.indexes, colors.size());
+		coloring.stats.stages = lookup.stages + coloring.stats.stages;
+		coloring.stats.count("result_cache_hit", 0);
+	}
+
+	return status;
+}
+
+enum coloring_status ColoringEngine::compute(struct picture_source const &source, struct col_opt const &opts, struct Coloring &coloring, QString *error) const
+{
+	try {
+		InterpreterLease interpreter([this]() { return acquire(); }, [this](gmic *gmic_obj) { release(gmic_obj); });
+		return ::make_coloring(source, colors, quantizer.get(), opts, coloring, [&]() -> gmic & { return interpreter.get(); }, error);
+	} catch (gmic_exception &e) {
+		if (error)
+			*error = e.what();
+	} catch (std::exception const &e) {
+		if (error)
+			*error = e.what();
+	}
+
+	return coloring_status::ProcessingFailed;
+}
+
+enum coloring_status ColoringEngine::make_coloring(const char *filename, struct Coloring &coloring, QString *error) const
+{
+	struct picture_source source;
+
+	source.filename = filename;
+	return make_coloring(source, coloring, error);
+}
+
+enum coloring_status ColoringEngine::make_coloring(QByteArray const &data, struct Coloring &coloring, QString *error) const
+{
+	struct picture_source source;
+	QBuffer buffer;
+
+	// Shares data, no copy
+	buffer.setData(data);
+	buffer.open(QIODevice::ReadOnly);
+	source.device = &buffer;
+	return make_coloring(source, coloring, error);
+}
+
+#ifndef A2C_HEADLESS
+enum coloring_status ColoringEngine::make_coloring(QImage const &image, struct Coloring &coloring, QString *error) const
+{
+	struct picture_source source;
+
+	source.image = &image;
+	return make_coloring(source, coloring, error);
+}
+#endif
+
+enum coloring_status ColoringEngine::write_pdf(QIODevice *device, struct Coloring const &coloring, bool soluce, struct run_stats *stats) const
+{
+	return coloring2pdf(device, coloring, opts, soluce, stats) ? coloring_status::Ok : coloring_status::OutputFailed;
+}
+
+enum coloring_status ColoringEngine::write_pdf(const char *filename, struct Coloring const &coloring, bool soluce, struct run_stats *stats) const
+{
+	return coloring2pdf(filename, coloring, opts, soluce, stats) ? coloring_status::Ok : coloring_status::OutputFailed;
+}
+
+enum coloring_status ColoringEngine::write_pdf(QByteArray &pdf, struct Coloring const &coloring, bool soluce, struct run_stats *stats) const
+{
+	QBuffer buffer(&pdf);
+
+	pdf.clear();
+	buffer.open(QIODevice::WriteOnly);
+	return write_pdf(&buffer, coloring, soluce, stats);
+}
+
+enum coloring_status ColoringEngine::write_pdf(const char *filename, struct Coloring const &coloring, enum pdf_content content, struct run_stats *stats) const
+{
+	return coloring2pdf(filename, coloring, opts, content, stats) ? coloring_status::Ok : coloring_status::OutputFailed;
+}
+
+enum coloring_status ColoringEngine::write_pdf(const char *sheet_filename, const char *soluce_filename, struct Coloring const &coloring, struct run_stats *stats) const
+{
+	return coloring2pdf(sheet_filename, soluce_filename, coloring, opts, stats) ? coloring_status::Ok : coloring_status::OutputFailed;
+}
@@ -0,0 +1,106 @@
+#ifndef _ENGINE_H_
+#define _ENGINE_H_
+
+/*
+ * Copyright 2017-2022 - Geoffrey Brun <geoffrey@spekadyon.org>
+ *
+ * This file is part of any2coloring.
+ *
+ * any2coloring is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * any2coloring is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * any2coloring. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QByteArray>
+#include <QIODevice>
+#include <QString>
+#include <QVector>
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "any2col.hpp"
+#include "quantize.hpp"
+#include "result_cache.hpp"
+
+/*
+ * Reusable coloring engine, for programs linking libany2col: options and
+ * palette are set once, then pictures are colored and written from any
+ * number of threads at once. Failures are reported as a status and a message,
+ * the engine never exits nor prints anything but debug messages.
+ *
+ * G'MIC interpreters are expensive to create, the engine keeps the ones it
+ * created for later calls. No Qt event loop is needed; the qt PDF writer and
+ * raster output draw text with QPainter, which needs a QGuiApplication object
+ * for fonts (the "offscreen" platform is enough, any2coloring uses it when
+ * QT_QPA_PLATFORM is not set). Headless builds need a QCoreApplication only.
+ */
+class ColoringEngine {
+public:
+	explicit ColoringEngine(struct col_opt const &opts);
+	~ColoringEngine();
+
+	// Configuration, not thread safe: done before coloring pictures.
+	// The native quantizer is built according to the options.
+	enum coloring_status set_palette(QVector<struct color> const &palette);
+	enum coloring_status set_palette(const char *palette_csv_file);
+	enum coloring_status set_palette(QIODevice *palette_csv);
+	// Prepared quantizer (e.g. from the palette cache) built from palette,
+	// used whatever opts.quantizer.native is; null: G'MIC palette mapping
+	void set_palette(QVector<struct color> const &palette, std::shared_ptr<const Quantizer> const &quantizer);
+	// Create interpreters up to count, so that the first calls don't pay for it
+	void warm_up(int count);
+	// Reuse index maps of earlier calls with the same picture, palette and
+	// options; null: no cache
+	void set_result_cache(std::shared_ptr<ResultCache> const &cache) { results = cache; }
+
+	struct col_opt const &options() const { return opts; }
+	QVector<struct color> const &palette() const { return colors; }
+	// Interpreters currently idle
+	int idle_interpreters() const;
+
+	// Thread safe. With a result cache, coloring.stats holds a
+	// "result_cache" stage and a "result_cache_hit" count.
+	enum coloring_status make_coloring(struct picture_source const &source, struct Coloring &coloring, QString *error = nullptr) const;
+	enum coloring_status make_coloring(const char *filename, struct Coloring &coloring, QString *error = nullptr) const;
+	// Encoded picture, in any format Qt reads
+	enum coloring_status make_coloring(QByteArray const &data, struct Coloring &coloring, QString *error = nullptr) const;
+#ifndef A2C_HEADLESS
+	enum coloring_status make_coloring(QImage const &image, struct Coloring &coloring, QString *error = nullptr) const;
+#endif
+	// With other options than the engine ones, e.g. another page format or
+	// pixel size; the palette and quantizer stay those of the engine
+	enum coloring_status make_coloring(struct picture_source const &source, struct col_opt const &opts, struct Coloring &coloring, QString *error = nullptr) const;
+	// PDF stages are added to stats if not null
+	enum coloring_status write_pdf(QIODevice *device, struct Coloring const &coloring, bool soluce, struct run_stats *stats = nullptr) const;
+	enum coloring_status write_pdf(const char *filename, struct Coloring const &coloring, bool soluce, struct run_stats *stats = nullptr) const;
+	enum coloring_status write_pdf(QByteArray &pdf, struct Coloring const &coloring, bool soluce, struct run_stats *stats = nullptr) const;
+	// Sheet, solution or both in one document
+	enum coloring_status write_pdf(const char *filename, struct Coloring const &coloring, enum pdf_content content, struct run_stats *stats = nullptr) const;
+	// Sheet and solution to two files, written concurrently
+	enum coloring_status write_pdf(const char *sheet_filename, const char *soluce_filename, struct Coloring const &coloring, struct run_stats *stats = nullptr) const;
+
+private:
+	enum coloring_status compute(struct picture_source const &source, struct col_opt const &opts, struct Coloring &coloring, QString *error) const;
+	gmic *acquire() const;
+	void release(gmic *gmic_obj) const;
+
+	struct col_opt opts;
+	QVector<struct color> colors;
+	std::shared_ptr<const Quantizer> quantizer;
+	std::shared_ptr<ResultCache> results;
+	mutable std::mutex mutex;
+	mutable std::vector<std::unique_ptr<gmic>> idle;
+};
+
+#endif /* _ENGINE_H_ */
@@ -19,14 +19,28 @@
 
 #include <QDebug>
 #include <QFile>
-#include <QPainter>
-#include <QPdfWriter>
+#include <QFileDevice>
+#include <QObject>
 #include <QVector>
 
+#ifndef A2C_HEADLESS
+#include <QImageReader>
+#endif
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
 #include <CImg.h>
 #include <gmic.h>
 
 #include "any2col.hpp"
+#include "decode.hpp"
+#include "palette_file.hpp"
+#include "quantize.hpp"
+#include "regions.hpp"
+#include "resize.hpp"
+#include "stats.hpp"
 
 
 inline double mm_to_pt(double mm)
@@ -36,40 +50,164 @@ inline double mm_to_pt(double mm)
 
 using namespace cimg_library;
 
-bool read_palette(const char *filename, QVector<struct color> &palette)
+bool is_poster(struct col_opt const &opts)
+{
+	return opts.poster.columns > 0 || opts.poster.width > 0;
+}
+
+int page_cells(double length, double px_size)
+{
+	return std::max(1, (int)std::floor(length/px_size + 1e-6));
+}
+
+void picture_area(struct col_opt const &opts, double &width, double &height)
+{
+	width = opts.page.width - opts.margin.right - opts.margin.left;
+	height = opts.page.height - opts.margin.top - opts.margin.bottom;
+	if (opts.poster.columns > 0) {
+		// Whole cells of every page, minus the ones repeated on neighbours;
+		// half a cell more so that the grid size doesn't depend on rounding
+		int page_width = page_cells(width, opts.px_size);
+		int page_height = page_cells(height, opts.px_size);
+		int overlap = std::max(0, std::min(opts.poster.overlap, std::min(page_width, page_height) - 1));
+		width = (opts.poster.columns*page_width - (opts.poster.columns - 1)*overlap + 0.5)*opts.px_size;
+		height = (opts.poster.rows*page_height - (opts.poster.rows - 1)*overlap + 0.5)*opts.px_size;
+	} else if (opts.poster.width > 0) {
+		width = opts.poster.width;
+		height = opts.poster.height;
+	}
+}
+
+QVector<struct page_tile> page_tiles(struct Coloring const &coloring, struct col_opt const &opts)
+{
+	QVector<struct page_tile> tiles;
+	int width = coloring.indexes.width();
+	int height = coloring.indexes.height();
+	struct page_tile tile;
+
+	tile.column = tile.row = 0;
+	tile.overlap = 0;
+	tile.left = tile.right = tile.top = tile.bottom = false;
+
+	if (!is_poster(opts)) {
+		tile.area = QRect(0, 0, width, height);
+		tile.origin = QPointF((opts.page.width + opts.margin.left - opts.margin.right)/2.0 - width*opts.px_size / 2.0,
+		                      (opts.page.height + opts.margin.top - opts.margin.bottom)/2.0 - height*opts.px_size / 2.0);
+		tiles.push_back(tile);
+		return tiles;
+	}
+
+	// Poster pages are filled from their top-left corner, adjacent pages
+	// repeat overlap rows/columns of cells
+	int page_width = page_cells(opts.page.width - opts.margin.left - opts.margin.right, opts.px_size);
+	int page_height = page_cells(opts.page.height - opts.margin.top - opts.margin.bottom, opts.px_size);
+	int overlap = std::max(0, std::min(opts.poster.overlap, std::min(page_width, page_height) - 1));
+	int step_x = page_width - overlap;
+	int step_y = page_height - overlap;
+	int columns = width <= page_width ? 1 : 1 + (width - page_width + step_x - 1) / step_x;
+	int rows = height <= page_height ? 1 : 1 + (height - page_height + step_y - 1) / step_y;
+
+	tile.origin = QPointF(opts.margin.left, opts.margin.top);
+	tile.overlap = overlap;
+	for (int row = 0; row < rows; row += 1) {
+		for (int column = 0; column < columns; column += 1) {
+			int x = column * step_x;
+			int y = row * step_y;
+			tile.area = QRect(x, y, std::min(width, x + page_width) - x, std::min(height, y + page_height) - y);
+			tile.column = column;
+			tile.row = row;
+			tile.left = column > 0;
+			tile.right = column < columns - 1;
+			tile.top = row > 0;
+			tile.bottom = row < rows - 1;
+			tiles.push_back(tile);
+		}
+	}
+
+	return tiles;
+}
+
+// Corner marks outside of the grid, and ticks at the limits of the cells
+// repeated on neighbour pages
+void poster_marks(struct col_opt const &opts, struct page_tile const &tile, QVector<QLineF> &lines, QPointF &caption_pos, QString &caption)
+{
+	double cell = opts.px_size;
+	double gap = 1.0;
+	double margin = std::min({opts.margin.top, opts.margin.bottom, opts.margin.left, opts.margin.right});
+	double length = std::min(5.0, margin - 1.5);
+	double x0 = tile.origin.x();
+	double y0 = tile.origin.y();
+	double x1 = x0 + tile.area.width()*cell;
+	double y1 = y0 + tile.area.height()*cell;
+
+	caption_pos = QPointF(x0, y1 + opts.margin.bottom*0.75);
+	caption = QObject::tr("Row %1, column %2").arg(tile.row + 1).arg(tile.column + 1);
+	if (length <= 0)
+		return;
+
+	for (double x: {x0, x1}) {
+		for (double y: {y0, y1}) {
+			double dx = x == x0 ? -1 : 1;
+			double dy = y == y0 ? -1 : 1;
+			lines.push_back(QLineF(x + dx*gap, y, x + dx*(gap + length), y));
+			lines.push_back(QLineF(x, y + dy*gap, x, y + dy*(gap + length)));
+		}
+	}
+
+	QVector<double> columns;
+	QVector<double> rows;
+	if (tile.left)
+		columns.push_back(x0 + tile.overlap*cell);
+	if (tile.right)
+		columns.push_back(x1 - tile.overlap*cell);
+	if (tile.top)
+		rows.push_back(y0 + tile.overlap*cell);
+	if (tile.bottom)
+		rows.push_back(y1 - tile.overlap*cell);
+	for (double x: columns) {
+		lines.push_back(QLineF(x, y0 - gap, x, y0 - gap - length));
+		lines.push_back(QLineF(x, y1 + gap, x, y1 + gap + length));
+	}
+	for (double y: rows) {
+		lines.push_back(QLineF(x0 - gap, y, x0 - gap - length, y));
+		lines.push_back(QLineF(x1 + gap, y, x1 + gap + length, y));
+	}
+}
+
+bool read_palette(const char *filename, QVector<struct color> &palette, struct palette_error *error)
 {
 	QFile qfile(filename);
-	QString str_colrgb;
-	QString str_colname;
 
 	if (!qfile.open(QIODevice::ReadOnly)) {
 		qDebug() << Q_FUNC_INFO << "unable to open" << filename << qfile.errorString();
+		palette.clear();
+		if (error) {
+			*error = palette_error();
+			error->message = qfile.errorString();
+		}
 		return false;
 	}
 
-	QTextStream textStream(&qfile);
-	while (!textStream.atEnd()) {
-		color Color;
-		bool ok;
-		uint32_t rawcolor;
-		QString str = textStream.readLine();
-		QRegExp regExp("\\s+");
-		QStringList strList = str.split(regExp);
-		if (strList.size() < 2)
-			continue;
-		rawcolor = strList.at(0).toUInt(&ok, 16);
-		if (!ok) {
-			qDebug() << Q_FUNC_INFO << "invalid RGB color:" << strList.at(0) << "skipping...";
-			continue;
+	return read_palette(&qfile, palette, error);
+}
+
+bool read_palette(QIODevice *device, QVector<struct color> &palette, struct palette_error *error)
+{
+	// Files are parsed in place, through a mapping
+	QFileDevice *file = qobject_cast<QFileDevice *>(device);
+	if (file && !file->isSequential() && file->size() > file->pos()) {
+		qint64 size = file->size() - file->pos();
+		const uchar *data = file->map(file->pos(), size);
+		if (data) {
+			bool ok = parse_palette(reinterpret_cast<const char *>(data), size, palette, error);
+			file->unmap(const_cast<uchar *>(data));
+			file->seek(file->size());
+			return ok;
 		}
-		Color.rgb.R = rawcolor >> 2*8;
-		Color.rgb.G = (uint32_t)(rawcolor >> 8) & (uint32_t)(0xFF);
-		Color.rgb.B = rawcolor & (uint32_t)0xFF;
-		Color.name = strList.at(1);
-		palette.push_back(Color);
 	}
 
-	return true;
+	QByteArray data = device->readAll();
+	return parse_palette(data.constData(), data.size(), palette, error);
 }
 
 void palette2CImg(QVector<struct color> const &palette, CImg<float> &cimg_palette)
@@ -82,116 +220,280 @@ void palette2CImg(QVector<struct color> const &palette, CImg<float> &cimg_palett
 	}
 }
 
-void make_coloring(const char *palette_csv_file, const char *original_picture, struct col_opt const &opts, struct Coloring &coloring)
+void grid_size(int width, int height, struct col_opt const &opts, bool &rotate, int &grid_width, int &grid_height)
+{
+	double pic_width, pic_height;
+	picture_area(opts, pic_width, pic_height);
+
+	// Same as the G'MIC "-rotate 90" and "-r2dy"/"-r2dx" steps
+	rotate = width > height;
+	if (rotate)
+		std::swap(width, height);
+	if ((double)height/(double)width > pic_height/pic_width) {
+		grid_height = std::max(1, (int)(pic_height/opts.px_size));
+		grid_width = std::max(1, (int)std::lround((double)width*grid_height/height));
+	} else {
+		grid_width = std::max(1, (int)(pic_width/opts.px_size));
+		grid_height = std::max(1, (int)std::lround((double)height*grid_width/width));
+	}
+}
+
+// Decode the picture; at_grid_size is set if it has been box filtered to the
+// grid size already
+static enum coloring_status load_picture(struct picture_source const &source, struct col_opt const &opts, CImg<float> &picture, bool &at_grid_size, size_t &peak, int64_t &pixels, QString &error)
+{
+	at_grid_size = false;
+	peak = 0;
+	pixels = 0;
+
+#ifndef A2C_HEADLESS
+	if (source.image) {
+		if (source.image->isNull()) {
+			error = QObject::tr("empty image");
+			return coloring_status::BadPicture;
+		}
+		image2cimg(*source.image, picture);
+	} else
+#endif
+	if (source.device && opts.max_memory > 0) {
+		if (!load_downscaled(source.device, opts, opts.max_memory, picture, peak, pixels, error))
+			return coloring_status::BadPicture;
+		at_grid_size = true;
+		return coloring_status::Ok;
+	} else if (source.device) {
+#ifdef A2C_HEADLESS
+		// No full size decoder without QtGui: read at the grid size
+		if (!load_downscaled(source.device, opts, SIZE_MAX, picture, peak, pixels, error))
+			return coloring_status::BadPicture;
+		at_grid_size = true;
+		return coloring_status::Ok;
+#else
+		QImageReader reader(source.device);
+		QImage image = reader.read();
+		if (image.isNull()) {
+			error = reader.errorString();
+			return coloring_status::BadPicture;
+		}
+		image2cimg(image, picture);
+#endif
+	} else if (source.filename && opts.max_memory > 0) {
+		// Read the picture straight at the grid size
+		if (!load_downscaled(source.filename, opts, opts.max_memory, picture, peak, pixels, error))
+			return coloring_status::BadPicture;
+		at_grid_size = true;
+		return coloring_status::Ok;
+	} else if (source.filename) {
+		try {
+			picture.load(source.filename);
+			picture.resize(-100, -100, -100, 3); // prevent abort() if picture is gray
+		} catch (CImgException &e) {
+			error = e.what();
+			return coloring_status::BadPicture;
+		}
+	} else {
+		error = QObject::tr("no picture");
+		return coloring_status::BadPicture;
+	}
+	peak = picture.size()*sizeof(float);
+	pixels = (int64_t)picture.width() * picture.height();
+
+	return coloring_status::Ok;
+}
+
+enum coloring_status make_coloring(struct picture_source const &source, QVector<struct color> const &palette, Quantizer const *quantizer, struct col_opt const &opts, struct Coloring &coloring, gmic &gmic_obj, QString *error)
+{
+	return make_coloring(source, palette, quantizer, opts, coloring, [&]() -> gmic & { return gmic_obj; }, error);
+}
+
+enum coloring_status make_coloring(struct picture_source const &source, QVector<struct color> const &palette, Quantizer const *quantizer, struct col_opt const &opts, struct Coloring &coloring, std::function<gmic &()> const &interpreter, QString *error)
 {
 	CImgList<float> cimgList(2);
 	CImgList<char> cimgNames(2);
-	QVector<struct color> palette;
 	QString gmic_cmdline;
 	QByteArray byteArray;
-	gmic gmic_obj;
-    bool result;
+	QString message;
+	bool at_grid_size;
+	int64_t pixels;
+	enum coloring_status status;
+	struct run_stats *stats = &coloring.stats;
 
-	double pic_width = opts.page.width - opts.margin.right - opts.margin.left;
-	double pic_height = opts.page.height - opts.margin.top - opts.margin.bottom;
+	coloring.stats = run_stats();
+
+	if (palette.isEmpty() || (quantizer && quantizer->size() != palette.size())) {
+		if (error)
+			*error = QObject::tr("empty or mismatched palette");
+		return coloring_status::BadPalette;
+	}
+
+	double pic_width, pic_height;
+	picture_area(opts, pic_width, pic_height);
 
-	// Read palette from file
-    result = read_palette(palette_csv_file, palette);
-    if (!result) {
-        qDebug() << Q_FUNC_INFO << "Palette file read error, aborting";
-        exit(EXIT_FAILURE);
-    }
 	palette2CImg(palette, cimgList[1]);
 
-	// Read original picture
-	cimgList[0].load(original_picture);
-	cimgList[0].resize(-100, -100, -100, 3); // prevent abort() if picture is gray
-
-	// build cmdline
-	gmic_cmdline = QString::asprintf(
-					 "-local[0] "
-					 "-if {w>h} -rotate 90 -endif "
-					 "-if {h/w>%g} "
-					 "-r2dy {int(%g)} "
-					 "-else "
-					 "-r2dx {int(%g)} "
-					 "-endif "
-					 "-endlocal "
-					 "-index.. .,1 +map[0] [1] -rm..",
-					 (double)pic_height/(double)pic_width,
-					 (double)pic_height/(double)opts.px_size,
-					 (double)pic_width/(double)opts.px_size
-					);
-
-	// Set names (useless?)
-	cimgNames[1] = "palette";
-	cimgNames[0] = "picture";
-
-	byteArray = gmic_cmdline.toUtf8();
-	gmic_obj.run(byteArray.constData(), cimgList, cimgNames);
-
-	coloring.picture = cimgList[0];
+	{
+		StageTimer timer(stats, "decode");
+		status = load_picture(source, opts, cimgList[0], at_grid_size, coloring.decode_peak, pixels, message);
+	}
+	if (status != coloring_status::Ok) {
+		qDebug() << Q_FUNC_INFO << source.filename << message;
+		if (error)
+			*error = message;
+		return status;
+	}
+
+	try {
+		bool gmic_resize = !at_grid_size && opts.resize.method == resize_method::Gmic;
+		if (gmic_resize) {
+			// build cmdline
+			gmic_cmdline = QString::asprintf(
+							 "-local[0] "
+							 "-if {w>h} -rotate 90 -endif "
+							 "-if {h/w>%g} "
+							 "-r2dy {int(%g)} "
+							 "-else "
+							 "-r2dx {int(%g)} "
+							 "-endif "
+							 "-endlocal ",
+							 (double)pic_height/(double)pic_width,
+							 (double)pic_height/(double)opts.px_size,
+							 (double)pic_width/(double)opts.px_size
+							);
+		} else if (!at_grid_size) {
+			StageTimer timer(stats, "resize");
+			CImg<float> grid;
+			resize_to_grid(cimgList[0], opts, grid, opts.threads);
+			grid.move_to(cimgList[0]);
+		}
+		if (!quantizer)
+			gmic_cmdline += QString::asprintf("-index.. .,%d +map[0] [1] -rm..", opts.quantizer.dithering ? 1 : 0);
+
+		// Set names (useless?)
+		cimgNames[1] = "palette";
+		cimgNames[0] = "picture";
+
+		if (!gmic_cmdline.isEmpty()) {
+			StageTimer timer(stats, !gmic_resize ? "index" : quantizer ? "resize" : "resize_index");
+			byteArray = gmic_cmdline.toUtf8();
+			interpreter().run(byteArray.constData(), cimgList, cimgNames);
+		}
+	} catch (CImgException &e) {
+		message = e.what();
+	} catch (gmic_exception &e) {
+		message = e.what();
+	}
+	if (!message.isEmpty()) {
+		qDebug() << Q_FUNC_INFO << source.filename << message;
+		if (error)
+			*error = message;
+		return coloring_status::ProcessingFailed;
+	}
+
+	if (quantizer) {
+		StageTimer timer(stats, "index");
+		quantizer->index(cimgList[0], coloring.indexes, opts.quantizer.dithering, opts.quantizer.kernel, opts.quantizer.serpentine, opts.threads);
+	} else {
+		CImg<float> const &picture = cimgList[0];
+		coloring.indexes.assign(picture.width(), picture.height(), palette.size());
+		for (int y = 0; y < picture.height(); y += 1) {
+			for (int x = 0; x < picture.width(); x += 1)
+				coloring.indexes.set(x, y, picture(x, y, 0));
+		}
+	}
+	coloring.regions = region_map();
+	if (opts.regions.enabled) {
+		StageTimer timer(stats, "regions");
+		int merged = find_regions(coloring.indexes, opts.regions.min_cells, coloring.regions, opts.threads);
+		stats->count("regions", coloring.regions.count());
+		stats->count("merged_regions", merged);
+	}
 	coloring.palette = palette;
+	stats->count("input_pixels", pixels);
+	stats->count("decode_buffer_bytes", coloring.decode_peak);
+	stats->count("grid_cells", (int64_t)coloring.indexes.width() * coloring.indexes.height());
+	stats->count("palette_colors", palette.size());
+
+	return coloring_status::Ok;
 }
 
-static inline double mm2pdf(int dpi, double mm)
+bool make_coloring(Quantizer const &quantizer, QVector<struct color> const &palette, const char *original_picture, struct col_opt const &opts, struct Coloring &coloring, gmic &gmic_obj)
 {
-	return mm/25.4*(double)dpi;
+	struct picture_source source;
+
+	source.filename = original_picture;
+	return make_coloring(source, palette, &quantizer, opts, coloring, gmic_obj) == coloring_status::Ok;
 }
 
-void coloring2pdf(const char *filename, struct Coloring const &coloring, struct col_opt const &opts, bool soluce)
+bool make_coloring(QVector<struct color> const &palette, const char *original_picture, struct col_opt const &opts, struct Coloring &coloring, gmic &gmic_obj)
 {
-	double offset_x, offset_y;
-	QPdfWriter pdfWriter(filename);
-	QPainter qPainter;
+	struct picture_source source;
 
-	offset_x = (opts.page.width + opts.margin.left - opts.margin.right)/2.0 - coloring.picture.width()*opts.px_size / 2.0;
-	offset_y = (opts.page.height + opts.margin.top - opts.margin.bottom)/2.0 - coloring.picture.height()*opts.px_size / 2.0;
+	source.filename = original_picture;
+	if (!opts.quantizer.native)
+		return make_coloring(source, palette, nullptr, opts, coloring, gmic_obj) == coloring_status::Ok;
 
-	QPageSize pageSize(QSizeF(opts.page.width, opts.page.height), QPageSize::Millimeter);
-	QPageLayout pageLayout(pageSize, QPageLayout::Portrait, QMarginsF(0, 0, 0, 0), QPageLayout::Millimeter);
-	pdfWriter.setPageLayout(pageLayout);
-	pdfWriter.setTitle(QObject::tr("Coloriage !"));
-	pdfWriter.setCreator(QString("any2coloring"));
-	qPainter.begin(&pdfWriter);
+	Quantizer quantizer(palette, opts.quantizer.metric);
+	if (opts.quantizer.search != nearest_search::Auto)
+		quantizer.set_search(opts.quantizer.search);
+	// Dithered values are not 8-bit, the lookup table is useless then.
+	// Automatic mode never builds it: 2^24 searches are more than any grid.
+	if (opts.quantizer.lut_bits > 0 && !opts.quantizer.dithering)
+		quantizer.build_lut(opts.quantizer.lut_bits);
+	return make_coloring(source, palette, &quantizer, opts, coloring, gmic_obj) == coloring_status::Ok;
+}
 
-	if (soluce) {
-		for (int y = 0; y < coloring.picture.height(); y += 1) {
-			for (int x = 0; x < coloring.picture.width(); x += 1) {
-				int R, G, B;
-				double rectx, recty, rectw, recth;
-				R = coloring.palette.at(coloring.picture(x, y, 0)).rgb.R;
-				G = coloring.palette.at(coloring.picture(x, y, 0)).rgb.G;
-				B = coloring.palette.at(coloring.picture(x, y, 0)).rgb.B;
-				rectx = mm2pdf(pdfWriter.resolution(), offset_x + x*opts.px_size);
-				recty = mm2pdf(pdfWriter.resolution(), offset_y + y*opts.px_size);
-				rectw = recth = mm2pdf(pdfWriter.resolution(), opts.px_size);
-				qPainter.fillRect(QRectF(rectx, recty, rectw, recth), QColor(R, G, B));
-			}
-		}
-	} else {
-		QPen penLines;
-		QPen penFonts;
-		QFont font;
-		penLines.setColor(QColor(opts.lineColor, opts.lineColor, opts.lineColor));
-		penLines.setStyle(Qt::SolidLine);
-		penLines.setWidthF(mm2pdf(pdfWriter.resolution(), opts.px_size/20.0));
-		penFonts.setColor(QColor(opts.textColor, opts.textColor, opts.textColor));
-		font.setFamily("Sans");
-		font.setPointSizeF(mm2pdf(pdfWriter.resolution(), opts.px_size)*0.035);
-		qPainter.setFont(font);
-		for (int y = 0; y < coloring.picture.height(); y += 1) {
-			for (int x = 0; x < coloring.picture.width(); x += 1) {
-				double rectx, recty, rectw, recth;
-				rectx = mm2pdf(pdfWriter.resolution(), offset_x + x*opts.px_size);
-				recty = mm2pdf(pdfWriter.resolution(), offset_y + y*opts.px_size);
-				rectw = recth = mm2pdf(pdfWriter.resolution(), opts.px_size);
-				qPainter.setPen(penLines);
-				qPainter.drawRect(QRectF(rectx, recty, rectw, recth));
-				qPainter.setPen(penFonts);
-				qPainter.drawText(QRectF(rectx, recty, rectw, recth), Qt::AlignCenter | Qt::AlignHCenter, coloring.palette.at(coloring.picture(x, y, 0)).name);
+bool make_coloring(const char *palette_csv_file, const char *original_picture, struct col_opt const &opts, struct Coloring &coloring)
+{
+	QVector<struct color> palette;
+	gmic gmic_obj;
+
+	// Read palette from file
+	if (!read_palette(palette_csv_file, palette)) {
+		qDebug() << Q_FUNC_INFO << "Palette file read error";
+		return false;
+	}
+
+	return make_coloring(palette, original_picture, opts, coloring, gmic_obj);
+}
+
+template <typename T>
+static void merge_cell_runs(IndexMap const &indexes, int left, int top, int width, int height, QVector<struct cell_rect> &rects)
+{
+	// Rectangles still growing downwards, ordered by x
+	QVector<struct cell_rect> open;
+	QVector<struct cell_rect> next;
+
+	for (int y = 0; y < height; y += 1) {
+		const T *row = indexes.row<T>(top + y) + left;
+		int k = 0;
+		next.clear();
+		for (int x = 0; x < width; ) {
+			int index = row[x];
+			int end = x + 1;
+			while (end < width && row[end] == index)
+				end += 1;
+			// Rectangles left of this run can't grow anymore
+			while (k < open.size() && open[k].x < x)
+				rects.push_back(open[k++]);
+			if (k < open.size() && open[k].x == x && open[k].width == end - x && open[k].index == index) {
+				open[k].height += 1;
+				next.push_back(open[k++]);
+			} else {
+				next.push_back({x, y, end - x, 1, index});
 			}
+			x = end;
 		}
+		while (k < open.size())
+			rects.push_back(open[k++]);
+		open.swap(next);
 	}
+	for (auto const &rect: open)
+		rects.push_back(rect);
 }
 
+void merge_cell_runs(IndexMap const &indexes, int x, int y, int width, int height, QVector<struct cell_rect> &rects)
+{
+	if (indexes.is_wide())
+		merge_cell_runs<uint16_t>(indexes, x, y, width, height, rects);
+	else
+		merge_cell_runs<uint8_t>(indexes, x, y, width, height, rects);
+}
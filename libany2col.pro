@@ -0,0 +1,42 @@
+# Coloring engine, for any2coloring and programs embedding it
+TEMPLATE = lib
+TARGET = any2col
+CONFIG += staticlib
+
+include(common.pri)
+
+# Input
+HEADERS += \
+    any2col.hpp \
+    decode.hpp \
+    engine.hpp \
+    nearest.hpp \
+    palette_cache.hpp \
+    palette_file.hpp \
+    parallel.hpp \
+    pdf_writer.hpp \
+    preview.hpp \
+    quantize.hpp \
+    raster.hpp \
+    regions.hpp \
+    render.hpp \
+    resize.hpp \
+    result_cache.hpp \
+    stats.hpp
+
+SOURCES += \
+    decode.cpp \
+    engine.cpp \
+    libany2col.cpp \
+    nearest.cpp \
+    palette_cache.cpp \
+    palette_file.cpp \
+    pdf_writer.cpp \
+    preview.cpp \
+    quantize.cpp \
+    raster.cpp \
+    regions.cpp \
+    render.cpp \
+    resize.cpp \
+    result_cache.cpp \
+    stats.cpp
@@ -0,0 +1,397 @@
+/*
+ * Copyright 2017-2022 - Geoffrey Brun <geoffrey@spekadyon.org>
+ *
+ * This file is part of any2coloring.
+ *
+ * any2coloring is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * any2coloring is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * any2coloring. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <vector>
+
+#include "nearest.hpp"
+
+namespace {
+
+// Colors per leaf (trees) or per grid cell, on average
+const int LEAF_SIZE = 8;
+
+struct point {
+	float c[3];
+	int index;
+};
+
+// Same operations, in the same order, as the brute force scan
+inline float distance(point const &p, const float q[3])
+{
+	float d0 = p.c[0] - q[0];
+	float d1 = p.c[1] - q[1];
+	float d2 = p.c[2] - q[2];
+	return d0*d0 + d1*d1 + d2*d2;
+}
+
+inline void consider(point const &p, const float q[3], float &best, int &bestIndex)
+{
+	float dist = distance(p, q);
+	if (dist < best || (dist == best && p.index < bestIndex)) {
+		best = dist;
+		bestIndex = p.index;
+	}
+}
+
+std::vector<point> make_points(const float *c0, const float *c1, const float *c2, int count)
+{
+	std::vector<point> points(count);
+
+	for (int i = 0; i < count; i += 1) {
+		points[i].c[0] = c0[i];
+		points[i].c[1] = c1[i];
+		points[i].c[2] = c2[i];
+		points[i].index = i;
+	}
+
+	return points;
+}
+
+/*
+ * k-d tree, split at the median of the widest axis. A subtree is skipped when
+ * the distance to its splitting plane alone is over the best distance: as
+ * floating point rounding is monotonic, that bound never exceeds the computed
+ * distance of a point behind the plane.
+ */
+class KdTree : public ColorIndex {
+public:
+	KdTree(const float *c0, const float *c1, const float *c2, int count) :
+		points(make_points(c0, c1, c2, count))
+	{
+		build(0, count);
+	}
+
+	int nearest(float c0, float c1, float c2) const override
+	{
+		const float q[3] = {c0, c1, c2};
+		float best = FLT_MAX;
+		int bestIndex = 0;
+		search(0, q, best, bestIndex);
+		return bestIndex;
+	}
+
+private:
+	// Leaf if axis < 0, holding points [begin, end)
+	struct node {
+		int axis;
+		float split;
+		int left;
+		int right;
+		int begin;
+		int end;
+	};
+
+	int build(int begin, int end)
+	{
+		int n = nodes.size();
+		nodes.push_back({-1, 0, -1, -1, begin, end});
+		if (end - begin <= LEAF_SIZE)
+			return n;
+
+		float lo[3] = {FLT_MAX, FLT_MAX, FLT_MAX};
+		float hi[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+		for (int i = begin; i < end; i += 1) {
+			for (int c = 0; c < 3; c += 1) {
+				lo[c] = std::min(lo[c], points[i].c[c]);
+				hi[c] = std::max(hi[c], points[i].c[c]);
+			}
+		}
+		int axis = 0;
+		for (int c = 1; c < 3; c += 1) {
+			if (hi[c] - lo[c] > hi[axis] - lo[axis])
+				axis = c;
+		}
+		if (hi[axis] == lo[axis])
+			return n;
+
+		int mid = (begin + end) / 2;
+		std::nth_element(points.begin() + begin, points.begin() + mid, points.begin() + end,
+		                 [axis](point const &a, point const &b) { return a.c[axis] < b.c[axis]; });
+		float split = points[mid].c[axis];
+		int left = build(begin, mid);
+		int right = build(mid, end);
+		nodes[n].axis = axis;
+		nodes[n].split = split;
+		nodes[n].left = left;
+		nodes[n].right = right;
+
+		return n;
+	}
+
+	void search(int n, const float q[3], float &best, int &bestIndex) const
+	{
+		node const &current = nodes[n];
+
+		if (current.axis < 0) {
+			for (int i = current.begin; i < current.end; i += 1)
+				consider(points[i], q, best, bestIndex);
+			return;
+		}
+
+		// Left points are <= split, right ones >= split
+		float diff = q[current.axis] - current.split;
+		int nearChild = diff < 0 ? current.left : current.right;
+		int farChild = diff < 0 ? current.right : current.left;
+		search(nearChild, q, best, bestIndex);
+		if (diff * diff <= best)
+			search(farChild, q, best, bestIndex);
+	}
+
+	std::vector<point> points;
+	std::vector<struct node> nodes;
+};
+
+/*
+ * Vantage point tree: points are split by their distance to a vantage point,
+ * at the median distance. Triangle inequality bounds are computed in double
+ * precision and widened by a margin far above the float rounding errors, the
+ * final comparisons are those of the brute force scan.
+ */
+class VpTree : public ColorIndex {
+public:
+	VpTree(const float *c0, const float *c1, const float *c2, int count) :
+		points(make_points(c0, c1, c2, count))
+	{
+		build(0, count);
+	}
+
+	int nearest(float c0, float c1, float c2) const override
+	{
+		const float q[3] = {c0, c1, c2};
+		float best = FLT_MAX;
+		int bestIndex = 0;
+		search(0, q, best, bestIndex);
+		return bestIndex;
+	}
+
+private:
+	// Vantage point points[begin], then points closer than radius in
+	// [begin + 1, mid), the others in [mid, end). Leaf if inside < 0.
+	struct node {
+		double radius;
+		int inside;
+		int outside;
+		int begin;
+		int end;
+	};
+
+	static double exact_distance(point const &p, const float q[3])
+	{
+		double d0 = (double)p.c[0] - q[0];
+		double d1 = (double)p.c[1] - q[1];
+		double d2 = (double)p.c[2] - q[2];
+		return std::sqrt(d0*d0 + d1*d1 + d2*d2);
+	}
+
+	int build(int begin, int end)
+	{
+		int n = nodes.size();
+		nodes.push_back({0, -1, -1, begin, end});
+		if (end - begin <= LEAF_SIZE)
+			return n;
+
+		// Vantage point: the farthest point from the centroid
+		double center[3] = {0, 0, 0};
+		for (int i = begin; i < end; i += 1) {
+			for (int c = 0; c < 3; c += 1)
+				center[c] += points[i].c[c];
+		}
+		const float centroid[3] = {float(center[0] / (end - begin)), float(center[1] / (end - begin)), float(center[2] / (end - begin))};
+		int vantage = begin;
+		for (int i = begin + 1; i < end; i += 1) {
+			if (exact_distance(points[i], centroid) > exact_distance(points[vantage], centroid))
+				vantage = i;
+		}
+		std::swap(points[begin], points[vantage]);
+
+		point const vp = points[begin];
+		int mid = (begin + 1 + end) / 2;
+		std::nth_element(points.begin() + begin + 1, points.begin() + mid, points.begin() + end,
+		                 [&vp](point const &a, point const &b) { return exact_distance(a, vp.c) < exact_distance(b, vp.c); });
+		double radius = exact_distance(points[mid], vp.c);
+		int inside = build(begin + 1, mid);
+		int outside = build(mid, end);
+		nodes[n].radius = radius;
+		nodes[n].inside = inside;
+		nodes[n].outside = outside;
+
+		return n;
+	}
+
+	void search(int n, const float q[3], float &best, int &bestIndex) const
+	{
+		node const &current = nodes[n];
+
+		if (current.inside < 0) {
+			for (int i = current.begin; i < current.end; i += 1)
+				consider(points[i], q, best, bestIndex);
+			return;
+		}
+
+		consider(points[current.begin], q, best, bestIndex);
+		double d = exact_distance(points[current.begin], q);
+		// Inside points are at most radius from the vantage point, outside
+		// ones at least radius
+		auto tau = [&]() { return std::sqrt((double)best) * (1 + 1e-5) + 1e-4; };
+		if (d < current.radius) {
+			if (d - tau() <= current.radius)
+				search(current.inside, q, best, bestIndex);
+			if (d + tau() >= current.radius)
+				search(current.outside, q, best, bestIndex);
+		} else {
+			if (d + tau() >= current.radius)
+				search(current.outside, q, best, bestIndex);
+			if (d - tau() <= current.radius)
+				search(current.inside, q, best, bestIndex);
+		}
+	}
+
+	std::vector<point> points;
+	std::vector<struct node> nodes;
+};
+
+/*
+ * Uniform grid over the palette bounding box, colors bucketed by cell. Cells
+ * are visited by growing shells around the query cell, until the distance to
+ * the unvisited cells is over the best distance.
+ */
+class Grid : public ColorIndex {
+public:
+	Grid(const float *c0, const float *c1, const float *c2, int count)
+	{
+		std::vector<point> all = make_points(c0, c1, c2, count);
+
+		cells = std::max(1, std::min(32, (int)std::ceil(std::cbrt((double)count / LEAF_SIZE))));
+		for (int c = 0; c < 3; c += 1) {
+			lo[c] = FLT_MAX;
+			float hi = -FLT_MAX;
+			for (auto const &p: all) {
+				lo[c] = std::min(lo[c], p.c[c]);
+				hi = std::max(hi, p.c[c]);
+			}
+			size[c] = hi > lo[c] ? (hi - lo[c]) / cells : 1;
+		}
+
+		// Counting sort of the points by cell, keeping the palette order
+		std::vector<int> cellOf(count);
+		starts.assign((size_t)cells * cells * cells + 1, 0);
+		for (int i = 0; i < count; i += 1) {
+			cellOf[i] = cell_index(cell(all[i].c[0], 0), cell(all[i].c[1], 1), cell(all[i].c[2], 2));
+			starts[cellOf[i] + 1] += 1;
+		}
+		for (size_t i = 1; i < starts.size(); i += 1)
+			starts[i] += starts[i - 1];
+		points.resize(count);
+		std::vector<int> fill(starts.begin(), starts.end() - 1);
+		for (int i = 0; i < count; i += 1)
+			points[fill[cellOf[i]]++] = all[i];
+	}
+
+	int nearest(float c0, float c1, float c2) const override
+	{
+		const float q[3] = {c0, c1, c2};
+		int qc[3] = {cell(c0, 0), cell(c1, 1), cell(c2, 2)};
+		float best = FLT_MAX;
+		int bestIndex = 0;
+
+		for (int r = 0; ; r += 1) {
+			int from[3], to[3];
+			bool whole = true;
+			for (int c = 0; c < 3; c += 1) {
+				from[c] = std::max(0, qc[c] - r);
+				to[c] = std::min(cells - 1, qc[c] + r);
+				whole = whole && from[c] == 0 && to[c] == cells - 1;
+			}
+			// Shell r: cells at Chebyshev distance r from the query cell
+			for (int i = from[0]; i <= to[0]; i += 1) {
+				for (int j = from[1]; j <= to[1]; j += 1) {
+					bool inner = std::abs(i - qc[0]) < r && std::abs(j - qc[1]) < r;
+					for (int k = from[2]; k <= to[2]; k += 1) {
+						if (inner && std::abs(k - qc[2]) < r) {
+							// Skip to the far side of the shell
+							k = qc[2] + r - 1;
+							continue;
+						}
+						int n = cell_index(i, j, k);
+						for (int p = starts[n]; p < starts[n + 1]; p += 1)
+							consider(points[p], q, best, bestIndex);
+					}
+				}
+			}
+			if (whole)
+				break;
+
+			// Distance to the closest unvisited cell, with a margin for the
+			// rounding of cell coordinates
+			double gap = DBL_MAX;
+			for (int c = 0; c < 3; c += 1) {
+				if (from[c] > 0)
+					gap = std::min(gap, (double)q[c] - (lo[c] + (double)from[c] * size[c]));
+				if (to[c] < cells - 1)
+					gap = std::min(gap, lo[c] + (double)(to[c] + 1) * size[c] - q[c]);
+			}
+			gap -= 1e-3 * (1 + std::fabs(gap));
+			if (gap > 0 && gap * gap > best)
+				break;
+		}
+
+		return bestIndex;
+	}
+
+private:
+	int cell(float v, int c) const
+	{
+		return std::max(0, std::min(cells - 1, (int)std::floor((v - lo[c]) / size[c])));
+	}
+
+	int cell_index(int i, int j, int k) const
+	{
+		return (i * cells + j) * cells + k;
+	}
+
+	int cells;
+	float lo[3];
+	float size[3];
+	std::vector<int> starts;
+	std::vector<point> points;
+};
+
+}
+
+std::unique_ptr<ColorIndex> ColorIndex::create(enum nearest_search search, const float *c0, const float *c1, const float *c2, int count)
+{
+	if (search == nearest_search::Auto)
+		search = count >= KDTREE_MIN_COLORS ? nearest_search::KdTree : nearest_search::BruteForce;
+	if (count <= 0)
+		return nullptr;
+
+	switch (search) {
+	case nearest_search::KdTree:
+		return std::unique_ptr<ColorIndex>(new KdTree(c0, c1, c2, count));
+	case nearest_search::VpTree:
+		return std::unique_ptr<ColorIndex>(new VpTree(c0, c1, c2, count));
+	case nearest_search::Grid:
+		return std::unique_ptr<ColorIndex>(new Grid(c0, c1, c2, count));
+	default:
+		return nullptr;
+	}
+}
@@ -0,0 +1,51 @@
+#ifndef _NEAREST_H_
+#define _NEAREST_H_
+
+/*
+ * Copyright 2017-2022 - Geoffrey Brun <geoffrey@spekadyon.org>
+ *
+ * This file is part of any2coloring.
+ *
+ * any2coloring is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * any2coloring is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * any2coloring. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <memory>
+
+#include "any2col.hpp"
+
+/*
+ * Nearest neighbour index over the palette colors (in the metric color
+ * space), replacing the brute force scan for large palettes.
+ *
+ * Results are exactly those of the brute force scan: distances are computed
+ * with the same floating point operations, pruning is conservative and ties
+ * go to the lowest palette index.
+ */
+class ColorIndex {
+public:
+	virtual ~ColorIndex() {}
+
+	// Nearest color, the first one on ties
+	virtual int nearest(float c0, float c1, float c2) const = 0;
+
+	// Index of the count colors given one channel after the other. Returns
+	// nullptr for brute force (also chosen by Auto for small palettes).
+	static std::unique_ptr<ColorIndex> create(enum nearest_search search, const float *c0, const float *c1, const float *c2, int count);
+};
+
+// Palette size from which nearest_search::Auto uses the k-d tree, about where
+// it gets faster than brute force (bench: nearest_crossover stage)
+const int KDTREE_MIN_COLORS = 256;
+
+#endif /* _NEAREST_H_ */
@@ -0,0 +1,307 @@
+/*
+ * Copyright 2017-2022 - Geoffrey Brun <geoffrey@spekadyon.org>
+ *
+ * This file is part of any2coloring.
+ *
+ * any2coloring is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * any2coloring is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * any2coloring. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QStandardPaths>
+
+#include <cstring>
+
+#include "palette_cache.hpp"
+#include "palette_file.hpp"
+
+namespace {
+
+const char CACHE_MAGIC[8] = {'A', '2', 'C', 'P', 'A', 'L', '\r', '\n'};
+const uint32_t CACHE_VERSION = 1;
+const char CACHE_SUFFIX[] = ".a2cp";
+
+/*
+ * Entry layout, in native byte order (the cache is local to the machine),
+ * every section aligned on 8 bytes:
+ * - header
+ * - RGB colors, 3 bytes per color
+ * - colors in the metric color space, 3 float arrays (one per channel)
+ * - name offsets in the names section, count + 1 uint32
+ * - names, UTF-8, not terminated
+ * - lookup table, 2^(3*lut_bits) entries of lut_index_size bytes
+ */
+struct cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t count;
+	uint32_t metric;
+	uint32_t lut_bits;
+	uint32_t lut_index_size;
+	uint32_t names_size;
+	uint64_t file_size;
+};
+
+struct cache_layout {
+	size_t rgb;
+	size_t metric;
+	size_t name_offsets;
+	size_t names;
+	size_t lut;
+	size_t size;
+};
+
+inline size_t align8(size_t value)
+{
+	return (value + 7) & ~(size_t)7;
+}
+
+cache_layout entry_layout(cache_header const &header)
+{
+	cache_layout layout;
+
+	layout.rgb = align8(sizeof(cache_header));
+	layout.metric = align8(layout.rgb + 3 * (size_t)header.count);
+	layout.name_offsets = align8(layout.metric + 3 * (size_t)header.count * sizeof(float));
+	layout.names = layout.name_offsets + ((size_t)header.count + 1) * sizeof(uint32_t);
+	layout.lut = align8(layout.names + header.names_size);
+	layout.size = layout.lut;
+	if (header.lut_bits)
+		layout.size += Quantizer::lut_entries(header.lut_bits) * header.lut_index_size;
+
+	return layout;
+}
+
+bool valid_entry(const uchar *data, qint64 size, cache_header &header)
+{
+	if (!data || size < (qint64)sizeof(cache_header))
+		return false;
+	memcpy(&header, data, sizeof(header));
+	if (memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) || header.version != CACHE_VERSION)
+		return false;
+	if (header.lut_bits > 8 || header.lut_index_size != (header.count <= 256 ? 1u : 2u))
+		return false;
+	if (header.metric > (uint32_t)color_metric::Lab)
+		return false;
+	cache_layout layout = entry_layout(header);
+	if (header.file_size != (uint64_t)size || layout.size != (size_t)size)
+		return false;
+
+	const uint32_t *offsets = reinterpret_cast<const uint32_t *>(data + layout.name_offsets);
+	if (offsets[0] != 0 || offsets[header.count] != header.names_size)
+		return false;
+	for (uint32_t i = 0; i < header.count; i += 1) {
+		if (offsets[i] > offsets[i + 1])
+			return false;
+	}
+
+	return true;
+}
+
+QByteArray cache_key(QByteArray const &csv, enum color_metric metric, int lut_bits)
+{
+	QCryptographicHash hash(QCryptographicHash::Sha1);
+
+	hash.addData(csv);
+	hash.addData(QByteArray::number(CACHE_VERSION));
+	hash.addData(QByteArray::number((int)metric));
+	hash.addData(QByteArray::number(lut_bits));
+
+	return hash.result().toHex();
+}
+
+QByteArray serialize(QVector<struct color> const &palette, Quantizer const &quantizer)
+{
+	cache_header header;
+	QVector<QByteArray> names;
+	QByteArray data;
+
+	memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+	header.version = CACHE_VERSION;
+	header.count = palette.size();
+	header.metric = (uint32_t)quantizer.metric();
+	header.lut_bits = quantizer.lut_bits();
+	header.lut_index_size = quantizer.lut_index_size();
+	header.names_size = 0;
+	for (auto const &color: palette) {
+		names.push_back(color.name.toUtf8());
+		header.names_size += names.back().size();
+	}
+	cache_layout layout = entry_layout(header);
+	header.file_size = layout.size;
+
+	data.fill(0, layout.size);
+	uchar *ptr = reinterpret_cast<uchar *>(data.data());
+	memcpy(ptr, &header, sizeof(header));
+	for (int i = 0; i < palette.size(); i += 1) {
+		ptr[layout.rgb + 3*i] = palette[i].rgb.R;
+		ptr[layout.rgb + 3*i + 1] = palette[i].rgb.G;
+		ptr[layout.rgb + 3*i + 2] = palette[i].rgb.B;
+	}
+	for (int c = 0; c < 3; c += 1)
+		memcpy(ptr + layout.metric + c * header.count * sizeof(float), quantizer.metric_values(c), header.count * sizeof(float));
+	uint32_t *offsets = reinterpret_cast<uint32_t *>(ptr + layout.name_offsets);
+	offsets[0] = 0;
+	for (int i = 0; i < names.size(); i += 1) {
+		memcpy(ptr + layout.names + offsets[i], names[i].constData(), names[i].size());
+		offsets[i + 1] = offsets[i] + names[i].size();
+	}
+	if (header.lut_bits)
+		memcpy(ptr + layout.lut, quantizer.lut_data(), layout.size - layout.lut);
+
+	return data;
+}
+
+}
+
+PaletteCache::PaletteCache(QString const &directory) :
+	directory(directory)
+{
+}
+
+QString PaletteCache::default_directory()
+{
+	return QDir(QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation)).filePath("any2coloring/palettes");
+}
+
+std::shared_ptr<const Quantizer> PaletteCache::load(const char *palette_csv_file, enum color_metric metric, int lut_bits, QVector<struct color> &palette, struct palette_error *error, enum nearest_search search)
+{
+	QFile csvFile(palette_csv_file);
+
+	if (!csvFile.open(QIODevice::ReadOnly)) {
+		qDebug() << Q_FUNC_INFO << "unable to open" << palette_csv_file << csvFile.errorString();
+		if (error) {
+			*error = palette_error();
+			error->message = csvFile.errorString();
+		}
+		return nullptr;
+	}
+	QByteArray csv = csvFile.readAll();
+	csvFile.close();
+
+	QString entryName = QDir(directory).filePath(QString::fromLatin1(cache_key(csv, metric, lut_bits)) + CACHE_SUFFIX);
+
+	// Hit: everything comes from the mapping, the lookup table is not copied
+	std::shared_ptr<QFile> entry = std::make_shared<QFile>(entryName);
+	if (entry->open(QIODevice::ReadOnly)) {
+		cache_header header;
+		qint64 size = entry->size();
+		const uchar *data = entry->map(0, size);
+		if (valid_entry(data, size, header) && header.metric == (uint32_t)metric && header.lut_bits == (uint32_t)lut_bits) {
+			cache_layout layout = entry_layout(header);
+			const uint32_t *offsets = reinterpret_cast<const uint32_t *>(data + layout.name_offsets);
+			palette.clear();
+			palette.reserve(header.count);
+			for (uint32_t i = 0; i < header.count; i += 1) {
+				struct color Color;
+				Color.rgb.R = data[layout.rgb + 3*i];
+				Color.rgb.G = data[layout.rgb + 3*i + 1];
+				Color.rgb.B = data[layout.rgb + 3*i + 2];
+				Color.name = QString::fromUtf8(reinterpret_cast<const char *>(data + layout.names + offsets[i]), offsets[i + 1] - offsets[i]);
+				palette.push_back(Color);
+			}
+			std::shared_ptr<Quantizer> quantizer = std::make_shared<Quantizer>(palette, metric, reinterpret_cast<const float *>(data + layout.metric));
+			if (search != nearest_search::Auto)
+				quantizer->set_search(search);
+			if (lut_bits)
+				quantizer->attach_lut(lut_bits, data + layout.lut, entry);
+			return quantizer;
+		}
+		qDebug() << Q_FUNC_INFO << "invalid cache entry" << entryName << ", rebuilding";
+		entry->close();
+	}
+
+	// Miss: compile the palette and store it
+	palette.clear();
+	if (!parse_palette(csv.constData(), csv.size(), palette, error))
+		return nullptr;
+	std::shared_ptr<Quantizer> quantizer = std::make_shared<Quantizer>(palette, metric);
+	if (search != nearest_search::Auto)
+		quantizer->set_search(search);
+	if (lut_bits)
+		quantizer->build_lut(lut_bits);
+
+	QSaveFile saveFile(entryName);
+	if (!QDir().mkpath(directory) || !saveFile.open(QIODevice::WriteOnly)) {
+		qDebug() << Q_FUNC_INFO << "unable to write cache entry" << entryName << saveFile.errorString();
+		return quantizer;
+	}
+	saveFile.write(serialize(palette, *quantizer));
+	if (!saveFile.commit())
+		qDebug() << Q_FUNC_INFO << "unable to write cache entry" << entryName << saveFile.errorString();
+
+	return quantizer;
+}
+
+bool PaletteCache::check(bool remove_invalid, int &valid, int &invalid) const
+{
+	QDir dir(directory);
+
+	valid = invalid = 0;
+	if (!dir.exists())
+		return true;
+
+	for (QFileInfo const &info: dir.entryInfoList(QStringList() << QString("*") + CACHE_SUFFIX, QDir::Files)) {
+		QFile entry(info.filePath());
+		cache_header header;
+		bool ok = entry.open(QIODevice::ReadOnly) && valid_entry(entry.map(0, entry.size()), entry.size(), header);
+		entry.close();
+		if (ok) {
+			valid += 1;
+			continue;
+		}
+		invalid += 1;
+		qDebug() << Q_FUNC_INFO << "invalid cache entry" << info.filePath();
+		if (remove_invalid)
+			QFile::remove(info.filePath());
+	}
+
+	// Temporary files left by interrupted writers; recent ones may still be
+	// in use
+	for (QFileInfo const &info: dir.entryInfoList(QStringList() << QString("*") + CACHE_SUFFIX + ".*", QDir::Files)) {
+		if (info.lastModified().secsTo(QDateTime::currentDateTime()) < 3600)
+			continue;
+		invalid += 1;
+		qDebug() << Q_FUNC_INFO << "stale temporary file" << info.filePath();
+		if (remove_invalid)
+			QFile::remove(info.filePath());
+	}
+
+	return true;
+}
+
+bool PaletteCache::clear() const
+{
+	QDir dir(directory);
+	bool ok = true;
+
+	if (!dir.exists())
+		return true;
+
+	QStringList filters;
+	filters << QString("*") + CACHE_SUFFIX << QString("*") + CACHE_SUFFIX + ".*";
+	for (QFileInfo const &info: dir.entryInfoList(filters, QDir::Files)) {
+		if (!QFile::remove(info.filePath())) {
+			qDebug() << Q_FUNC_INFO << "unable to remove" << info.filePath();
+			ok = false;
+		}
+	}
+
+	return ok;
+}
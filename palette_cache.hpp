@@ -0,0 +1,64 @@
+#ifndef _PALETTE_CACHE_H_
+#define _PALETTE_CACHE_H_
+
+/*
+ * Copyright 2017-2022 - Geoffrey Brun <geoffrey@spekadyon.org>
+ *
+ * This file is part of any2coloring.
+ *
+ * any2coloring is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * any2coloring is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * any2coloring. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QString>
+#include <QVector>
+
+#include <memory>
+
+#include "any2col.hpp"
+#include "quantize.hpp"
+
+/*
+ * On-disk cache of compiled palettes: parsed colors, colors in the metric
+ * color space and nearest index lookup table.
+ *
+ * Entries are named after a hash of the palette file content, the metric and
+ * the lookup table resolution. They are written to a temporary file renamed
+ * over the final name, so that concurrent writers never expose a partial
+ * entry, and read back through a memory mapping.
+ */
+class PaletteCache {
+public:
+	explicit PaletteCache(QString const &directory);
+
+	// Default cache directory (user cache location)
+	static QString default_directory();
+
+	// Compiled form of palette_csv_file: loaded from the cache if present,
+	// otherwise built (lut_bits = 0: no lookup table) and stored. Returns
+	// nullptr if the palette can't be read, error (if not null) telling why.
+	// The nearest color search index is not cached, it is built with search.
+	std::shared_ptr<const Quantizer> load(const char *palette_csv_file, enum color_metric metric, int lut_bits, QVector<struct color> &palette,
+	                                      struct palette_error *error = nullptr, enum nearest_search search = nearest_search::Auto);
+
+	// Validate every entry, removing the invalid ones if remove_invalid.
+	// Returns false if the directory can't be read.
+	bool check(bool remove_invalid, int &valid, int &invalid) const;
+	// Remove every entry
+	bool clear() const;
+
+private:
+	QString directory;
+};
+
+#endif /* _PALETTE_CACHE_H_ */
@@ -0,0 +1,250 @@
+/*
+ * Copyright 2017-2022 - Geoffrey Brun <geoffrey@spekadyon.org>
+ *
+ * This file is part of any2coloring.
+ *
+ * any2coloring is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * any2coloring is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * any2coloring. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QDebug>
+#include <QSaveFile>
+#include <QtEndian>
+
+#include <cstdint>
+#include <cstring>
+
+#include "palette_file.hpp"
+
+namespace {
+
+const char PALETTE_MAGIC[8] = {'A', '2', 'C', 'C', 'O', 'L', '\r', '\n'};
+const uint32_t PALETTE_VERSION = 1;
+
+/*
+ * Compiled palette layout, little-endian:
+ * - magic, 8 bytes
+ * - version, color count and names size, 3 uint32
+ * - RGB colors, 3 bytes per color
+ * - name offsets in the names section, count + 1 uint32
+ * - names, UTF-8, not terminated
+ */
+const size_t HEADER_SIZE = sizeof(PALETTE_MAGIC) + 3 * sizeof(uint32_t);
+
+inline uint32_t read_u32(const char *data)
+{
+	return qFromLittleEndian<quint32>(reinterpret_cast<const uchar *>(data));
+}
+
+inline bool is_blank(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+inline int hex_value(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+bool fail(struct palette_error *error, int line, int column, const char *message)
+{
+	qDebug() << Q_FUNC_INFO << "line" << line << "column" << column << ":" << message;
+	if (error) {
+		error->line = line;
+		error->column = column;
+		error->message = message;
+	}
+	return false;
+}
+
+bool load_compiled(const char *data, size_t size, QVector<struct color> &palette, struct palette_error *error)
+{
+	if (size < HEADER_SIZE)
+		return fail(error, 0, 0, "truncated compiled palette");
+	uint32_t version = read_u32(data + 8);
+	uint32_t count = read_u32(data + 12);
+	uint32_t names_size = read_u32(data + 16);
+	if (version != PALETTE_VERSION)
+		return fail(error, 0, 0, "unsupported compiled palette version");
+
+	size_t rgb = HEADER_SIZE;
+	size_t offsets = rgb + 3 * (size_t)count;
+	size_t names = offsets + ((size_t)count + 1) * sizeof(uint32_t);
+	if (count > size || names > size || size - names != names_size)
+		return fail(error, 0, 0, "truncated compiled palette");
+
+	palette.reserve(count);
+	uint32_t start = read_u32(data + offsets);
+	if (start != 0)
+		return fail(error, 0, 0, "invalid compiled palette names");
+	for (uint32_t i = 0; i < count; i += 1) {
+		uint32_t end = read_u32(data + offsets + 4 * ((size_t)i + 1));
+		if (end < start || end > names_size)
+			return fail(error, 0, 0, "invalid compiled palette names");
+		struct color Color;
+		Color.rgb.R = data[rgb + 3*i];
+		Color.rgb.G = data[rgb + 3*i + 1];
+		Color.rgb.B = data[rgb + 3*i + 2];
+		Color.name = QString::fromUtf8(data + names + start, end - start);
+		palette.push_back(Color);
+		start = end;
+	}
+
+	return true;
+}
+
+bool parse_text(const char *data, size_t size, QVector<struct color> &palette, struct palette_error *error)
+{
+	const char *end = data + size;
+
+	// UTF-8 byte order mark, as written by spreadsheet exports
+	if (size >= 3 && !memcmp(data, "\xEF\xBB\xBF", 3))
+		data += 3;
+
+	// One allocation for the whole palette
+	int lines = 1;
+	for (const char *p = data; (p = static_cast<const char *>(memchr(p, '\n', end - p))); p += 1)
+		lines += 1;
+	palette.reserve(lines);
+
+	int line = 0;
+	for (const char *p = data; p < end; ) {
+		const char *eol = static_cast<const char *>(memchr(p, '\n', end - p));
+		if (!eol)
+			eol = end;
+		const char *begin = p;
+		line += 1;
+		p = eol + 1;
+
+		const char *c = begin;
+		while (c < eol && is_blank(*c))
+			c += 1;
+		if (c == eol)
+			continue;
+
+		// Color, "#" or "0x" prefixed or not. "#" lines are comments, unless
+		// "#" is followed by exactly 6 hexadecimal digits and a blank
+		if (*c == '#') {
+			int digits = 0;
+			while (c + 1 + digits < eol && hex_value(c[1 + digits]) >= 0)
+				digits += 1;
+			if (digits != 6 || c + 7 == eol || !is_blank(c[7]))
+				continue;
+			c += 1;
+		} else if (*c == '0' && c + 2 < eol && (c[1] == 'x' || c[1] == 'X') && hex_value(c[2]) >= 0) {
+			c += 2;
+		}
+		const char *digits = c;
+		uint32_t rawcolor = 0;
+		while (c < eol && hex_value(*c) >= 0) {
+			if (c - digits == 6)
+				return fail(error, line, c - begin + 1, "RGB color longer than 6 hexadecimal digits");
+			rawcolor = rawcolor << 4 | hex_value(*c);
+			c += 1;
+		}
+		if (c == digits || (c < eol && !is_blank(*c)))
+			return fail(error, line, c - begin + 1, "invalid RGB color");
+
+		// Name: next word
+		while (c < eol && is_blank(*c))
+			c += 1;
+		if (c == eol)
+			return fail(error, line, c - begin + 1, "missing color name");
+		const char *name = c;
+		while (c < eol && !is_blank(*c))
+			c += 1;
+
+		struct color Color;
+		Color.rgb.R = rawcolor >> 2*8;
+		Color.rgb.G = (rawcolor >> 8) & 0xFF;
+		Color.rgb.B = rawcolor & 0xFF;
+		Color.name = QString::fromUtf8(name, c - name);
+		palette.push_back(Color);
+	}
+
+	return true;
+}
+
+}
+
+bool is_compiled_palette(const char *data, size_t size)
+{
+	return size >= sizeof(PALETTE_MAGIC) && !memcmp(data, PALETTE_MAGIC, sizeof(PALETTE_MAGIC));
+}
+
+bool parse_palette(const char *data, size_t size, QVector<struct color> &palette, struct palette_error *error)
+{
+	palette.clear();
+	if (error)
+		*error = palette_error();
+
+	bool ok = is_compiled_palette(data, size) ? load_compiled(data, size, palette, error) : parse_text(data, size, palette, error);
+	if (!ok)
+		palette.clear();
+
+	return ok;
+}
+
+QByteArray compile_palette(QVector<struct color> const &palette)
+{
+	QVector<QByteArray> names;
+	uint32_t names_size = 0;
+
+	for (auto const &color: palette) {
+		names.push_back(color.name.toUtf8());
+		names_size += names.back().size();
+	}
+
+	size_t count = palette.size();
+	size_t rgb = HEADER_SIZE;
+	size_t offsets = rgb + 3 * count;
+	size_t namesStart = offsets + (count + 1) * sizeof(uint32_t);
+	QByteArray data(namesStart + names_size, '\0');
+	uchar *ptr = reinterpret_cast<uchar *>(data.data());
+
+	memcpy(ptr, PALETTE_MAGIC, sizeof(PALETTE_MAGIC));
+	qToLittleEndian<quint32>(PALETTE_VERSION, ptr + 8);
+	qToLittleEndian<quint32>(count, ptr + 12);
+	qToLittleEndian<quint32>(names_size, ptr + 16);
+	uint32_t offset = 0;
+	qToLittleEndian<quint32>(offset, ptr + offsets);
+	for (size_t i = 0; i < count; i += 1) {
+		ptr[rgb + 3*i] = palette[i].rgb.R;
+		ptr[rgb + 3*i + 1] = palette[i].rgb.G;
+		ptr[rgb + 3*i + 2] = palette[i].rgb.B;
+		memcpy(ptr + namesStart + offset, names[i].constData(), names[i].size());
+		offset += names[i].size();
+		qToLittleEndian<quint32>(offset, ptr + offsets + 4 * (i + 1));
+	}
+
+	return data;
+}
+
+bool write_compiled_palette(const char *filename, QVector<struct color> const &palette)
+{
+	QSaveFile file(filename);
+	QByteArray data = compile_palette(palette);
+
+	if (!file.open(QIODevice::WriteOnly) || file.write(data) != data.size() || !file.commit()) {
+		qDebug() << Q_FUNC_INFO << "unable to write" << filename << file.errorString();
+		return false;
+	}
+
+	return true;
+}
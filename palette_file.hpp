@@ -0,0 +1,51 @@
+#ifndef _PALETTE_FILE_H_
+#define _PALETTE_FILE_H_
+
+/*
+ * Copyright 2017-2022 - Geoffrey Brun <geoffrey@spekadyon.org>
+ *
+ * This file is part of any2coloring.
+ *
+ * any2coloring is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * any2coloring is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * any2coloring. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QByteArray>
+#include <QVector>
+
+#include <cstddef>
+
+#include "any2col.hpp"
+
+/*
+ * Palette files, text or compiled.
+ *
+ * Text palettes have one color per line: a hexadecimal RGB value (optionally
+ * prefixed by "#" or "0x"), blanks, then the color name; the rest of the line
+ * is ignored. Blank lines and comments ("#" not followed by a hexadecimal
+ * digit) are skipped. The text is scanned in place, without per-line
+ * allocations.
+ *
+ * Compiled palettes are a fixed little-endian layout (colors, then name
+ * offsets, then names) read without any parsing; read_palette() recognizes
+ * them by their first bytes.
+ */
+
+// Parse the palette held by data (either form), replacing palette
+bool parse_palette(const char *data, size_t size, QVector<struct color> &palette, struct palette_error *error = nullptr);
+
+bool is_compiled_palette(const char *data, size_t size);
+QByteArray compile_palette(QVector<struct color> const &palette);
+bool write_compiled_palette(const char *filename, QVector<struct color> const &palette);
+
+#endif /* _PALETTE_FILE_H_ */
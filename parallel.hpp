@@ -0,0 +1,124 @@
+#ifndef _PARALLEL_H_
+#define _PARALLEL_H_
+
+/*
+ * Copyright 2017-2022 - Geoffrey Brun <geoffrey@spekadyon.org>
+ *
+ * This file is part of any2coloring.
+ *
+ * any2coloring is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * any2coloring is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * any2coloring. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+inline int ideal_thread_count()
+{
+	return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Call fn(i) for every i in [begin, end), spread over threads (threads <= 0
+// means one per core). Indexes are handed out one by one, so fn() should work
+// on a reasonably large chunk, like a picture row.
+template <typename Fn>
+void parallel_for(int begin, int end, Fn fn, int threads = 0)
+{
+	if (threads <= 0)
+		threads = ideal_thread_count();
+	threads = std::min(threads, end - begin);
+	if (threads <= 1) {
+		for (int i = begin; i < end; i += 1)
+			fn(i);
+		return;
+	}
+
+	std::atomic<int> next(begin);
+	std::vector<std::thread> workers;
+	auto work = [&]() {
+		for (int i = next++; i < end; i = next++)
+			fn(i);
+	};
+	for (int i = 1; i < threads; i += 1)
+		workers.emplace_back(work);
+	work();
+	for (auto &worker: workers)
+		worker.join();
+}
+
+// Fixed capacity FIFO: push() blocks while full, try_push() fails instead,
+// pop() blocks while empty and returns false once the queue is closed and
+// drained.
+template <typename T>
+class JobQueue {
+public:
+	explicit JobQueue(size_t capacity) : capacity(capacity) {}
+
+	void push(T const &job)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		notFull.wait(lock, [this] { return queue.size() < capacity; });
+		queue.push_back(job);
+		notEmpty.notify_one();
+	}
+
+	bool try_push(T const &job)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (queue.size() >= capacity || closed)
+			return false;
+		queue.push_back(job);
+		notEmpty.notify_one();
+		return true;
+	}
+
+	bool pop(T &job)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		notEmpty.wait(lock, [this] { return !queue.empty() || closed; });
+		if (queue.empty())
+			return false;
+		job = queue.front();
+		queue.pop_front();
+		notFull.notify_one();
+		return true;
+	}
+
+	void close()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		closed = true;
+		notEmpty.notify_all();
+	}
+
+	size_t size() const
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return queue.size();
+	}
+
+private:
+	size_t capacity;
+	bool closed = false;
+	std::deque<T> queue;
+	mutable std::mutex mutex;
+	std::condition_variable notEmpty;
+	std::condition_variable notFull;
+};
+
+#endif /* _PARALLEL_H_ */
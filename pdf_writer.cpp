@@ -0,0 +1,475 @@
+/*
+ * Copyright 2017-2022 - Geoffrey Brun <geoffrey@spekadyon.org>
+ *
+ * This file is part of any2coloring.
+ *
+ * any2coloring is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * any2coloring is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * any2coloring. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QByteArray>
+#include <QDebug>
+#include <QMap>
+#include <QObject>
+#include <QPair>
+#include <QSizeF>
+
+#include <algorithm>
+#include <vector>
+
+#include <cmath>
+#include <cstdio>
+
+#include "parallel.hpp"
+#include "pdf_writer.hpp"
+#include "regions.hpp"
+
+namespace {
+
+// Helvetica advance widths (1/1000 em) of the printable ASCII characters
+const short HELVETICA_WIDTHS[95] = {
+	278, 278, 355, 556, 556, 889, 667, 191, 333, 333, 389, 584, 278, 333, 278, 278,	// ' ' to '/'
+	556, 556, 556, 556, 556, 556, 556, 556, 556, 556,				// '0' to '9'
+	278, 278, 584, 584, 584, 556, 1015,						// ':' to '@'
+	667, 667, 722, 722, 667, 611, 778, 722, 278, 500, 667, 556, 833,		// 'A' to 'M'
+	722, 778, 667, 778, 722, 667, 611, 722, 667, 944, 667, 667, 611,		// 'N' to 'Z'
+	278, 278, 278, 469, 556, 333,							// '[' to '`'
+	556, 556, 500, 556, 556, 278, 556, 556, 222, 222, 500, 222, 833,		// 'a' to 'm'
+	556, 556, 556, 556, 333, 500, 278, 556, 500, 722, 500, 500, 500,		// 'n' to 'z'
+	334, 260, 334, 584								// '{' to '~'
+};
+// Helvetica cap height (1/1000 em), labels are centered on it
+const double HELVETICA_CAP_HEIGHT = 718;
+
+inline double mm2pt(double mm)
+{
+	return mm / 25.4 * 72.0;
+}
+
+// Shortest decimal form, decimals at most, followed by a space
+void num(QByteArray &out, double value, int decimals = 2)
+{
+	char buffer[32];
+	int length = snprintf(buffer, sizeof(buffer), "%.*f", decimals, value);
+
+	while (length > 0 && buffer[length - 1] == '0')
+		length -= 1;
+	if (length > 0 && buffer[length - 1] == '.')
+		length -= 1;
+	if (length == 2 && buffer[0] == '-' && buffer[1] == '0')
+		length = 1, buffer[0] = '0';
+	out.append(buffer, length);
+	out.append(' ');
+}
+
+// Latin-1 (WinAnsiEncoding) string literal
+QByteArray pdf_string(QString const &text)
+{
+	QByteArray out("(");
+
+	for (QChar c: text) {
+		char byte = c.unicode() < 256 ? (char)c.unicode() : '?';
+		if (byte == '(' || byte == ')' || byte == '\\')
+			out.append('\\');
+		out.append(byte);
+	}
+	out.append(')');
+
+	return out;
+}
+
+double text_width(QString const &text, double size)
+{
+	double width = 0;
+
+	for (QChar c: text) {
+		ushort code = c.unicode();
+		width += code >= 32 && code < 127 ? HELVETICA_WIDTHS[code - 32] : 556;
+	}
+
+	return width * size / 1000.0;
+}
+
+QByteArray deflate(QByteArray const &data)
+{
+	// qCompress() prepends the uncompressed size to a zlib stream
+	QByteArray compressed = qCompress(data, 6);
+	compressed.remove(0, 4);
+	return compressed;
+}
+
+// Objects are numbered by the caller and written in any order
+class PdfOutput {
+public:
+	explicit PdfOutput(QIODevice *device) : device(device) {}
+
+	void write(QByteArray const &data)
+	{
+		if (ok && device->write(data) != data.size())
+			ok = false;
+		position += data.size();
+	}
+
+	void object(int number, QByteArray const &body)
+	{
+		if ((int)offsets.size() <= number)
+			offsets.resize(number + 1, -1);
+		offsets[number] = position;
+		write(QByteArray::number(number) + " 0 obj\n" + body + "\nendobj\n");
+	}
+
+	// data is already compressed if compressed
+	void stream(int number, QByteArray const &dict, QByteArray const &data, bool compressed)
+	{
+		QByteArray body = "<< " + dict + " /Length " + QByteArray::number(data.size());
+		if (compressed)
+			body += " /Filter /FlateDecode";
+		object(number, body + " >>\nstream\n" + data + "\nendstream");
+	}
+
+	bool finish(int root, int info)
+	{
+		qint64 xref = position;
+		QByteArray table = "xref\n0 " + QByteArray::number(offsets.size()) + "\n";
+		char entry[21];
+
+		table += "0000000000 65535 f \n";
+		for (size_t i = 1; i < offsets.size(); i += 1) {
+			snprintf(entry, sizeof(entry), "%010lld 00000 n \n", (long long)std::max<qint64>(0, offsets[i]));
+			table += entry;
+		}
+		table += "trailer\n<< /Size " + QByteArray::number(offsets.size())
+				+ " /Root " + QByteArray::number(root) + " 0 R"
+				+ " /Info " + QByteArray::number(info) + " 0 R >>\n"
+				+ "startxref\n" + QByteArray::number(xref) + "\n%%EOF\n";
+		write(table);
+
+		return ok;
+	}
+
+	qint64 size() const { return position; }
+
+private:
+	QIODevice *device;
+	qint64 position = 0;
+	bool ok = true;
+	std::vector<qint64> offsets;
+};
+
+// Page geometry, PDF user space (points, origin at the bottom-left corner)
+struct page_geometry {
+	double height;		// page
+	double cell;
+	double left;		// grid top-left corner
+	double top;
+};
+
+struct page_content {
+	QByteArray data;	// compressed
+	int form;		// grid form index, -1: none
+	int fills = 0;
+	int texts = 0;
+};
+
+// Grid lines of a width x height cells area, from its bottom-left corner
+QByteArray grid_form(int width, int height, double cell, double line_width, uint8_t gray)
+{
+	QByteArray out;
+
+	num(out, line_width);
+	out += "w ";
+	num(out, gray / 255.0, 3);
+	out += "G\n";
+	for (int y = 0; y <= height; y += 1) {
+		out += "0 ";
+		num(out, y * cell);
+		out += "m ";
+		num(out, width * cell);
+		num(out, y * cell);
+		out += "l\n";
+	}
+	for (int x = 0; x <= width; x += 1) {
+		num(out, x * cell);
+		out += "0 m ";
+		num(out, x * cell);
+		num(out, height * cell);
+		out += "l\n";
+	}
+	out += "S\n";
+
+	return out;
+}
+
+void page_fills(QByteArray &out, struct page_content &content, struct Coloring const &coloring, struct col_opt const &opts, struct page_tile const &tile, struct page_geometry const &geometry)
+{
+	QVector<struct cell_rect> rects;
+	QRect const &area = tile.area;
+
+	if (opts.merge_cells) {
+		merge_cell_runs(coloring.indexes, area.x(), area.y(), area.width(), area.height(), rects);
+	} else {
+		for (int y = 0; y < area.height(); y += 1) {
+			for (int x = 0; x < area.width(); x += 1)
+				rects.push_back({x, y, 1, 1, coloring.indexes.at(area.x() + x, area.y() + y)});
+		}
+	}
+	// One fill per color
+	std::stable_sort(rects.begin(), rects.end(), [](struct cell_rect const &a, struct cell_rect const &b) {
+		return a.index < b.index;
+	});
+
+	for (int i = 0; i < rects.size(); ) {
+		int index = rects[i].index;
+		struct color const &Color = coloring.palette.at(index);
+		num(out, Color.rgb.R / 255.0, 3);
+		num(out, Color.rgb.G / 255.0, 3);
+		num(out, Color.rgb.B / 255.0, 3);
+		out += "rg\n";
+		for (; i < rects.size() && rects[i].index == index; i += 1) {
+			struct cell_rect const &rect = rects[i];
+			num(out, geometry.left + rect.x * geometry.cell);
+			num(out, geometry.top - (rect.y + rect.height) * geometry.cell);
+			num(out, rect.width * geometry.cell);
+			num(out, rect.height * geometry.cell);
+			out += "re\n";
+		}
+		out += "f\n";
+		content.fills += 1;
+	}
+}
+
+void page_labels(QByteArray &out, struct page_content &content, struct Coloring const &coloring, struct col_opt const &opts, struct page_tile const &tile, struct page_geometry const &geometry)
+{
+	double size = opts.px_size * LABEL_POINTS_PER_MM;
+	QVector<QByteArray> strings;
+	QVector<double> offsets;
+	QRect const &area = tile.area;
+
+	// Label strings and horizontal centering, once per palette entry
+	for (auto const &Color: coloring.palette) {
+		strings.push_back(pdf_string(Color.name));
+		offsets.push_back((geometry.cell - text_width(Color.name, size)) / 2.0);
+	}
+
+	out += "BT\n/F1 ";
+	num(out, size);
+	out += "Tf ";
+	num(out, opts.textColor / 255.0, 3);
+	out += "g\n";
+	// Td moves relative to the previous line start: the line start follows
+	// the rounded moves actually written, so that rounding errors don't add
+	// up along the page
+	double x0 = 0, y0 = 0;
+	double baseline = (geometry.cell - HELVETICA_CAP_HEIGHT * size / 1000.0) / 2.0;
+	auto label = [&](int x, int y) {
+		int index = coloring.indexes.at(area.x() + x, area.y() + y);
+		double tx = geometry.left + x * geometry.cell + offsets[index];
+		double ty = geometry.top - (y + 1) * geometry.cell + baseline;
+		double dx = std::round((tx - x0) * 100.0) / 100.0;
+		double dy = std::round((ty - y0) * 100.0) / 100.0;
+		num(out, dx);
+		num(out, dy);
+		out += "Td ";
+		out += strings[index];
+		out += "Tj\n";
+		x0 += dx;
+		y0 += dy;
+		content.texts += 1;
+	};
+	if (opts.regions.enabled && !coloring.regions.is_empty()) {
+		// One label per region whose label cell is on the page
+		for (QPoint const &cell: coloring.regions.label_cells) {
+			if (area.contains(cell))
+				label(cell.x() - area.x(), cell.y() - area.y());
+		}
+	} else {
+		for (int y = 0; y < area.height(); y += 1) {
+			for (int x = 0; x < area.width(); x += 1)
+				label(x, y);
+		}
+	}
+	out += "ET\n";
+}
+
+// Region outlines of the page, one stroked path
+void page_outlines(QByteArray &out, struct Coloring const &coloring, struct col_opt const &opts, struct page_tile const &tile, struct page_geometry const &geometry)
+{
+	QVector<QLine> lines;
+
+	region_outlines(coloring.regions, tile.area, lines);
+	num(out, mm2pt(opts.px_size / 20.0));
+	out += "w ";
+	num(out, opts.lineColor / 255.0, 3);
+	out += "G\n";
+	for (auto const &line: lines) {
+		num(out, geometry.left + line.x1() * geometry.cell);
+		num(out, geometry.top - line.y1() * geometry.cell);
+		out += "m ";
+		num(out, geometry.left + line.x2() * geometry.cell);
+		num(out, geometry.top - line.y2() * geometry.cell);
+		out += "l\n";
+	}
+	out += "S\n";
+}
+
+void page_marks(QByteArray &out, struct page_content &content, struct col_opt const &opts, struct page_tile const &tile, struct page_geometry const &geometry)
+{
+	QVector<QLineF> lines;
+	QPointF caption_pos;
+	QString caption;
+
+	poster_marks(opts, tile, lines, caption_pos, caption);
+	if (!lines.isEmpty()) {
+		num(out, mm2pt(0.1));
+		out += "w 0 G\n";
+		for (auto const &line: lines) {
+			num(out, mm2pt(line.x1()));
+			num(out, geometry.height - mm2pt(line.y1()));
+			out += "m ";
+			num(out, mm2pt(line.x2()));
+			num(out, geometry.height - mm2pt(line.y2()));
+			out += "l\n";
+		}
+		out += "S\n";
+	}
+
+	out += "BT\n/F1 ";
+	num(out, 3.0 * LABEL_POINTS_PER_MM);
+	out += "Tf 0 g ";
+	num(out, mm2pt(caption_pos.x()));
+	num(out, geometry.height - mm2pt(caption_pos.y()));
+	out += "Td ";
+	out += pdf_string(caption);
+	out += "Tj\nET\n";
+	content.texts += 1;
+}
+
+}
+
+bool coloring2pdf_direct(QIODevice *device, struct Coloring const &coloring, struct col_opt const &opts, enum pdf_content content, struct run_stats *stats)
+{
+	QVector<struct page_tile> tiles = page_tiles(coloring, opts);
+	// With both, the tiles are gone through twice: sheet, then solution
+	std::vector<struct page_content> pages(content == pdf_content::Both ? 2*tiles.size() : tiles.size());
+	QVector<QByteArray> forms;
+	QVector<QSizeF> formSizes;
+	double cell = mm2pt(opts.px_size);
+	double page_width = mm2pt(opts.page.width);
+	double page_height = mm2pt(opts.page.height);
+	bool regions = opts.regions.enabled && !coloring.regions.is_empty();
+
+	{
+		StageTimer timer(stats, "pdf_record");
+
+		// One grid form per page size
+		QMap<QPair<int, int>, int> formIndex;
+		for (auto const &tile: tiles) {
+			QPair<int, int> key(tile.area.width(), tile.area.height());
+			if (content == pdf_content::Soluce || regions || formIndex.contains(key))
+				continue;
+			formIndex.insert(key, forms.size());
+			formSizes.push_back(QSizeF(key.first * cell, key.second * cell));
+			forms.push_back(grid_form(key.first, key.second, cell, mm2pt(opts.px_size / 20.0), opts.lineColor));
+		}
+
+		parallel_for(0, (int)pages.size(), [&](int i) {
+			struct page_tile const &tile = tiles.at(i % tiles.size());
+			struct page_content &page = pages[i];
+			bool soluce = content == pdf_content::Soluce || i >= tiles.size();
+			struct page_geometry geometry;
+			QByteArray out;
+
+			geometry.height = page_height;
+			geometry.cell = cell;
+			geometry.left = mm2pt(tile.origin.x());
+			geometry.top = page_height - mm2pt(tile.origin.y());
+			page.form = -1;
+			if (soluce) {
+				page_fills(out, page, coloring, opts, tile, geometry);
+			} else if (regions) {
+				page_outlines(out, coloring, opts, tile, geometry);
+				page_labels(out, page, coloring, opts, tile, geometry);
+			} else {
+				page.form = formIndex.value(QPair<int, int>(tile.area.width(), tile.area.height()));
+				double bottom = geometry.top - tile.area.height() * cell;
+				out += "q 1 0 0 1 ";
+				num(out, geometry.left);
+				num(out, bottom);
+				out += "cm /G" + QByteArray::number(page.form) + " Do Q\n";
+				page_labels(out, page, coloring, opts, tile, geometry);
+			}
+			if (is_poster(opts) && opts.poster.marks)
+				page_marks(out, page, opts, tile, geometry);
+			page.data = deflate(out);
+		}, opts.threads);
+	}
+
+	StageTimer timer(stats, "pdf_write");
+	PdfOutput pdf(device);
+
+	// 1: catalog, 2: page tree, 3: font, 4: info, 5: resources, then forms,
+	// then content and page objects of every page
+	const int firstForm = 6;
+	int firstPage = firstForm + forms.size();
+	QByteArray mediaBox = "[0 0 ";
+	num(mediaBox, page_width);
+	num(mediaBox, page_height);
+	mediaBox[mediaBox.size() - 1] = ']';
+
+	pdf.write("%PDF-1.4\n%\xe2\xe3\xcf\xd3\n");
+	pdf.object(1, "<< /Type /Catalog /Pages 2 0 R >>");
+	QByteArray kids;
+	for (int i = 0; i < (int)pages.size(); i += 1)
+		kids += QByteArray::number(firstPage + 2*i + 1) + " 0 R ";
+	pdf.object(2, "<< /Type /Pages /Count " + QByteArray::number((int)pages.size()) + " /Kids [" + kids.trimmed() + "] >>");
+	pdf.object(3, "<< /Type /Font /Subtype /Type1 /BaseFont /Helvetica /Encoding /WinAnsiEncoding >>");
+	pdf.object(4, "<< /Title " + pdf_string(QObject::tr("Coloriage !")) + " /Creator (any2coloring) /Producer (any2coloring) >>");
+	QByteArray xobjects;
+	for (int i = 0; i < forms.size(); i += 1)
+		xobjects += "/G" + QByteArray::number(i) + " " + QByteArray::number(firstForm + i) + " 0 R ";
+	pdf.object(5, "<< /Font << /F1 3 0 R >> /XObject << " + xobjects + ">> >>");
+	for (int i = 0; i < forms.size(); i += 1) {
+		QByteArray bbox = "[-1 -1 ";
+		num(bbox, formSizes[i].width() + 1);
+		num(bbox, formSizes[i].height() + 1);
+		bbox[bbox.size() - 1] = ']';
+		QByteArray data = deflate(forms[i]);
+		pdf.stream(firstForm + i, "/Type /XObject /Subtype /Form /BBox " + bbox, data, true);
+	}
+	for (int i = 0; i < (int)pages.size(); i += 1) {
+		int stream = firstPage + 2*i;
+		pdf.stream(stream, "", pages[i].data, true);
+		pdf.object(stream + 1, "<< /Type /Page /Parent 2 0 R /MediaBox " + mediaBox
+		           + " /Resources 5 0 R /Contents " + QByteArray::number(stream) + " 0 R >>");
+	}
+	bool ok = pdf.finish(1, 4);
+	if (!ok)
+		qDebug() << Q_FUNC_INFO << "write error" << device->errorString();
+
+#ifndef A2C_NO_STATS
+	if (stats) {
+		int64_t fills = 0, texts = 0;
+		for (auto const &page: pages) {
+			fills += page.fills;
+			texts += page.texts;
+		}
+		stats->count("pdf_pages", pages.size());
+		stats->count("pdf_objects", firstPage + 2*pages.size() - 1);
+		stats->count("pdf_fills", fills);
+		stats->count("pdf_texts", texts);
+		stats->count("pdf_bytes", pdf.size());
+	}
+#endif
+
+	return ok;
+}
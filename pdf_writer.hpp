@@ -0,0 +1,39 @@
+#ifndef _PDF_WRITER_H_
+#define _PDF_WRITER_H_
+
+/*
+ * Copyright 2017-2022 - Geoffrey Brun <geoffrey@spekadyon.org>
+ *
+ * This file is part of any2coloring.
+ *
+ * any2coloring is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * any2coloring is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * any2coloring. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QIODevice>
+
+#include "any2col.hpp"
+#include "stats.hpp"
+
+/*
+ * Direct PDF output, without QPainter: the page content is written straight
+ * from the index map, with deflate compressed streams. The grid of a page is
+ * a form XObject shared by the pages of the same size, labels use the
+ * standard Helvetica font, which PDF readers provide. Only QtCore is needed.
+ *
+ * Same layout as the QPainter output; same return value and stats as
+ * coloring2pdf().
+ */
+bool coloring2pdf_direct(QIODevice *device, struct Coloring const &coloring, struct col_opt const &opts, enum pdf_content content, struct run_stats *stats = nullptr);
+
+#endif /* _PDF_WRITER_H_ */
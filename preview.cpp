@@ -0,0 +1,317 @@
+/*
+ * Copyright 2017-2022 - Geoffrey Brun <geoffrey@spekadyon.org>
+ *
+ * This file is part of any2coloring.
+ *
+ * any2coloring is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * any2coloring is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * any2coloring. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QDebug>
+#include <QFile>
+#include <QLine>
+#include <QPoint>
+#include <QRect>
+#include <QVector>
+
+#include <algorithm>
+#include <vector>
+
+#include <csetjmp>
+#include <cstdint>
+#include <cstring>
+
+#include <png.h>
+
+#include "parallel.hpp"
+#include "preview.hpp"
+#include "regions.hpp"
+
+namespace {
+
+// 3x5 bitmap font, one row per entry, most significant bit on the left
+const int GLYPH_WIDTH = 3;
+const int GLYPH_HEIGHT = 5;
+
+const uint8_t DIGITS[10][GLYPH_HEIGHT] = {
+	{7, 5, 5, 5, 7}, {2, 6, 2, 2, 7}, {7, 1, 7, 4, 7}, {7, 1, 7, 1, 7}, {5, 5, 7, 1, 1},
+	{7, 4, 7, 1, 7}, {7, 4, 7, 5, 7}, {7, 1, 1, 1, 1}, {7, 5, 7, 5, 7}, {7, 5, 7, 1, 7},
+};
+
+const uint8_t LETTERS[26][GLYPH_HEIGHT] = {
+	{2, 5, 7, 5, 5}, {6, 5, 6, 5, 6}, {7, 4, 4, 4, 7}, {6, 5, 5, 5, 6}, {7, 4, 6, 4, 7},
+	{7, 4, 6, 4, 4}, {7, 4, 5, 5, 7}, {5, 5, 7, 5, 5}, {7, 2, 2, 2, 7}, {1, 1, 1, 5, 7},
+	{5, 5, 6, 5, 5}, {4, 4, 4, 4, 7}, {5, 7, 7, 5, 5}, {6, 5, 5, 5, 5}, {2, 5, 5, 5, 2},
+	{7, 5, 7, 4, 4}, {7, 5, 5, 7, 1}, {6, 5, 6, 5, 5}, {7, 4, 7, 1, 7}, {7, 2, 2, 2, 2},
+	{5, 5, 5, 5, 7}, {5, 5, 5, 5, 2}, {5, 5, 7, 7, 5}, {5, 5, 2, 5, 5}, {5, 5, 2, 2, 2},
+	{7, 1, 2, 4, 7},
+};
+
+const uint8_t DASH[GLYPH_HEIGHT] = {0, 0, 7, 0, 0};
+const uint8_t BLANK[GLYPH_HEIGHT] = {0, 0, 0, 0, 0};
+
+const uint8_t *glyph(QChar c)
+{
+	char l = c.toLatin1();
+
+	if (l >= '0' && l <= '9')
+		return DIGITS[l - '0'];
+	if (l >= 'a' && l <= 'z')
+		return LETTERS[l - 'a'];
+	if (l >= 'A' && l <= 'Z')
+		return LETTERS[l - 'A'];
+	if (l == '-' || l == '_')
+		return DASH;
+	return BLANK;
+}
+
+}
+
+QVector<QPoint> label_pixels(QString const &name, int cell)
+{
+	QVector<QPoint> pixels;
+	int chars = name.size();
+
+	if (chars == 0)
+		return pixels;
+	int width = chars * (GLYPH_WIDTH + 1) - 1;
+	// One pixel of margin on both sides, past the grid line
+	int scale = std::min((cell - 3) / width, (cell - 3) / GLYPH_HEIGHT);
+	if (scale < 1)
+		return pixels;
+
+	int left = 1 + (cell - 1 - width * scale) / 2;
+	int top = 1 + (cell - 1 - GLYPH_HEIGHT * scale) / 2;
+	for (int i = 0; i < chars; i += 1) {
+		const uint8_t *rows = glyph(name.at(i));
+		for (int gy = 0; gy < GLYPH_HEIGHT; gy += 1) {
+			for (int gx = 0; gx < GLYPH_WIDTH; gx += 1) {
+				if (!(rows[gy] & (4 >> gx)))
+					continue;
+				for (int sy = 0; sy < scale; sy += 1) {
+					for (int sx = 0; sx < scale; sx += 1)
+						pixels.push_back(QPoint(left + (i * (GLYPH_WIDTH + 1) + gx) * scale + sx, top + gy * scale + sy));
+				}
+			}
+		}
+	}
+
+	return pixels;
+}
+
+namespace {
+
+// Pixels as 0xffRRGGBB words, like QImage::Format_RGB32
+struct preview_image {
+	int width = 0;
+	int height = 0;
+	std::vector<uint32_t> pixels;
+
+	bool allocate(int w, int h)
+	{
+		// Same limit as QImage: 2 GiB
+		if ((int64_t)w * h > INT32_MAX / 4)
+			return false;
+		width = w;
+		height = h;
+		pixels.resize((size_t)w * h);
+		return true;
+	}
+	uint32_t *scan_line(int y) { return pixels.data() + (size_t)y * width; }
+};
+
+inline uint32_t rgb32(int R, int G, int B)
+{
+	return 0xff000000u | R << 16 | G << 8 | B;
+}
+
+// False if the preview would be empty or too large
+bool render_preview(struct preview_image &image, struct Coloring const &coloring, struct col_opt const &opts, bool soluce, int max_size)
+{
+	IndexMap const &indexes = coloring.indexes;
+	int gw = indexes.width();
+	int gh = indexes.height();
+
+	if (indexes.is_empty())
+		return false;
+
+	int cell = std::max(1, max_size / std::max(gw, gh));
+	// Closing grid line on the right and bottom sides
+	int border = soluce ? 0 : 1;
+	if (!image.allocate(gw * cell + border, gh * cell + border))
+		return false;
+
+	if (soluce) {
+		QVector<uint32_t> colors;
+		for (auto const &color: coloring.palette)
+			colors.push_back(rgb32(color.rgb.R, color.rgb.G, color.rgb.B));
+		parallel_for(0, gh, [&](int y) {
+			uint32_t *first = image.scan_line(y * cell);
+			for (int x = 0; x < gw; x += 1)
+				std::fill(first + x * cell, first + (x + 1) * cell, colors.at(indexes.at(x, y)));
+			for (int row = 1; row < cell; row += 1)
+				memcpy(image.scan_line(y * cell + row), first, gw * cell * sizeof(uint32_t));
+		}, opts.threads);
+		return true;
+	}
+
+	const uint32_t white = rgb32(255, 255, 255);
+	const uint32_t line = rgb32(opts.lineColor, opts.lineColor, opts.lineColor);
+	const uint32_t text = rgb32(opts.textColor, opts.textColor, opts.textColor);
+	bool lines = cell >= 3;
+	QVector<QVector<QPoint>> labels;
+	for (auto const &color: coloring.palette)
+		labels.push_back(label_pixels(color.name, cell));
+
+	if (opts.regions.enabled && !coloring.regions.is_empty()) {
+		// Region outlines and one label per region
+		parallel_for(0, image.height, [&](int y) {
+			uint32_t *pixels = image.scan_line(y);
+			std::fill(pixels, pixels + image.width, white);
+		}, opts.threads);
+		if (lines) {
+			QVector<QLine> outlines;
+			region_outlines(coloring.regions, QRect(0, 0, gw, gh), outlines);
+			for (QLine const &outline: outlines) {
+				if (outline.y1() == outline.y2()) {
+					uint32_t *pixels = image.scan_line(std::min(outline.y1() * cell, image.height - 1));
+					std::fill(pixels + outline.x1() * cell, pixels + std::min(outline.x2() * cell + 1, image.width), line);
+				} else {
+					int x = std::min(outline.x1() * cell, image.width - 1);
+					for (int y = outline.y1() * cell; y <= std::min(outline.y2() * cell, image.height - 1); y += 1)
+						image.scan_line(y)[x] = line;
+				}
+			}
+		}
+		for (QPoint const &cellPos: coloring.regions.label_cells) {
+			for (QPoint const &p: labels.at(indexes.at(cellPos.x(), cellPos.y())))
+				image.scan_line(cellPos.y() * cell + p.y())[cellPos.x() * cell + p.x()] = text;
+		}
+		return true;
+	}
+
+	parallel_for(0, gh, [&](int y) {
+		for (int row = 0; row < cell; row += 1) {
+			uint32_t *pixels = image.scan_line(y * cell + row);
+			if (lines && row == 0) {
+				std::fill(pixels, pixels + image.width, line);
+				continue;
+			}
+			std::fill(pixels, pixels + image.width, white);
+			if (lines) {
+				for (int x = 0; x <= gw; x += 1)
+					pixels[x * cell] = line;
+			}
+		}
+		for (int x = 0; x < gw; x += 1) {
+			for (QPoint const &p: labels.at(indexes.at(x, y)))
+				image.scan_line(y * cell + p.y())[x * cell + p.x()] = text;
+		}
+	}, opts.threads);
+	uint32_t *last = image.scan_line(image.height - 1);
+	std::fill(last, last + image.width, lines ? line : white);
+
+	return true;
+}
+
+void png_write_device(png_structp png, png_bytep data, png_size_t length)
+{
+	QIODevice *device = static_cast<QIODevice *>(png_get_io_ptr(png));
+
+	if (device->write(reinterpret_cast<const char *>(data), length) != (qint64)length)
+		png_error(png, "write error");
+}
+
+bool write_png(QIODevice *device, struct preview_image &image)
+{
+	png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+	png_infop info = png ? png_create_info_struct(png) : nullptr;
+
+	if (!info) {
+		png_destroy_write_struct(&png, &info);
+		return false;
+	}
+	if (setjmp(png_jmpbuf(png))) {
+		png_destroy_write_struct(&png, &info);
+		return false;
+	}
+	png_set_write_fn(png, device, png_write_device, nullptr);
+	png_set_IHDR(png, info, image.width, image.height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+	             PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	// Flat colors compress well even at the fastest zlib level
+	png_set_compression_level(png, 1);
+	png_write_info(png, info);
+	// RGB out of the 0xffRRGGBB words
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+	png_set_bgr(png);
+	png_set_filler(png, 0, PNG_FILLER_AFTER);
+#else
+	png_set_filler(png, 0, PNG_FILLER_BEFORE);
+#endif
+	for (int y = 0; y < image.height; y += 1)
+		png_write_row(png, reinterpret_cast<png_const_bytep>(image.scan_line(y)));
+	png_write_end(png, info);
+	png_destroy_write_struct(&png, &info);
+
+	return true;
+}
+
+}
+
+#ifndef A2C_HEADLESS
+QImage coloring2image(struct Coloring const &coloring, struct col_opt const &opts, bool soluce, int max_size)
+{
+	struct preview_image preview;
+
+	if (!render_preview(preview, coloring, opts, soluce, max_size))
+		return QImage();
+	QImage image(preview.width, preview.height, QImage::Format_RGB32);
+	if (image.isNull())
+		return image;
+	for (int y = 0; y < preview.height; y += 1)
+		memcpy(image.scanLine(y), preview.scan_line(y), preview.width * sizeof(uint32_t));
+
+	return image;
+}
+#endif
+
+bool coloring2preview(QIODevice *device, struct Coloring const &coloring, struct col_opt const &opts, bool soluce, int max_size, struct run_stats *stats)
+{
+	StageTimer timer(stats, "preview");
+	struct preview_image image;
+
+	if (!render_preview(image, coloring, opts, soluce, max_size)) {
+		qDebug() << Q_FUNC_INFO << "empty coloring or preview too large";
+		return false;
+	}
+	if (!write_png(device, image)) {
+		qDebug() << Q_FUNC_INFO << "unable to write preview";
+		return false;
+	}
+	if (stats)
+		stats->count("preview_pixels", (int64_t)image.width * image.height);
+
+	return true;
+}
+
+bool coloring2preview(const char *filename, struct Coloring const &coloring, struct col_opt const &opts, bool soluce, int max_size, struct run_stats *stats)
+{
+	QFile file(filename);
+
+	if (!file.open(QIODevice::WriteOnly)) {
+		qDebug() << Q_FUNC_INFO << "unable to open" << filename << file.errorString();
+		return false;
+	}
+
+	return coloring2preview(&file, coloring, opts, soluce, max_size, stats);
+}
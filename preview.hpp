@@ -0,0 +1,62 @@
+#ifndef _PREVIEW_H_
+#define _PREVIEW_H_
+
+/*
+ * Copyright 2017-2022 - Geoffrey Brun <geoffrey@spekadyon.org>
+ *
+ * This file is part of any2coloring.
+ *
+ * any2coloring is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * any2coloring is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * any2coloring. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QIODevice>
+#include <QPoint>
+#include <QString>
+#include <QVector>
+
+#ifndef A2C_HEADLESS
+#include <QImage>
+#endif
+
+#include <cstddef>
+
+#include "any2col.hpp"
+#include "stats.hpp"
+
+/*
+ * Raster preview of the whole grid, straight from the index map: every cell
+ * is a square of pixels (nearest neighbour upscaling), sized so that the
+ * longest side is at most max_size pixels (at least one pixel per cell).
+ *
+ * Colored cells for the solution, otherwise the grid with its labels, drawn
+ * with a built-in bitmap font (digits and latin letters) when cells are large
+ * enough. Neither fonts nor QPainter are used; the PNG is written by libpng,
+ * with fast compression.
+ */
+#ifndef A2C_HEADLESS
+QImage coloring2image(struct Coloring const &coloring, struct col_opt const &opts, bool soluce, int max_size);
+#endif
+bool coloring2preview(QIODevice *device, struct Coloring const &coloring, struct col_opt const &opts, bool soluce, int max_size, struct run_stats *stats = nullptr);
+bool coloring2preview(const char *filename, struct Coloring const &coloring, struct col_opt const &opts, bool soluce, int max_size, struct run_stats *stats = nullptr);
+
+// Pixels of a label in the built-in font, relative to the corner of a cell of
+// cell x cell pixels, centered in it; empty if it doesn't fit
+QVector<QPoint> label_pixels(QString const &name, int cell);
+
+// Default longest side of previews, in pixels
+const int PREVIEW_SIZE = 1024;
+// Decoding memory budget used for previews when none is given (bytes)
+const size_t PREVIEW_MEMORY = (size_t)1024 * 1048576;
+
+#endif /* _PREVIEW_H_ */
@@ -0,0 +1,394 @@
+/*
+ * Copyright 2017-2022 - Geoffrey Brun <geoffrey@spekadyon.org>
+ *
+ * This file is part of any2coloring.
+ *
+ * any2coloring is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * any2coloring is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * any2coloring. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <cfloat>
+#include <cmath>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "parallel.hpp"
+#include "quantize.hpp"
+
+using namespace cimg_library;
+
+// Far away from any color, for palette padding
+static const float PAD_VALUE = 1e18f;
+
+static inline float srgb2linear(float c)
+{
+	c /= 255.0f;
+	return c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+}
+
+static inline float lab_f(float t)
+{
+	return t > 216.0f / 24389.0f ? std::cbrt(t) : (24389.0f / 27.0f * t + 16.0f) / 116.0f;
+}
+
+void rgb2lab(float R, float G, float B, float &L, float &a, float &b)
+{
+	float r = srgb2linear(R);
+	float g = srgb2linear(G);
+	float bl = srgb2linear(B);
+
+	float X = (0.4124564f * r + 0.3575761f * g + 0.1804375f * bl) / 0.95047f;
+	float Y = 0.2126729f * r + 0.7151522f * g + 0.0721750f * bl;
+	float Z = (0.0193339f * r + 0.1191920f * g + 0.9503041f * bl) / 1.08883f;
+
+	float fx = lab_f(X), fy = lab_f(Y), fz = lab_f(Z);
+	L = 116.0f * fy - 16.0f;
+	a = 500.0f * (fx - fy);
+	b = 200.0f * (fy - fz);
+}
+
+Quantizer::Quantizer(QVector<struct color> const &palette, enum color_metric metric, const float *metric_values) :
+	count(palette.size()),
+	colorMetric(metric),
+	lutBits(0),
+	lut8(nullptr),
+	lut16(nullptr),
+	searchMethod(nearest_search::Auto)
+{
+	int padded = (count + 3) & ~3;
+
+	for (int c = 0; c < 3; c += 1) {
+		rgb[c].assign(padded, PAD_VALUE);
+		pal[c].assign(padded, PAD_VALUE);
+	}
+	for (int i = 0; i < count; i += 1) {
+		rgb[0][i] = palette[i].rgb.R;
+		rgb[1][i] = palette[i].rgb.G;
+		rgb[2][i] = palette[i].rgb.B;
+		if (metric_values) {
+			pal[0][i] = metric_values[i];
+			pal[1][i] = metric_values[count + i];
+			pal[2][i] = metric_values[2*count + i];
+		} else if (metric == color_metric::Lab) {
+			rgb2lab(rgb[0][i], rgb[1][i], rgb[2][i], pal[0][i], pal[1][i], pal[2][i]);
+		} else {
+			pal[0][i] = rgb[0][i];
+			pal[1][i] = rgb[1][i];
+			pal[2][i] = rgb[2][i];
+		}
+	}
+	set_search(nearest_search::Auto);
+}
+
+void Quantizer::set_search(enum nearest_search search)
+{
+	searchMethod = search;
+	searchIndex = ColorIndex::create(search, pal[0].data(), pal[1].data(), pal[2].data(), count);
+}
+
+int Quantizer::nearest_metric(float c0, float c1, float c2) const
+{
+	int padded = pal[0].size();
+	int best = 0;
+	float distmin = FLT_MAX;
+
+#ifdef __SSE2__
+	const __m128 v0 = _mm_set1_ps(c0);
+	const __m128 v1 = _mm_set1_ps(c1);
+	const __m128 v2 = _mm_set1_ps(c2);
+	const __m128i four = _mm_set1_epi32(4);
+	__m128i idx = _mm_setr_epi32(0, 1, 2, 3);
+	__m128i bestIdx = _mm_setzero_si128();
+	__m128 bestDist = _mm_set1_ps(FLT_MAX);
+	for (int i = 0; i < padded; i += 4) {
+		__m128 d0 = _mm_sub_ps(_mm_loadu_ps(&pal[0][i]), v0);
+		__m128 d1 = _mm_sub_ps(_mm_loadu_ps(&pal[1][i]), v1);
+		__m128 d2 = _mm_sub_ps(_mm_loadu_ps(&pal[2][i]), v2);
+		__m128 dist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(d0, d0), _mm_mul_ps(d1, d1)), _mm_mul_ps(d2, d2));
+		__m128i lt = _mm_castps_si128(_mm_cmplt_ps(dist, bestDist));
+		bestDist = _mm_min_ps(dist, bestDist);
+		bestIdx = _mm_or_si128(_mm_and_si128(lt, idx), _mm_andnot_si128(lt, bestIdx));
+		idx = _mm_add_epi32(idx, four);
+	}
+
+	// Each lane kept its first minimum, keep the lowest index among lanes
+	float dists[4];
+	int32_t idxs[4];
+	_mm_storeu_ps(dists, bestDist);
+	_mm_storeu_si128((__m128i *)idxs, bestIdx);
+	best = idxs[0];
+	distmin = dists[0];
+	for (int lane = 1; lane < 4; lane += 1) {
+		if (dists[lane] < distmin || (dists[lane] == distmin && idxs[lane] < best)) {
+			distmin = dists[lane];
+			best = idxs[lane];
+		}
+	}
+#else
+	for (int i = 0; i < padded; i += 1) {
+		float d0 = pal[0][i] - c0;
+		float d1 = pal[1][i] - c1;
+		float d2 = pal[2][i] - c2;
+		float dist = d0*d0 + d1*d1 + d2*d2;
+		if (dist < distmin) {
+			distmin = dist;
+			best = i;
+		}
+	}
+#endif
+
+	return best;
+}
+
+int Quantizer::nearest(float R, float G, float B) const
+{
+	if (colorMetric == color_metric::Lab) {
+		float L, a, b;
+		rgb2lab(R, G, B, L, a, b);
+		return searchIndex ? searchIndex->nearest(L, a, b) : nearest_metric(L, a, b);
+	}
+
+	return searchIndex ? searchIndex->nearest(R, G, B) : nearest_metric(R, G, B);
+}
+
+int Quantizer::nearest_brute_force(float R, float G, float B) const
+{
+	if (colorMetric == color_metric::Lab) {
+		float L, a, b;
+		rgb2lab(R, G, B, L, a, b);
+		return nearest_metric(L, a, b);
+	}
+
+	return nearest_metric(R, G, B);
+}
+
+void Quantizer::build_lut(int bits, int threads)
+{
+	size_t levels = (size_t)1 << bits;
+	int shift = 8 - bits;
+	// Center of each lookup table cell
+	float offset = ((1 << shift) - 1) / 2.0f;
+
+	std::shared_ptr<std::vector<uint8_t>> table = std::make_shared<std::vector<uint8_t>>(lut_entries(bits) * lut_index_size());
+	uint8_t *table8 = table->data();
+	uint16_t *table16 = reinterpret_cast<uint16_t *>(table->data());
+
+	parallel_for(0, (int)levels, [&](int r) {
+		size_t i = (size_t)r * levels * levels;
+		float R = (r << shift) + offset;
+		for (size_t g = 0; g < levels; g += 1) {
+			float G = (g << shift) + offset;
+			for (size_t b = 0; b < levels; b += 1, i += 1) {
+				float B = (b << shift) + offset;
+				int index = nearest(R, G, B);
+				if (count <= 256)
+					table8[i] = index;
+				else
+					table16[i] = index;
+			}
+		}
+	}, threads);
+
+	attach_lut(bits, table->data(), table);
+}
+
+void Quantizer::attach_lut(int bits, const void *table, std::shared_ptr<const void> owner)
+{
+	lutBits = bits;
+	lut8 = count <= 256 ? static_cast<const uint8_t *>(table) : nullptr;
+	lut16 = count <= 256 ? nullptr : static_cast<const uint16_t *>(table);
+	lutOwner = owner;
+}
+
+static inline uint8_t to_uint8(float v)
+{
+	return (uint8_t)(std::min(255.0f, std::max(0.0f, v)) + 0.5f);
+}
+
+template <typename T>
+void Quantizer::index_row(CImg<float> const &picture, int y, T *row) const
+{
+	const float *pR = picture.data(0, y, 0, 0);
+	const float *pG = picture.data(0, y, 0, 1);
+	const float *pB = picture.data(0, y, 0, 2);
+
+	if (has_lut()) {
+		for (int x = 0; x < picture.width(); x += 1)
+			row[x] = nearest_lut(to_uint8(pR[x]), to_uint8(pG[x]), to_uint8(pB[x]));
+	} else {
+		for (int x = 0; x < picture.width(); x += 1)
+			row[x] = nearest(pR[x], pG[x], pB[x]);
+	}
+}
+
+void Quantizer::index(CImg<float> const &picture, IndexMap &indexes, bool dithering, enum dither_kernel kernel, bool serpentine, int threads) const
+{
+	const int w = picture.width();
+	const int h = picture.height();
+
+	indexes.assign(w, h, count);
+
+	if (!dithering) {
+		parallel_for(0, h, [&](int y) {
+			if (indexes.is_wide())
+				index_row(picture, y, indexes.row<uint16_t>(y));
+			else
+				index_row(picture, y, indexes.row<uint8_t>(y));
+		}, threads);
+		return;
+	}
+
+	dither(picture, indexes, kernel, serpentine, threads);
+}
+
+namespace {
+
+// Error diffusion kernels: neighbour offset and weight, in the order errors are
+// added (the order matters to floating point results)
+struct diffusion {
+	int dx;
+	int dy;
+	float weight;
+};
+
+// Polls of the row above before a dithering thread sleeps, a few microseconds
+const int DITHER_SPIN = 1024;
+
+// Same order as CImg::get_index()
+const struct diffusion FLOYD_STEINBERG[] = {
+	{1, 0, 7}, {-1, 1, 3}, {0, 1, 5}, {1, 1, 1}
+};
+
+const struct diffusion SIERRA[] = {
+	                        {1, 0, 5}, {2, 0, 3},
+	{-2, 1, 2}, {-1, 1, 4}, {0, 1, 5}, {1, 1, 4}, {2, 1, 2},
+	            {-1, 2, 2}, {0, 2, 3}, {1, 2, 2}
+};
+
+}
+
+void Quantizer::dither(CImg<float> const &picture, IndexMap &indexes, enum dither_kernel kernel, bool serpentine, int threads) const
+{
+	const int w = picture.width();
+	const int h = picture.height();
+	const struct diffusion *weights = kernel == dither_kernel::Sierra ? SIERRA : FLOYD_STEINBERG;
+	const int nweights = kernel == dither_kernel::Sierra ? sizeof(SIERRA)/sizeof(*SIERRA) : sizeof(FLOYD_STEINBERG)/sizeof(*FLOYD_STEINBERG);
+	const float ndithering = kernel == dither_kernel::Sierra ? 1.0f / 32 : 1.0f / 16;
+	// Largest horizontal reach of the kernel
+	const int reach = kernel == dither_kernel::Sierra ? 2 : 1;
+
+	// Values are clamped to the picture range before computing the error
+	float valm = 0, valM = picture.max_min(valm);
+	if (valm == valM && valm >= 0 && valM <= 255) {
+		valm = 0;
+		valM = 255;
+	}
+
+	CImg<float> work(picture);
+	// Quantize pixel (x, y), diffusing its error forward (dir = 1) or
+	// backward (dir = -1, serpentine odd rows)
+	auto pixel = [&](int x, int y, int dir) {
+		float val[3];
+		float err[3];
+		for (int c = 0; c < 3; c += 1)
+			val[c] = std::min(valM, std::max(valm, work(x, y, 0, c)));
+		int i = nearest(val[0], val[1], val[2]);
+		for (int c = 0; c < 3; c += 1) {
+			err[c] = (val[c] - rgb[c][i]) * ndithering;
+			for (int k = 0; k < nweights; k += 1) {
+				int tx = x + dir * weights[k].dx;
+				int ty = y + weights[k].dy;
+				if (tx >= 0 && tx < w && ty < h)
+					work(tx, ty, 0, c) += weights[k].weight * err[c];
+			}
+		}
+		indexes.set(x, y, i);
+	};
+
+	if (serpentine) {
+		// Rows alternate direction, no wavefront: serial
+		for (int y = 0; y < h; y += 1) {
+			if (y % 2 == 0) {
+				for (int x = 0; x < w; x += 1)
+					pixel(x, y, 1);
+			} else {
+				for (int x = w - 1; x >= 0; x -= 1)
+					pixel(x, y, -1);
+			}
+		}
+		return;
+	}
+
+	/*
+	 * Wavefront: a row is processed by one thread, pixel x only once the
+	 * previous row is done up to x + 2 * reach. Errors diffused to a pixel
+	 * then come in the same order as in a serial scan (rows above first, left
+	 * to right, then the left neighbours), so that the result doesn't depend
+	 * on the thread count.
+	 *
+	 * A thread waiting for the row above spins for a short while, then sleeps
+	 * until that row progresses: with more threads than free cores (batch
+	 * workers dithering at once), spinning would take the time of the threads
+	 * it waits for.
+	 */
+	const int lag = 2 * reach;
+	std::unique_ptr<std::atomic<int>[]> done(new std::atomic<int>[h]);
+	for (int y = 0; y < h; y += 1)
+		done[y].store(0, std::memory_order_relaxed);
+	std::mutex mutex;
+	std::condition_variable progress;
+	std::atomic<int> sleeping(0);
+
+	// Sequentially consistent: a publisher either sees a sleeping thread and
+	// wakes it up, or the thread sees the published progress before sleeping
+	auto publish = [&](int y, int x) {
+		done[y].store(x);
+		if (sleeping.load() > 0) {
+			std::lock_guard<std::mutex> lock(mutex);
+			progress.notify_all();
+		}
+	};
+	auto wait = [&](int y, int needed) {
+		int ready = 0;
+		for (int spin = 0; spin < DITHER_SPIN; spin += 1) {
+			ready = done[y].load(std::memory_order_acquire);
+			if (ready >= needed)
+				return ready;
+		}
+		std::unique_lock<std::mutex> lock(mutex);
+		sleeping += 1;
+		progress.wait(lock, [&] { return (ready = done[y].load()) >= needed; });
+		sleeping -= 1;
+		return ready;
+	};
+
+	parallel_for(0, h, [&](int y) {
+		int ready = y == 0 ? w : 0;
+		for (int x = 0; x < w; x += 1) {
+			int needed = std::min(w, x + lag + 1);
+			if (ready < needed)
+				ready = wait(y - 1, needed);
+			pixel(x, y, 1);
+			// Published by groups of pixels, to limit cache line traffic
+			if ((x & 7) == 7 || x == w - 1)
+				publish(y, x + 1);
+		}
+	}, threads);
+}
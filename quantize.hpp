@@ -0,0 +1,118 @@
+#ifndef _QUANTIZE_H_
+#define _QUANTIZE_H_
+
+/*
+ * Copyright 2017-2022 - Geoffrey Brun <geoffrey@spekadyon.org>
+ *
+ * This file is part of any2coloring.
+ *
+ * any2coloring is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * any2coloring is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * any2coloring. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QVector>
+
+#include <memory>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+#include <CImg.h>
+
+#include "any2col.hpp"
+#include "nearest.hpp"
+
+// sRGB (0-255) to CIELAB, D65 white point
+void rgb2lab(float R, float G, float B, float &L, float &a, float &b);
+
+/*
+ * Native palette mapping, replacing G'MIC's "-index" command.
+ *
+ * Nearest color search is a brute force scan over the palette (vectorized
+ * when SSE2 is available) or, for large palettes, a spatial index
+ * (nearest.hpp), using the squared euclidean distance in the selected color
+ * space. An optional RGB -> index lookup table, with 2^bits
+ * levels per channel, turns the search into a single read per pixel. With 8
+ * bits, the table is exact for 8-bit pixels.
+ */
+class Quantizer {
+public:
+	// metric_values, if given, holds the palette already converted to the
+	// metric color space, one channel after the other (3 * palette size)
+	Quantizer(QVector<struct color> const &palette, enum color_metric metric = color_metric::RGB, const float *metric_values = nullptr);
+
+	int size() const { return count; }
+	enum color_metric metric() const { return colorMetric; }
+
+	// Nearest color search method, nearest_search::Auto when constructed
+	void set_search(enum nearest_search search);
+	enum nearest_search search() const { return searchMethod; }
+	// Brute force scan, whatever the search method
+	int nearest_brute_force(float R, float G, float B) const;
+
+	// Nearest palette entry of a 0-255 RGB color, the first one on ties
+	int nearest(float R, float G, float B) const;
+
+	// Palette channel c (0-2) in the metric color space
+	const float *metric_values(int c) const { return pal[c].data(); }
+
+	// Build the lookup table (1 <= bits <= 8), in parallel
+	void build_lut(int bits, int threads = 0);
+	// Use an existing lookup table, as built by build_lut(). owner keeps the
+	// memory holding the table alive (e.g. a file mapping).
+	void attach_lut(int bits, const void *table, std::shared_ptr<const void> owner);
+	bool has_lut() const { return lutBits > 0; }
+	int lut_bits() const { return lutBits; }
+	// Size of a table entry: 1 byte up to 256 colors, 2 bytes otherwise
+	int lut_index_size() const { return count <= 256 ? 1 : 2; }
+	static size_t lut_entries(int bits) { return (size_t)1 << (3 * bits); }
+	const void *lut_data() const { return lut8 ? (const void *)lut8 : (const void *)lut16; }
+	int nearest_lut(uint8_t R, uint8_t G, uint8_t B) const
+	{
+		int shift = 8 - lutBits;
+		size_t i = ((size_t)(R >> shift) << (2 * lutBits)) | ((size_t)(G >> shift) << lutBits) | (size_t)(B >> shift);
+		return lut8 ? lut8[i] : lut16[i];
+	}
+
+	// Map a 3-channel, 0-255 picture to palette indexes. Without dithering,
+	// the lookup table is used if built (pixels are rounded to 8 bits first).
+	// Dithering is error diffusion with the given kernel; Floyd-Steinberg
+	// follows the same scheme (and floating point operation order) as
+	// CImg::get_index(). Rows are dithered in parallel as a wavefront, with
+	// the same result whatever the thread count (threads <= 0 means one per
+	// core); serpentine scanning (odd rows from right to left) is serial.
+	void index(cimg_library::CImg<float> const &picture, IndexMap &indexes, bool dithering,
+	           enum dither_kernel kernel = dither_kernel::FloydSteinberg, bool serpentine = false, int threads = 0) const;
+
+private:
+	int nearest_metric(float c0, float c1, float c2) const;
+	void dither(cimg_library::CImg<float> const &picture, IndexMap &indexes, enum dither_kernel kernel, bool serpentine, int threads) const;
+	template <typename T>
+	void index_row(cimg_library::CImg<float> const &picture, int y, T *row) const;
+
+	int count;
+	enum color_metric colorMetric;
+	// Palette in RGB and in the metric color space, one array per channel,
+	// padded to a multiple of 4 entries
+	std::vector<float> rgb[3];
+	std::vector<float> pal[3];
+	int lutBits;
+	const uint8_t *lut8;
+	const uint16_t *lut16;
+	std::shared_ptr<const void> lutOwner;
+	enum nearest_search searchMethod;
+	std::shared_ptr<const ColorIndex> searchIndex;
+};
+
+#endif /* _QUANTIZE_H_ */
@@ -0,0 +1,563 @@
+/*
+ * Copyright 2017-2022 - Geoffrey Brun <geoffrey@spekadyon.org>
+ *
+ * This file is part of any2coloring.
+ *
+ * any2coloring is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * any2coloring is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * any2coloring. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QDebug>
+#include <QFile>
+#include <QFileInfo>
+#include <QLineF>
+#include <QPointF>
+#include <QRect>
+#include <QVector>
+
+#ifndef A2C_HEADLESS
+#include <QColor>
+#include <QFont>
+#include <QImage>
+#include <QPainter>
+#endif
+
+#include <algorithm>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <cmath>
+#include <csetjmp>
+#include <cstdint>
+#include <cstring>
+
+#include <png.h>
+
+#include "parallel.hpp"
+#include "preview.hpp"
+#include "raster.hpp"
+#include "regions.hpp"
+
+namespace {
+
+// Strips rendered at once, while as many are encoded
+const int RING_STRIPS = 8;
+// Pixel rows in flight, the whole ring, whatever the core count and the
+// resolution: strips are sized to fit
+const size_t RASTER_BUFFER_BYTES = 64 << 20;
+// Uncompressed TIFF strip size, in bytes (at least one row)
+const int TIFF_STRIP_BYTES = 65536;
+
+inline int mm2px(double mm, int dpi)
+{
+	return (int)std::lround(mm / 25.4 * dpi);
+}
+
+// Page rows, RGB, 3 bytes per pixel
+class RasterEncoder {
+public:
+	virtual ~RasterEncoder() {}
+	virtual bool begin_page(int width, int height) = 0;
+	virtual bool write_rows(const uchar *rows, int count) = 0;
+	virtual bool finish() = 0;
+};
+
+// Through libpng, which streams rows to the zlib compressor
+class PngEncoder : public RasterEncoder {
+public:
+	PngEncoder(QIODevice *device, int dpi) : device(device), dpi(dpi), rowBytes(0)
+	{
+		png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+		info = png ? png_create_info_struct(png) : nullptr;
+	}
+	~PngEncoder() override { png_destroy_write_struct(&png, &info); }
+
+	bool begin_page(int width, int height) override
+	{
+		if (!info || rowBytes > 0)
+			return false;
+		if (setjmp(png_jmpbuf(png)))
+			return false;
+		png_set_write_fn(png, device, write_data, nullptr);
+		png_set_IHDR(png, info, width, height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+		             PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+		png_uint_32 dpm = std::lround(dpi / 0.0254);
+		png_set_pHYs(png, info, dpm, dpm, PNG_RESOLUTION_METER);
+		// Flat colors and repeated rows: the fastest level and the "up"
+		// filter do nearly as well as the defaults
+		png_set_compression_level(png, 1);
+		png_set_filter(png, PNG_FILTER_TYPE_BASE, PNG_FILTER_NONE | PNG_FILTER_UP);
+		png_write_info(png, info);
+		rowBytes = width * 3;
+		return true;
+	}
+
+	bool write_rows(const uchar *rows, int count) override
+	{
+		if (setjmp(png_jmpbuf(png)))
+			return false;
+		for (int y = 0; y < count; y += 1)
+			png_write_row(png, rows + (size_t)y * rowBytes);
+		return true;
+	}
+
+	bool finish() override
+	{
+		if (setjmp(png_jmpbuf(png)))
+			return false;
+		png_write_end(png, info);
+		return true;
+	}
+
+private:
+	static void write_data(png_structp png, png_bytep data, png_size_t length)
+	{
+		QIODevice *device = static_cast<QIODevice *>(png_get_io_ptr(png));
+		if (device->write(reinterpret_cast<const char *>(data), length) != (qint64)length)
+			png_error(png, "write error");
+	}
+
+	QIODevice *device;
+	int dpi;
+	int rowBytes;
+	png_structp png;
+	png_infop info;
+};
+
+/*
+ * Baseline TIFF, little endian, uncompressed: strip sizes are known in
+ * advance, so every page is written as its directory followed by its pixels,
+ * with forward offsets only.
+ */
+class TiffEncoder : public RasterEncoder {
+public:
+	TiffEncoder(QIODevice *device, int dpi, int pages) : device(device), dpi(dpi), pages(pages), page(0), offset(0) {}
+
+	bool begin_page(int width, int height) override
+	{
+		QByteArray out;
+		if (page == 0) {
+			out += "II";
+			put16(out, 42);
+			put32(out, 8);
+		} else if (offset & 1) {
+			// Directories start on a word boundary
+			out += '\0';
+		}
+
+		const int ENTRIES = 14;
+		int rowsPerStrip = std::max(1, TIFF_STRIP_BYTES / (width * 3));
+		int strips = (height + rowsPerStrip - 1) / rowsPerStrip;
+		uint64_t ifd = offset + out.size();
+		uint64_t extra = ifd + 2 + ENTRIES*12 + 4;
+		uint64_t bitsPerSample = extra;
+		uint64_t resolution = bitsPerSample + 6;
+		uint64_t stripOffsets = resolution + 8;
+		uint64_t stripCounts = stripOffsets + (strips > 1 ? 4*strips : 0);
+		uint64_t data = stripCounts + (strips > 1 ? 4*strips : 0);
+		uint64_t bytes = (uint64_t)width * height * 3;
+		uint64_t next = page + 1 < pages ? data + bytes + (bytes & 1) : 0;
+		if (data + bytes > UINT32_MAX) {
+			qDebug() << Q_FUNC_INFO << "TIFF over 4 GiB";
+			return false;
+		}
+
+		put16(out, ENTRIES);
+		entry(out, 256, LONG, 1, width);			// ImageWidth
+		entry(out, 257, LONG, 1, height);			// ImageLength
+		entry(out, 258, SHORT, 3, bitsPerSample);		// BitsPerSample
+		entry(out, 259, SHORT, 1, 1);				// Compression: none
+		entry(out, 262, SHORT, 1, 2);				// PhotometricInterpretation: RGB
+		entry(out, 273, LONG, strips, strips > 1 ? stripOffsets : data);	// StripOffsets
+		entry(out, 277, SHORT, 1, 3);				// SamplesPerPixel
+		entry(out, 278, LONG, 1, rowsPerStrip);		// RowsPerStrip
+		entry(out, 279, LONG, strips, strips > 1 ? stripCounts : bytes);	// StripByteCounts
+		entry(out, 282, RATIONAL, 1, resolution);		// XResolution
+		entry(out, 283, RATIONAL, 1, resolution);		// YResolution
+		entry(out, 284, SHORT, 1, 1);				// PlanarConfiguration: chunky
+		entry(out, 296, SHORT, 1, 2);				// ResolutionUnit: inch
+		entry(out, 297, SHORT, 2, page | (pages << 16));	// PageNumber
+		put32(out, next);
+
+		for (int i = 0; i < 3; i += 1)
+			put16(out, 8);
+		put32(out, dpi);
+		put32(out, 1);
+		if (strips > 1) {
+			uint64_t stripBytes = (uint64_t)rowsPerStrip * width * 3;
+			for (int i = 0; i < strips; i += 1)
+				put32(out, data + i * stripBytes);
+			for (int i = 0; i < strips; i += 1)
+				put32(out, std::min(stripBytes, bytes - i * stripBytes));
+		}
+
+		rowBytes = width * 3;
+		page += 1;
+		return write(out.constData(), out.size());
+	}
+
+	bool write_rows(const uchar *rows, int count) override
+	{
+		return write(reinterpret_cast<const char *>(rows), (qint64)count * rowBytes);
+	}
+
+	bool finish() override { return page == pages; }
+
+private:
+	enum field_type {
+		SHORT = 3,
+		LONG = 4,
+		RATIONAL = 5
+	};
+
+	static void put16(QByteArray &out, uint16_t value)
+	{
+		out += (char)(value & 0xff);
+		out += (char)(value >> 8);
+	}
+
+	static void put32(QByteArray &out, uint32_t value)
+	{
+		put16(out, value & 0xffff);
+		put16(out, value >> 16);
+	}
+
+	// A single SHORT value is left justified, which is where it lands in
+	// little endian
+	static void entry(QByteArray &out, uint16_t tag, enum field_type type, uint32_t count, uint32_t value)
+	{
+		put16(out, tag);
+		put16(out, type);
+		put32(out, count);
+		put32(out, value);
+	}
+
+	bool write(const char *data, qint64 size)
+	{
+		offset += size;
+		return device->write(data, size) == size;
+	}
+
+	QIODevice *device;
+	int dpi;
+	int pages;
+	int page;
+	int rowBytes = 0;
+	uint64_t offset;
+};
+
+// Pixel geometry of a page
+struct raster_page {
+	int width;
+	int height;
+	QVector<int> xs;	// cell edges of the tile area, width + 1 values
+	QVector<int> ys;	// height + 1 values
+	QVector<QRect> marks;	// registration marks
+};
+
+// Cell sprites, shared by the pages
+struct raster_style {
+	int size;		// sprite side, the largest cell
+	int line;		// line width
+	uchar lineGray;
+	std::vector<std::vector<uchar>> sprites;	// per palette entry, RGB rows
+};
+
+void page_geometry(struct raster_page &page, struct col_opt const &opts, struct page_tile const &tile, int dpi)
+{
+	page.width = mm2px(opts.page.width, dpi);
+	page.height = mm2px(opts.page.height, dpi);
+	page.xs.clear();
+	page.ys.clear();
+	for (int x = 0; x <= tile.area.width(); x += 1)
+		page.xs.push_back(mm2px(tile.origin.x() + x * opts.px_size, dpi));
+	for (int y = 0; y <= tile.area.height(); y += 1)
+		page.ys.push_back(mm2px(tile.origin.y() + y * opts.px_size, dpi));
+
+	page.marks.clear();
+	if (!is_poster(opts) || !opts.poster.marks)
+		return;
+	QVector<QLineF> lines;
+	QPointF caption_pos;
+	QString caption;
+	poster_marks(opts, tile, lines, caption_pos, caption);
+	int width = std::max(1, mm2px(0.1, dpi));
+	for (QLineF const &line: lines) {
+		QRect rect(QPoint(mm2px(std::min(line.x1(), line.x2()), dpi), mm2px(std::min(line.y1(), line.y2()), dpi)),
+		           QPoint(mm2px(std::max(line.x1(), line.x2()), dpi), mm2px(std::max(line.y1(), line.y2()), dpi)));
+		if (line.y1() == line.y2())
+			rect.adjust(0, -width/2, 0, width - 1 - width/2);
+		else
+			rect.adjust(-width/2, 0, width - 1 - width/2, 0);
+		page.marks.push_back(rect);
+	}
+}
+
+void make_sprites(struct raster_style &style, struct Coloring const &coloring, struct col_opt const &opts, bool soluce, int dpi)
+{
+	double cell = opts.px_size / 25.4 * dpi;
+	int size = style.size = std::max(1, (int)std::ceil(cell));
+	// Lines drawn on the top and left edges of the cells
+	int line = style.line = std::max(1, mm2px(opts.px_size / 20.0, dpi));
+	bool lines = !(opts.regions.enabled && !coloring.regions.is_empty());
+	uchar text = opts.textColor;
+	style.lineGray = opts.lineColor;
+
+	style.sprites.assign(coloring.palette.size(), std::vector<uchar>());
+	parallel_for(0, coloring.palette.size(), [&](int i) {
+		std::vector<uchar> &sprite = style.sprites[i];
+		struct color const &Color = coloring.palette.at(i);
+		sprite.resize((size_t)size * size * 3);
+		if (soluce) {
+			for (size_t p = 0; p < sprite.size(); p += 3) {
+				sprite[p] = Color.rgb.R;
+				sprite[p + 1] = Color.rgb.G;
+				sprite[p + 2] = Color.rgb.B;
+			}
+			return;
+		}
+
+		std::fill(sprite.begin(), sprite.end(), 255);
+#ifdef A2C_HEADLESS
+		for (QPoint const &p: label_pixels(Color.name, std::max(1, (int)std::lround(cell))))
+			std::fill_n(&sprite[((size_t)p.y() * size + p.x()) * 3], 3, text);
+#else
+		QImage image(size, size, QImage::Format_RGB888);
+		image.fill(Qt::white);
+		{
+			QPainter painter(&image);
+			QFont font("Sans");
+			font.setPixelSize(std::max(1, (int)std::lround(opts.px_size * LABEL_POINTS_PER_MM / 72.0 * dpi)));
+			painter.setRenderHint(QPainter::TextAntialiasing);
+			painter.setFont(font);
+			painter.setPen(QColor(text, text, text));
+			painter.drawText(QRectF(0, 0, cell, cell), Qt::AlignCenter, Color.name);
+		}
+		for (int y = 0; y < size; y += 1)
+			memcpy(&sprite[(size_t)y * size * 3], image.constScanLine(y), size * 3);
+#endif
+		if (lines) {
+			for (int y = 0; y < size; y += 1) {
+				int from = y < line ? size : line;
+				std::fill_n(&sprite[(size_t)y * size * 3], from * 3, style.lineGray);
+			}
+		}
+	}, opts.threads);
+}
+
+// Rectangle rect of the page, clipped to the strip of rows [top, bottom)
+void fill_rect(uchar *strip, int top, int bottom, int width, QRect const &rect, uchar gray)
+{
+	int x0 = std::max(rect.left(), 0);
+	int x1 = std::min(rect.right() + 1, width);
+	if (x0 >= x1)
+		return;
+	for (int y = std::max(rect.top(), top); y < std::min(rect.bottom() + 1, bottom); y += 1)
+		memset(strip + ((size_t)(y - top) * width + x0) * 3, gray, (x1 - x0) * 3);
+}
+
+// Cell rows [first_row, first_row + rows) of the tile, in page rows [top, bottom)
+void render_strip(uchar *strip, int top, int bottom, struct raster_page const &page, struct raster_style const &style,
+                  struct Coloring const &coloring, struct col_opt const &opts, bool soluce, struct page_tile const &tile, int first_row, int rows)
+{
+	QRect const &area = tile.area;
+	bool regions = !soluce && opts.regions.enabled && !coloring.regions.is_empty();
+	size_t stride = (size_t)page.width * 3;
+
+	memset(strip, 255, (bottom - top) * stride);
+	auto blit = [&](int x, int y) {
+		int x0 = page.xs[x];
+		int width = std::min(page.xs[x + 1], page.width) - x0;
+		if (width <= 0)
+			return;
+		std::vector<uchar> const &sprite = style.sprites[coloring.indexes.at(area.x() + x, area.y() + y)];
+		for (int py = page.ys[y]; py < std::min(page.ys[y + 1], bottom); py += 1)
+			memcpy(strip + (py - top) * stride + x0 * 3, &sprite[(size_t)(py - page.ys[y]) * style.size * 3], width * 3);
+	};
+
+	if (regions) {
+		for (QPoint const &label: coloring.regions.label_cells) {
+			int y = label.y() - area.y();
+			if (area.contains(label) && y >= first_row && y < first_row + rows)
+				blit(label.x() - area.x(), y);
+		}
+		QVector<QLine> lines;
+		region_outlines(coloring.regions, area, first_row, rows, lines);
+		for (QLine const &line: lines) {
+			int y1 = page.ys[first_row + line.y1()];
+			int y2 = page.ys[first_row + line.y2()];
+			fill_rect(strip, top, bottom, page.width,
+			          QRect(QPoint(page.xs[line.x1()], y1), QPoint(page.xs[line.x2()] + style.line - 1, y1 == y2 ? y1 + style.line - 1 : y2 - 1)),
+			          style.lineGray);
+		}
+	} else {
+		for (int y = first_row; y < first_row + rows; y += 1) {
+			for (int x = 0; x < area.width(); x += 1)
+				blit(x, y);
+		}
+		if (!soluce) {
+			// Right and bottom edges of the grid, the sprites have the top
+			// and left ones
+			int right = page.xs[area.width()];
+			fill_rect(strip, top, bottom, page.width,
+			          QRect(QPoint(right, page.ys[first_row]), QPoint(right + style.line - 1, page.ys[first_row + rows] - 1)), style.lineGray);
+			if (first_row + rows == area.height()) {
+				int last = page.ys[area.height()];
+				fill_rect(strip, top, bottom, page.width,
+				          QRect(QPoint(page.xs[0], last), QPoint(right + style.line - 1, last + style.line - 1)), style.lineGray);
+			}
+		}
+	}
+
+	for (QRect const &mark: page.marks)
+		fill_rect(strip, top, bottom, page.width, mark, 0);
+}
+
+}
+
+enum raster_format raster_format_of(QString const &filename)
+{
+	QString suffix = QFileInfo(filename).suffix().toLower();
+
+	return suffix == "tif" || suffix == "tiff" ? raster_format::Tiff : raster_format::Png;
+}
+
+bool coloring2raster(QIODevice *device, struct Coloring const &coloring, struct col_opt const &opts, bool soluce, int dpi, enum raster_format format, struct run_stats *stats)
+{
+	if (coloring.indexes.is_empty() || dpi <= 0) {
+		qDebug() << Q_FUNC_INFO << "empty coloring or invalid resolution";
+		return false;
+	}
+	QVector<struct page_tile> tiles = page_tiles(coloring, opts);
+	if (format == raster_format::Png && tiles.size() > 1) {
+		qDebug() << Q_FUNC_INFO << "PNG holds a single page, use TIFF for posters";
+		return false;
+	}
+
+	struct raster_style style;
+	{
+		StageTimer timer(stats, "raster_sprites");
+		make_sprites(style, coloring, opts, soluce, dpi);
+	}
+
+	StageTimer timer(stats, "raster");
+	std::unique_ptr<RasterEncoder> encoder;
+	if (format == raster_format::Png)
+		encoder.reset(new PngEncoder(device, dpi));
+	else
+		encoder.reset(new TiffEncoder(device, dpi, tiles.size()));
+
+	/*
+	 * A ring of 2 * RING_STRIPS strip buffers: one half is rendered while
+	 * the other one is encoded, so that the rows in memory stay within
+	 * RASTER_BUFFER_BYTES, however many cores render them.
+	 */
+	std::vector<uchar> buffers[2][RING_STRIPS];
+	int bufferRows[2][RING_STRIPS];
+	size_t bufferBytes = 0, peakBytes = 0;
+	std::thread encoding;
+	bool ok = true;
+	int64_t pixels = 0;
+	auto encoded = [&]() {
+		if (encoding.joinable())
+			encoding.join();
+		return ok;
+	};
+
+	for (int i = 0; i < tiles.size(); i += 1) {
+		struct page_tile const &tile = tiles.at(i);
+		struct raster_page page;
+		page_geometry(page, opts, tile, dpi);
+		int height = tile.area.height();
+		size_t stripCellBytes = (size_t)style.size * page.width * 3;
+		int stripCells = qBound<size_t>(1, RASTER_BUFFER_BYTES / (2 * RING_STRIPS) / stripCellBytes, std::max(height, 1));
+		int strips = (height + stripCells - 1) / stripCells;
+		if (!encoded() || !encoder->begin_page(page.width, page.height)) {
+			ok = false;
+			break;
+		}
+		pixels += (int64_t)page.width * page.height;
+
+		for (int first = 0, b = 0; first < strips; first += RING_STRIPS, b ^= 1) {
+			int count = std::min(RING_STRIPS, strips - first);
+			for (int s = 0; s < count; s += 1) {
+				int strip = first + s;
+				int first_row = strip * stripCells;
+				int rows = std::min(stripCells, height - first_row);
+				// The first and last strips take the page margins
+				int top = strip == 0 ? 0 : std::min(page.ys[first_row], page.height);
+				int bottom = strip == strips - 1 ? page.height : std::min(page.ys[first_row + rows], page.height);
+				std::vector<uchar> &buffer = buffers[b][s];
+				bufferBytes -= buffer.capacity();
+				buffer.resize((size_t)(bottom - top) * page.width * 3);
+				bufferBytes += buffer.capacity();
+				bufferRows[b][s] = bottom - top;
+			}
+			peakBytes = std::max(peakBytes, bufferBytes);
+			parallel_for(0, count, [&](int s) {
+				int strip = first + s;
+				int first_row = strip * stripCells;
+				int rows = std::min(stripCells, height - first_row);
+				int top = strip == 0 ? 0 : std::min(page.ys[first_row], page.height);
+				if (bufferRows[b][s] > 0)
+					render_strip(buffers[b][s].data(), top, top + bufferRows[b][s], page, style, coloring, opts, soluce, tile, first_row, rows);
+			}, opts.threads);
+			if (!encoded())
+				break;
+			encoding = std::thread([&, b, count]() {
+				for (int s = 0; s < count && ok; s += 1)
+					ok = encoder->write_rows(buffers[b][s].data(), bufferRows[b][s]);
+			});
+		}
+	}
+	ok = encoded() && ok;
+	// Strip buffers are not needed by the encoder anymore
+	for (auto &half: buffers) {
+		for (std::vector<uchar> &buffer: half)
+			std::vector<uchar>().swap(buffer);
+	}
+	ok = ok && encoder->finish();
+
+	if (stats) {
+		stats->count("raster_pages", tiles.size());
+		stats->count("raster_pixels", pixels);
+		stats->count("raster_sprites", style.sprites.size());
+		stats->count("raster_buffer_bytes", peakBytes);
+	}
+	if (!ok)
+		qDebug() << Q_FUNC_INFO << "unable to write the raster";
+
+	return ok;
+}
+
+bool coloring2raster(const char *filename, struct Coloring const &coloring, struct col_opt const &opts, bool soluce, int dpi, struct run_stats *stats)
+{
+	QFile file(QString::fromLocal8Bit(filename));
+
+	if (!file.open(QIODevice::WriteOnly)) {
+		qDebug() << Q_FUNC_INFO << "unable to open" << filename << file.errorString();
+		return false;
+	}
+	if (!coloring2raster(&file, coloring, opts, soluce, dpi, raster_format_of(file.fileName()), stats))
+		return false;
+	file.close();
+	if (file.error() != QFileDevice::NoError) {
+		qDebug() << Q_FUNC_INFO << "unable to write" << filename << file.errorString();
+		return false;
+	}
+	if (stats)
+		stats->count("raster_bytes", QFileInfo(file).size());
+
+	return true;
+}
@@ -0,0 +1,56 @@
+#ifndef _RASTER_H_
+#define _RASTER_H_
+
+/*
+ * Copyright 2017-2022 - Geoffrey Brun <geoffrey@spekadyon.org>
+ *
+ * This file is part of any2coloring.
+ *
+ * any2coloring is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * any2coloring is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * any2coloring. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QIODevice>
+#include <QString>
+
+#include "any2col.hpp"
+#include "stats.hpp"
+
+/*
+ * Print resolution raster of the pages, for printers that want pictures
+ * rather than a PDF. Every palette entry is drawn once as a cell sprite (its
+ * colour, or the outlined cell with its label), then sprites are copied from
+ * the index map into strips of rows, rendered in parallel and written in
+ * order: a fixed budget of rows is in memory, never the whole page (the
+ * peak is counted as "raster_buffer_bytes"). Cell edges are rounded to the
+ * nearest pixel, so that the grid keeps its printed size.
+ *
+ * PNG holds one page; TIFF (uncompressed, written without seeking) holds
+ * every page of a poster. Registration marks are drawn, page captions are
+ * not. Labels use the PDF font, or the preview bitmap font in headless
+ * builds.
+ */
+enum class raster_format {
+	Png,
+	Tiff
+};
+
+// Default raster resolution (dots per inch)
+const int RASTER_DPI = 300;
+
+// TIFF for .tif and .tiff files, PNG otherwise
+enum raster_format raster_format_of(QString const &filename);
+bool coloring2raster(QIODevice *device, struct Coloring const &coloring, struct col_opt const &opts, bool soluce, int dpi, enum raster_format format, struct run_stats *stats = nullptr);
+bool coloring2raster(const char *filename, struct Coloring const &coloring, struct col_opt const &opts, bool soluce, int dpi, struct run_stats *stats = nullptr);
+
+#endif /* _RASTER_H_ */
@@ -0,0 +1,335 @@
+/*
+ * Copyright 2017-2022 - Geoffrey Brun <geoffrey@spekadyon.org>
+ *
+ * This file is part of any2coloring.
+ *
+ * any2coloring is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * any2coloring is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * any2coloring. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <numeric>
+
+#include "parallel.hpp"
+#include "regions.hpp"
+
+namespace {
+
+// Union-find over cell positions: a root is the smallest position of its
+// set, so parent[i] <= i
+inline int32_t find_root(std::vector<int32_t> &parent, int32_t i)
+{
+	while (parent[i] != i) {
+		parent[i] = parent[parent[i]];
+		i = parent[i];
+	}
+	return i;
+}
+
+inline void unite(std::vector<int32_t> &parent, int32_t a, int32_t b)
+{
+	a = find_root(parent, a);
+	b = find_root(parent, b);
+	if (a < b)
+		parent[b] = a;
+	else if (b < a)
+		parent[a] = b;
+}
+
+// Rows y0 to y1 (excluded), only touching the parents of their own cells
+template <typename T>
+void label_strip(IndexMap const &indexes, std::vector<int32_t> &parent, int y0, int y1)
+{
+	int width = indexes.width();
+
+	for (int y = y0; y < y1; y += 1) {
+		const T *row = indexes.row<T>(y);
+		const T *above = y > y0 ? indexes.row<T>(y - 1) : nullptr;
+		int32_t first = (int32_t)y * width;
+		for (int x = 0; x < width; x += 1) {
+			int32_t i = first + x;
+			parent[i] = i;
+			if (x > 0 && row[x - 1] == row[x])
+				unite(parent, i - 1, i);
+			if (above && above[x] == row[x])
+				unite(parent, i - width, i);
+		}
+	}
+}
+
+template <typename T>
+void join_strips(IndexMap const &indexes, std::vector<int32_t> &parent, int y)
+{
+	const T *row = indexes.row<T>(y);
+	const T *above = indexes.row<T>(y - 1);
+	int32_t first = (int32_t)y * indexes.width();
+
+	for (int x = 0; x < indexes.width(); x += 1) {
+		if (above[x] == row[x])
+			unite(parent, first + x - indexes.width(), first + x);
+	}
+}
+
+// Merge regions under min_cells, rewrite the palette index of their cells
+int merge_regions(IndexMap &indexes, std::vector<int32_t> const &labels, int count, int min_cells)
+{
+	int width = indexes.width();
+	int height = indexes.height();
+	std::vector<int> sizes(count, 0);
+	std::vector<int> index(count, -1);
+
+	for (int y = 0; y < height; y += 1) {
+		for (int x = 0; x < width; x += 1) {
+			int32_t label = labels[(size_t)y * width + x];
+			if (sizes[label]++ == 0)
+				index[label] = indexes.at(x, y);
+		}
+	}
+
+	std::vector<int32_t> small;
+	std::vector<bool> isSmall(count, false);
+	for (int32_t label = 0; label < count; label += 1) {
+		if (sizes[label] < min_cells) {
+			small.push_back(label);
+			isSmall[label] = true;
+		}
+	}
+	if (small.empty())
+		return 0;
+
+	// Neighbour across every unit border of the small regions, grouped by
+	// region (counting sort)
+	auto for_each_border = [&](auto const &fn) {
+		for (int y = 0; y < height; y += 1) {
+			const int32_t *row = labels.data() + (size_t)y * width;
+			for (int x = 0; x < width; x += 1) {
+				if (x + 1 < width && row[x] != row[x + 1])
+					fn(row[x], row[x + 1]);
+				if (y + 1 < height && row[x] != row[x + width])
+					fn(row[x], row[x + width]);
+			}
+		}
+	};
+	std::vector<int32_t> first(count + 1, 0);
+	for_each_border([&](int32_t a, int32_t b) {
+		first[a + 1] += isSmall[a];
+		first[b + 1] += isSmall[b];
+	});
+	std::partial_sum(first.begin(), first.end(), first.begin());
+	std::vector<int32_t> neighbours(first[count]);
+	std::vector<int32_t> next(first.begin(), first.end() - 1);
+	for_each_border([&](int32_t a, int32_t b) {
+		if (isSmall[a])
+			neighbours[next[a]++] = b;
+		if (isSmall[b])
+			neighbours[next[b]++] = a;
+	});
+
+	// Regions merged so far form groups: a union-find whose root is the
+	// region merged into, and a list of members
+	std::vector<int32_t> target(count);
+	std::iota(target.begin(), target.end(), 0);
+	std::vector<int32_t> nextMember(count, -1);
+	std::vector<int32_t> lastMember(target);
+	auto group = [&target](int32_t label) {
+		while (target[label] != label) {
+			target[label] = target[target[label]];
+			label = target[label];
+		}
+		return label;
+	};
+
+	std::stable_sort(small.begin(), small.end(), [&](int32_t a, int32_t b) { return sizes[a] < sizes[b]; });
+	std::vector<int> length(count, 0);
+	std::vector<int32_t> touched;
+	int merged = 0;
+	for (int32_t label: small) {
+		if (target[label] != label || sizes[label] >= min_cells)
+			continue;
+
+		// Border length with every neighbour group, all members being
+		// small regions
+		touched.clear();
+		for (int32_t member = label; member >= 0; member = nextMember[member]) {
+			for (int32_t k = first[member]; k < first[member + 1]; k += 1) {
+				int32_t neighbour = group(neighbours[k]);
+				if (neighbour != label && length[neighbour]++ == 0)
+					touched.push_back(neighbour);
+			}
+		}
+		int32_t best = -1;
+		for (int32_t neighbour: touched) {
+			if (best < 0 || length[neighbour] > length[best] || (length[neighbour] == length[best] && neighbour < best))
+				best = neighbour;
+		}
+		for (int32_t neighbour: touched)
+			length[neighbour] = 0;
+		if (best < 0)
+			continue;
+
+		target[label] = best;
+		sizes[best] += sizes[label];
+		nextMember[lastMember[best]] = label;
+		lastMember[best] = lastMember[label];
+		merged += 1;
+	}
+
+	for (int y = 0; y < height; y += 1) {
+		for (int x = 0; x < width; x += 1) {
+			int32_t label = labels[(size_t)y * width + x];
+			int32_t root = group(label);
+			if (root != label)
+				indexes.set(x, y, index[root]);
+		}
+	}
+
+	return merged;
+}
+
+// Cell farthest from the region border, outside of the grid counting as border
+void place_labels(struct region_map &regions, int height, int count)
+{
+	int width = regions.width;
+	std::vector<int32_t> const &labels = regions.labels;
+	std::vector<int32_t> distance(labels.size());
+
+	for (int y = 0; y < height; y += 1) {
+		for (int x = 0; x < width; x += 1) {
+			size_t i = (size_t)y * width + x;
+			int32_t left = x > 0 && labels[i - 1] == labels[i] ? distance[i - 1] : 0;
+			int32_t up = y > 0 && labels[i - width] == labels[i] ? distance[i - width] : 0;
+			distance[i] = std::min(left, up) + 1;
+		}
+	}
+	for (int y = height - 1; y >= 0; y -= 1) {
+		for (int x = width - 1; x >= 0; x -= 1) {
+			size_t i = (size_t)y * width + x;
+			int32_t right = x + 1 < width && labels[i + 1] == labels[i] ? distance[i + 1] : 0;
+			int32_t down = y + 1 < height && labels[i + width] == labels[i] ? distance[i + width] : 0;
+			distance[i] = std::min(distance[i], std::min(right, down) + 1);
+		}
+	}
+
+	std::vector<int32_t> best(count, 0);
+	regions.label_cells.fill(QPoint(), count);
+	for (int y = 0; y < height; y += 1) {
+		for (int x = 0; x < width; x += 1) {
+			size_t i = (size_t)y * width + x;
+			if (distance[i] > best[labels[i]]) {
+				best[labels[i]] = distance[i];
+				regions.label_cells[labels[i]] = QPoint(x, y);
+			}
+		}
+	}
+}
+
+}
+
+int label_regions(IndexMap const &indexes, std::vector<int32_t> &labels, int threads)
+{
+	int width = indexes.width();
+	int height = indexes.height();
+	std::vector<int32_t> parent((size_t)width * height);
+
+	labels.assign(parent.size(), 0);
+	if (parent.empty())
+		return 0;
+
+	if (threads <= 0)
+		threads = ideal_thread_count();
+	int strips = std::max(1, std::min(threads, height / 16));
+	auto first_row = [height, strips](int strip) { return (int)((int64_t)height * strip / strips); };
+	parallel_for(0, strips, [&](int strip) {
+		if (indexes.is_wide())
+			label_strip<uint16_t>(indexes, parent, first_row(strip), first_row(strip + 1));
+		else
+			label_strip<uint8_t>(indexes, parent, first_row(strip), first_row(strip + 1));
+	}, threads);
+	for (int strip = 1; strip < strips; strip += 1) {
+		if (indexes.is_wide())
+			join_strips<uint16_t>(indexes, parent, first_row(strip));
+		else
+			join_strips<uint8_t>(indexes, parent, first_row(strip));
+	}
+
+	// Roots come first: their number is known when their cells are reached
+	int count = 0;
+	for (size_t i = 0; i < parent.size(); i += 1)
+		labels[i] = parent[i] == (int32_t)i ? count++ : labels[find_root(parent, i)];
+
+	return count;
+}
+
+int find_regions(IndexMap &indexes, int min_cells, struct region_map &regions, int threads)
+{
+	regions = region_map();
+	regions.width = indexes.width();
+	int count = label_regions(indexes, regions.labels, threads);
+	int merged = 0;
+
+	if (count == 0)
+		return 0;
+	if (min_cells > 1) {
+		merged = merge_regions(indexes, regions.labels, count, min_cells);
+		// Merged regions may now touch others of their new index
+		if (merged > 0)
+			count = label_regions(indexes, regions.labels, threads);
+	}
+	place_labels(regions, indexes.height(), count);
+
+	return merged;
+}
+
+void region_outlines(struct region_map const &regions, QRect const &area, QVector<QLine> &lines)
+{
+	region_outlines(regions, area, 0, area.height(), lines);
+}
+
+void region_outlines(struct region_map const &regions, QRect const &area, int first_row, int rows, QVector<QLine> &lines)
+{
+	int width = area.width();
+	int height = area.height();
+	int last = first_row + rows == height ? rows : rows - 1;
+
+	lines.clear();
+	// Horizontal borders above row y of the band, runs merged
+	for (int y = 0; y <= last; y += 1) {
+		int row = first_row + y;
+		int start = -1;
+		for (int x = 0; x <= width; x += 1) {
+			bool edge = x < width && (row == 0 || row == height
+			                          || regions.at(area.x() + x, area.y() + row - 1) != regions.at(area.x() + x, area.y() + row));
+			if (edge && start < 0) {
+				start = x;
+			} else if (!edge && start >= 0) {
+				lines.push_back(QLine(start, y, x, y));
+				start = -1;
+			}
+		}
+	}
+	// Vertical borders left of column x
+	for (int x = 0; x <= width; x += 1) {
+		int start = -1;
+		for (int y = 0; y <= rows; y += 1) {
+			int row = area.y() + first_row + y;
+			bool edge = y < rows && (x == 0 || x == width
+			                         || regions.at(area.x() + x - 1, row) != regions.at(area.x() + x, row));
+			if (edge && start < 0) {
+				start = y;
+			} else if (!edge && start >= 0) {
+				lines.push_back(QLine(x, start, x, y));
+				start = -1;
+			}
+		}
+	}
+}
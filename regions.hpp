@@ -0,0 +1,58 @@
+#ifndef _REGIONS_H_
+#define _REGIONS_H_
+
+/*
+ * Copyright 2017-2022 - Geoffrey Brun <geoffrey@spekadyon.org>
+ *
+ * This file is part of any2coloring.
+ *
+ * any2coloring is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * any2coloring is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * any2coloring. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QLine>
+#include <QRect>
+#include <QVector>
+
+#include <cstdint>
+#include <vector>
+
+#include "any2col.hpp"
+
+/*
+ * Connected component labeling of the index map, 4-neighbour. Row strips are
+ * labelled in parallel with a union-find whose roots are the first cell of
+ * their region, strips are then joined along their borders, so the result
+ * doesn't depend on the thread count. Regions are numbered in scan order of
+ * their first cell; returns their number.
+ */
+int label_regions(IndexMap const &indexes, std::vector<int32_t> &labels, int threads = 0);
+
+/*
+ * Region map of indexes. Regions smaller than min_cells are first merged,
+ * smallest first, into the neighbour sharing their longest border: their
+ * cells take its palette index, so indexes is modified. Labels go to the
+ * cell farthest from the region border (city block distance), the first one
+ * in scan order on ties. Returns the number of merged regions.
+ */
+int find_regions(IndexMap &indexes, int min_cells, struct region_map &regions, int threads = 0);
+
+// Region borders in the area, as horizontal and vertical segments in cells,
+// relative to the area top-left corner; the area outline is included
+void region_outlines(struct region_map const &regions, QRect const &area, QVector<QLine> &lines);
+// Same as above, rows first_row to first_row + rows (excluded) of the area
+// only, relative to the first one: the horizontal borders above every row,
+// and below the last one if it is the last of the area
+void region_outlines(struct region_map const &regions, QRect const &area, int first_row, int rows, QVector<QLine> &lines);
+
+#endif /* _REGIONS_H_ */
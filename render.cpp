@@ -0,0 +1,386 @@
+/*
+ * Copyright 2017-2022 - Geoffrey Brun <geoffrey@spekadyon.org>
+ *
+ * This file is part of any2coloring.
+ *
+ * any2coloring is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * any2coloring is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * any2coloring. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QDebug>
+#include <QFile>
+#include <QObject>
+
+#ifndef A2C_HEADLESS
+#include <QHash>
+#include <QPdfWriter>
+#include <QTextLayout>
+#endif
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#include "any2col.hpp"
+#include "parallel.hpp"
+#include "pdf_writer.hpp"
+#include "regions.hpp"
+#include "render.hpp"
+
+using namespace cimg_library;
+
+#ifndef A2C_HEADLESS
+void prepare_style(struct render_style &style, struct Coloring const &coloring, struct col_opt const &opts, int dpi, QPainter const &painter)
+{
+	double cell = mm2pdf(dpi, opts.px_size);
+
+	style.penLines.setColor(QColor(opts.lineColor, opts.lineColor, opts.lineColor));
+	style.penLines.setStyle(Qt::SolidLine);
+	style.penLines.setWidthF(mm2pdf(dpi, opts.px_size/20.0));
+	style.penFonts.setColor(QColor(opts.textColor, opts.textColor, opts.textColor));
+	style.penMarks.setColor(Qt::black);
+	style.penMarks.setStyle(Qt::SolidLine);
+	style.penMarks.setWidthF(mm2pdf(dpi, 0.1));
+	style.font.setFamily("Sans");
+	style.font.setPointSizeF(opts.px_size * LABEL_POINTS_PER_MM);
+	style.captionFont.setFamily("Sans");
+	style.captionFont.setPointSizeF(3.0 * LABEL_POINTS_PER_MM);
+
+	style.colors.clear();
+	style.labels.clear();
+	style.labelOffsets.clear();
+	for (auto const &Color: coloring.palette) {
+		style.colors.push_back(QColor(Color.rgb.R, Color.rgb.G, Color.rgb.B));
+		// Laid out once per palette entry, then centered in cells
+		QTextLayout layout(Color.name, style.font, painter.device());
+		layout.beginLayout();
+		QTextLine line = layout.createLine();
+		layout.endLayout();
+		style.labels.push_back(layout.glyphRuns());
+		style.labelOffsets.push_back(QPointF((cell - line.naturalTextWidth())/2.0, (cell - line.height())/2.0));
+	}
+}
+
+static void record_marks(struct page_drawing &drawing, struct col_opt const &opts, int dpi, struct page_tile const &tile)
+{
+	QVector<QLineF> lines;
+	QPointF caption_pos;
+	QString caption;
+
+	poster_marks(opts, tile, lines, caption_pos, caption);
+	drawing.captions.push_back(qMakePair(caption_pos * mm2pdf(dpi, 1.0), caption));
+	for (auto const &line: lines) {
+		drawing.marks.moveTo(line.p1() * mm2pdf(dpi, 1.0));
+		drawing.marks.lineTo(line.p2() * mm2pdf(dpi, 1.0));
+	}
+}
+
+void record_band(struct page_drawing &drawing, struct Coloring const &coloring, struct col_opt const &opts, bool soluce, int dpi, struct page_tile const &tile, int first_row, int rows)
+{
+	double cell = mm2pdf(dpi, opts.px_size);
+	double left = mm2pdf(dpi, tile.origin.x());
+	double top = mm2pdf(dpi, tile.origin.y()) + first_row*cell;
+	QRect const &area = tile.area;
+	// Cells of the band
+	QRect band(area.x(), area.y() + first_row, area.width(), rows);
+	bool last = first_row + rows == area.height();
+
+	if (soluce && opts.merge_cells) {
+		// Maximal same-color rectangles, drawn once joined with the other
+		// bands
+		merge_cell_runs(coloring.indexes, band.x(), band.y(), band.width(), band.height(), drawing.rects);
+		for (auto &rect: drawing.rects)
+			rect.y += first_row;
+	} else if (soluce) {
+		for (int y = 0; y < band.height(); y += 1) {
+			for (int x = 0; x < band.width(); x += 1) {
+				int index = coloring.indexes.at(band.x() + x, band.y() + y);
+				drawing.cells.push_back(qMakePair(QRectF(left + x*cell, top + y*cell, cell, cell), index));
+			}
+		}
+	} else if (opts.regions.enabled && !coloring.regions.is_empty()) {
+		// Region outlines as a single path, one label per region whose
+		// label cell is in the band
+		QVector<QLine> lines;
+		region_outlines(coloring.regions, area, first_row, rows, lines);
+		for (auto const &line: lines) {
+			drawing.grid.moveTo(left + line.x1()*cell, top + line.y1()*cell);
+			drawing.grid.lineTo(left + line.x2()*cell, top + line.y2()*cell);
+		}
+		for (QPoint const &label: coloring.regions.label_cells) {
+			if (band.contains(label))
+				drawing.labels.push_back(qMakePair(QPointF(left + (label.x() - band.x())*cell, top + (label.y() - band.y())*cell),
+				                                   coloring.indexes.at(label.x(), label.y())));
+		}
+	} else {
+		// Whole band grid as a single path: the horizontal lines above
+		// every row (and below the last one of the page), and width+1
+		// vertical lines
+		for (int y = 0; y <= band.height() - !last; y += 1) {
+			drawing.grid.moveTo(left, top + y*cell);
+			drawing.grid.lineTo(left + band.width()*cell, top + y*cell);
+		}
+		for (int x = 0; x <= band.width(); x += 1) {
+			drawing.grid.moveTo(left + x*cell, top);
+			drawing.grid.lineTo(left + x*cell, top + band.height()*cell);
+		}
+		for (int y = 0; y < band.height(); y += 1) {
+			for (int x = 0; x < band.width(); x += 1) {
+				int index = coloring.indexes.at(band.x() + x, band.y() + y);
+				drawing.labels.push_back(qMakePair(QPointF(left + x*cell, top + y*cell), index));
+			}
+		}
+	}
+
+	if (first_row == 0 && is_poster(opts) && opts.poster.marks)
+		record_marks(drawing, opts, dpi, tile);
+}
+
+void join_bands(std::vector<struct page_drawing> &bands, struct Coloring const &coloring, struct col_opt const &opts, int dpi, struct page_tile const &tile)
+{
+	double cell = mm2pdf(dpi, opts.px_size);
+	double left = mm2pdf(dpi, tile.origin.x());
+	double top = mm2pdf(dpi, tile.origin.y());
+	QVector<struct cell_rect> rects;
+	// Rectangles reaching the bottom of the previous band, by column: runs
+	// of a row don't overlap
+	QHash<int, struct cell_rect> open, next;
+
+	for (size_t b = 0; b < bands.size(); b += 1) {
+		int first_row = b * BAND_ROWS;
+		bool last = b + 1 == bands.size();
+		next.clear();
+		for (struct cell_rect rect: bands[b].rects) {
+			auto it = open.find(rect.x);
+			if (rect.y == first_row && it != open.end() && it->width == rect.width && it->index == rect.index) {
+				rect.y = it->y;
+				rect.height += it->height;
+				open.erase(it);
+			}
+			if (!last && rect.y + rect.height == first_row + BAND_ROWS)
+				next.insert(rect.x, rect);
+			else
+				rects.push_back(rect);
+		}
+		for (auto const &rect: open)
+			rects.push_back(rect);
+		open.swap(next);
+		bands[b].rects.clear();
+	}
+	if (bands.empty() || rects.isEmpty())
+		return;
+
+	// One path per palette color for the whole page
+	struct page_drawing &first = bands.front();
+	first.fills.resize(coloring.palette.size());
+	for (auto const &rect: rects)
+		first.fills[rect.index].addRect(QRectF(left + rect.x*cell, top + rect.y*cell, rect.width*cell, rect.height*cell));
+	first.rects = rects;
+}
+
+int record_pages(std::vector<std::vector<struct page_drawing>> &pages, QVector<struct page_tile> const &tiles, struct Coloring const &coloring, struct col_opt const &opts, enum pdf_content content, int dpi, int threads)
+{
+	QVector<QPair<int, int>> bands;		// page, first row
+
+	pages.clear();
+	pages.resize(content == pdf_content::Both ? 2*tiles.size() : tiles.size());
+	for (size_t i = 0; i < pages.size(); i += 1) {
+		int rows = tiles.at(i % tiles.size()).area.height();
+		pages[i].resize(std::max(1, (rows + BAND_ROWS - 1) / BAND_ROWS));
+		for (size_t band = 0; band < pages[i].size(); band += 1)
+			bands.push_back(qMakePair((int)i, (int)band * BAND_ROWS));
+	}
+	parallel_for(0, bands.size(), [&](int b) {
+		int i = bands.at(b).first;
+		int first_row = bands.at(b).second;
+		struct page_tile const &tile = tiles.at(i % tiles.size());
+		bool soluce = content == pdf_content::Soluce || i >= tiles.size();
+		record_band(pages[i][first_row / BAND_ROWS], coloring, opts, soluce, dpi, tile,
+		            first_row, std::min(BAND_ROWS, tile.area.height() - first_row));
+	}, threads);
+	if (opts.merge_cells) {
+		parallel_for(0, pages.size(), [&](int i) {
+			join_bands(pages[i], coloring, opts, dpi, tiles.at(i % tiles.size()));
+		}, threads);
+	}
+
+	return bands.size();
+}
+
+void replay_page(QPainter &painter, struct page_drawing const &drawing, struct render_style const &style)
+{
+	for (int i = 0; i < drawing.fills.size(); i += 1) {
+		if (!drawing.fills[i].isEmpty())
+			painter.fillPath(drawing.fills[i], style.colors.at(i));
+	}
+	for (auto const &cell: drawing.cells)
+		painter.fillRect(cell.first, style.colors.at(cell.second));
+
+	painter.setBrush(Qt::NoBrush);
+	if (!drawing.grid.isEmpty()) {
+		painter.setPen(style.penLines);
+		painter.drawPath(drawing.grid);
+	}
+	if (!drawing.labels.isEmpty()) {
+		painter.setFont(style.font);
+		painter.setPen(style.penFonts);
+		for (auto const &label: drawing.labels) {
+			QPointF position = label.first + style.labelOffsets.at(label.second);
+			for (QGlyphRun const &run: style.labels.at(label.second))
+				painter.drawGlyphRun(position, run);
+		}
+	}
+	if (!drawing.marks.isEmpty()) {
+		painter.setPen(style.penMarks);
+		painter.drawPath(drawing.marks);
+	}
+	if (!drawing.captions.isEmpty()) {
+		painter.setFont(style.captionFont);
+		painter.setPen(style.penMarks);
+		for (auto const &caption: drawing.captions)
+			painter.drawText(caption.first, caption.second);
+	}
+}
+
+#endif
+
+bool coloring2pdf(const char *filename, struct Coloring const &coloring, struct col_opt const &opts, bool soluce, struct run_stats *stats)
+{
+	return coloring2pdf(filename, coloring, opts, soluce ? pdf_content::Soluce : pdf_content::Sheet, stats);
+}
+
+bool coloring2pdf(QIODevice *device, struct Coloring const &coloring, struct col_opt const &opts, bool soluce, struct run_stats *stats)
+{
+	return coloring2pdf(device, coloring, opts, soluce ? pdf_content::Soluce : pdf_content::Sheet, stats);
+}
+
+bool coloring2pdf(const char *sheet_filename, const char *soluce_filename, struct Coloring const &coloring, struct col_opt const &opts, struct run_stats *stats)
+{
+	// Stats aren't thread safe: the solution has its own
+	struct run_stats soluceStats;
+	bool soluceOk = false;
+
+	std::thread soluce([&]() {
+		soluceOk = coloring2pdf(soluce_filename, coloring, opts, pdf_content::Soluce, stats ? &soluceStats : nullptr);
+	});
+	bool sheetOk = coloring2pdf(sheet_filename, coloring, opts, pdf_content::Sheet, stats);
+	soluce.join();
+
+#ifndef A2C_NO_STATS
+	if (stats) {
+		for (auto stage: soluceStats.stages) {
+			stage.name.prepend("soluce_");
+			stats->stages.push_back(stage);
+		}
+		for (auto const &count: soluceStats.counts)
+			stats->count(qPrintable("soluce_" + count.first), count.second);
+	}
+#endif
+
+	return sheetOk && soluceOk;
+}
+
+bool coloring2pdf(const char *filename, struct Coloring const &coloring, struct col_opt const &opts, enum pdf_content content, struct run_stats *stats)
+{
+	QFile file(QString::fromLocal8Bit(filename));
+
+	if (!file.open(QIODevice::WriteOnly)) {
+		qDebug() << Q_FUNC_INFO << "unable to open" << filename << file.errorString();
+		return false;
+	}
+	if (!coloring2pdf(&file, coloring, opts, content, stats))
+		return false;
+	file.close();
+	if (file.error() != QFileDevice::NoError) {
+		qDebug() << Q_FUNC_INFO << "unable to write" << filename << file.errorString();
+		return false;
+	}
+
+	return true;
+}
+
+bool coloring2pdf(QIODevice *device, struct Coloring const &coloring, struct col_opt const &opts, enum pdf_content content, struct run_stats *stats)
+{
+#ifdef A2C_HEADLESS
+	// No QPainter output, which needs fonts
+	return coloring2pdf_direct(device, coloring, opts, content, stats);
+#else
+	if (opts.pdf == pdf_backend::Direct)
+		return coloring2pdf_direct(device, coloring, opts, content, stats);
+
+	QPdfWriter pdfWriter(device);
+	QPainter qPainter;
+#ifndef A2C_NO_STATS
+	qint64 start = device->pos();
+#endif
+
+	QPageSize pageSize(QSizeF(opts.page.width, opts.page.height), QPageSize::Millimeter);
+	QPageLayout pageLayout(pageSize, QPageLayout::Portrait, QMarginsF(0, 0, 0, 0), QPageLayout::Millimeter);
+	pdfWriter.setPageLayout(pageLayout);
+	pdfWriter.setTitle(QObject::tr("Coloriage !"));
+	pdfWriter.setCreator(QString("any2coloring"));
+	int dpi = pdfWriter.resolution();
+
+	// With both, the tiles are gone through twice: sheet, then solution
+	QVector<struct page_tile> tiles = page_tiles(coloring, opts);
+	std::vector<std::vector<struct page_drawing>> pages;
+	int bands;
+	{
+		StageTimer timer(stats, "pdf_record");
+		bands = record_pages(pages, tiles, coloring, opts, content, dpi, opts.threads);
+	}
+
+	bool ok;
+	{
+		StageTimer timer(stats, "pdf_write");
+		if (!qPainter.begin(&pdfWriter)) {
+			qDebug() << Q_FUNC_INFO << "unable to start the PDF";
+			return false;
+		}
+		struct render_style style;
+		prepare_style(style, coloring, opts, dpi, qPainter);
+		for (size_t i = 0; i < pages.size(); i += 1) {
+			if (i > 0)
+				pdfWriter.newPage();
+			for (auto const &band: pages[i])
+				replay_page(qPainter, band, style);
+		}
+		ok = qPainter.end();
+	}
+
+#ifndef A2C_NO_STATS
+	if (stats) {
+		// Drawing operations, the PDF engine doesn't expose its objects
+		int64_t fills = 0, labels = 0, paths = 0;
+		for (auto const &page: pages) {
+			for (auto const &band: page) {
+				for (auto const &fill: band.fills)
+					fills += !fill.isEmpty();
+				fills += band.cells.size();
+				labels += band.labels.size() + band.captions.size();
+				paths += !band.grid.isEmpty() + !band.marks.isEmpty();
+			}
+		}
+		stats->count("pdf_pages", pages.size());
+		stats->count("pdf_bands", bands);
+		stats->count("pdf_fills", fills);
+		stats->count("pdf_texts", labels);
+		stats->count("pdf_paths", paths);
+		if (!device->isSequential())
+			stats->count("pdf_bytes", device->pos() - start);
+	}
+#endif
+
+	return ok;
+#endif
+}
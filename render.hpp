@@ -0,0 +1,105 @@
+#ifndef _RENDER_H_
+#define _RENDER_H_
+
+/*
+ * Copyright 2017-2022 - Geoffrey Brun <geoffrey@spekadyon.org>
+ *
+ * This file is part of any2coloring.
+ *
+ * any2coloring is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * any2coloring is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * any2coloring. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * QPainter output, which needs QtGui: not available in headless builds,
+ * where coloring2pdf() always uses the direct PDF writer.
+ */
+#ifndef A2C_HEADLESS
+
+#include <QColor>
+#include <QFont>
+#include <QGlyphRun>
+#include <QList>
+#include <QPainter>
+#include <QPainterPath>
+#include <QPair>
+#include <QPen>
+#include <QPointF>
+#include <QRect>
+#include <QString>
+#include <QVector>
+
+#include <vector>
+
+#include "any2col.hpp"
+
+/*
+ * Page rendering is split in two steps: recording builds the page geometry
+ * (paths, label positions) in device coordinates, and may run on any thread;
+ * replaying draws it on a painter, in the painter's thread.
+ *
+ * Pages are recorded as bands of BAND_ROWS cell rows, in parallel, then
+ * replayed in order. The band height is fixed, so that the document doesn't
+ * depend on the number of threads. Merged cell rectangles are joined across
+ * bands afterwards: a page has the same rectangles as merged at once.
+ */
+
+// Recorded page, coordinates in device units
+struct page_drawing {
+	QVector<struct cell_rect> rects;	// merged cells, in tile area rows (once joined: the page ones, first band)
+	QVector<QPainterPath> fills;		// one path per palette entry (merged cells)
+	QVector<QPair<QRectF, int>> cells;	// one fill per cell, palette index
+	QPainterPath grid;
+	QVector<QPair<QPointF, int>> labels;	// cell top-left corner, palette index
+	QPainterPath marks;			// registration marks
+	QVector<QPair<QPointF, QString>> captions;
+};
+
+// Pens, font, colors and laid out labels, shared by the pages of a document
+struct render_style {
+	QPen penLines;
+	QPen penFonts;
+	QPen penMarks;
+	QFont font;
+	QFont captionFont;
+	QVector<QColor> colors;
+	// Labels laid out once, as glyph runs: drawing them needs no text
+	// layout, which the PDF engine would redo for every cell
+	QVector<QList<QGlyphRun>> labels;
+	QVector<QPointF> labelOffsets;	// label position relative to the cell corner
+};
+
+// Cell rows per recorded band
+const int BAND_ROWS = 32;
+
+static inline double mm2pdf(int dpi, double mm)
+{
+	return mm/25.4*(double)dpi;
+}
+
+void prepare_style(struct render_style &style, struct Coloring const &coloring, struct col_opt const &opts, int dpi, QPainter const &painter);
+// Rows first_row to first_row + rows (excluded) of the tile area; marks and
+// captions are recorded with the first band. Merged cells are recorded as
+// rectangles only, see join_bands()
+void record_band(struct page_drawing &drawing, struct Coloring const &coloring, struct col_opt const &opts, bool soluce, int dpi, struct page_tile const &tile, int first_row, int rows);
+// Join the merged cell rectangles of the bands of a page that continue in the
+// next band, and record them as the fills of the first band
+void join_bands(std::vector<struct page_drawing> &bands, struct Coloring const &coloring, struct col_opt const &opts, int dpi, struct page_tile const &tile);
+// Pages of the document, as bands (threads <= 0: one per core); the number of
+// bands
+int record_pages(std::vector<std::vector<struct page_drawing>> &pages, QVector<struct page_tile> const &tiles, struct Coloring const &coloring, struct col_opt const &opts, enum pdf_content content, int dpi, int threads = 0);
+void replay_page(QPainter &painter, struct page_drawing const &drawing, struct render_style const &style);
+
+#endif /* A2C_HEADLESS */
+
+#endif /* _RENDER_H_ */
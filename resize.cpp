@@ -0,0 +1,161 @@
+/*
+ * Copyright 2017-2022 - Geoffrey Brun <geoffrey@spekadyon.org>
+ *
+ * This file is part of any2coloring.
+ *
+ * any2coloring is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * any2coloring is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * any2coloring. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <vector>
+
+#include <cmath>
+#include <cstdint>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "parallel.hpp"
+#include "resize.hpp"
+
+using namespace cimg_library;
+
+namespace {
+
+/*
+ * Source pixels [first[i], first[i] + count) covered by destination pixel i,
+ * and the weight of each. In units of 1/cells source pixels, source pixel x
+ * spans [x*cells, (x+1)*cells) and destination pixel i spans
+ * [i*length, (i+1)*length): overlaps are exact integers, weights are the
+ * overlaps divided by length.
+ */
+struct area_weights {
+	std::vector<int> first;
+	std::vector<int> offset;	// weights of i: [offset[i], offset[i+1])
+	std::vector<float> weights;
+
+	area_weights(int length, int cells) : first(cells), offset(cells + 1)
+	{
+		for (int i = 0; i < cells; i += 1) {
+			int64_t begin = (int64_t)i * length;
+			int64_t end = begin + length;
+			first[i] = begin / cells;
+			offset[i] = weights.size();
+			for (int x = first[i]; (int64_t)x * cells < end; x += 1) {
+				int64_t overlap = std::min(end, (int64_t)(x + 1) * cells) - std::max(begin, (int64_t)x * cells);
+				weights.push_back((float)((double)overlap / length));
+			}
+		}
+		offset[cells] = weights.size();
+	}
+
+	int count(int i) const { return offset[i + 1] - offset[i]; }
+	float const *of(int i) const { return weights.data() + offset[i]; }
+};
+
+inline float srgb2linear(float c)
+{
+	c /= 255.0f;
+	return c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+}
+
+inline float linear2srgb(float c)
+{
+	c = c <= 0.0031308f ? c * 12.92f : 1.055f * std::pow(c, 1.0f / 2.4f) - 0.055f;
+	return c * 255.0f;
+}
+
+// sum[x] += weight * row[x]
+inline void add_weighted(float *sum, float const *row, float weight, int width)
+{
+	int x = 0;
+#ifdef __SSE2__
+	const __m128 w = _mm_set1_ps(weight);
+	for (; x + 4 <= width; x += 4)
+		_mm_storeu_ps(sum + x, _mm_add_ps(_mm_loadu_ps(sum + x), _mm_mul_ps(w, _mm_loadu_ps(row + x))));
+#endif
+	for (; x < width; x += 1)
+		sum[x] += weight * row[x];
+}
+
+}
+
+void area_resize(CImg<float> const &picture, int width, int height, bool rotate, bool linear, CImg<float> &grid, int threads)
+{
+	int srcWidth = picture.width();
+	int srcHeight = picture.height();
+	int channels = picture.spectrum();
+	// Grid size in the source orientation
+	int cellsX = rotate ? height : width;
+	int cellsY = rotate ? width : height;
+	area_weights wx(srcWidth, cellsX);
+	area_weights wy(srcHeight, cellsY);
+	// sRGB to linear light of 8-bit values, computed for other ones
+	std::vector<float> toLinear(256);
+	for (int v = 0; v < 256; v += 1)
+		toLinear[v] = srgb2linear(v);
+
+	grid.assign(width, height, 1, channels);
+	float *out = grid.data();
+	size_t plane = (size_t)width * height;
+
+	// One grid row (source orientation) per call: source rows are first
+	// summed vertically over the whole width, then horizontally per cell
+	parallel_for(0, cellsY, [&](int cy) {
+		std::vector<float> sums(srcWidth);
+		std::vector<float> scratch(linear ? srcWidth : 0);
+		for (int c = 0; c < channels; c += 1) {
+			std::fill(sums.begin(), sums.end(), 0.0f);
+			float const *weights = wy.of(cy);
+			for (int k = 0; k < wy.count(cy); k += 1) {
+				float const *row = picture.data(0, wy.first[cy] + k, 0, c);
+				if (linear) {
+					for (int x = 0; x < srcWidth; x += 1) {
+						float v = row[x];
+						int i = (int)v;
+						scratch[x] = i == v && i >= 0 && i < 256 ? toLinear[i] : srgb2linear(v);
+					}
+					row = scratch.data();
+				}
+				add_weighted(sums.data(), row, weights[k], srcWidth);
+			}
+
+			// Rotated: cell (cx, cy) goes to (height - 1 - cy, cx)
+			float *dst = out + c * plane;
+			for (int cx = 0; cx < cellsX; cx += 1) {
+				float const *w = wx.of(cx);
+				float const *s = sums.data() + wx.first[cx];
+				float value = 0;
+				for (int k = 0; k < wx.count(cx); k += 1)
+					value += w[k] * s[k];
+				if (linear)
+					value = linear2srgb(value);
+				if (rotate)
+					dst[(size_t)cx * width + (width - 1 - cy)] = value;
+				else
+					dst[(size_t)cy * width + cx] = value;
+			}
+		}
+	}, threads);
+}
+
+void resize_to_grid(CImg<float> const &picture, struct col_opt const &opts, CImg<float> &grid, int threads)
+{
+	bool rotate;
+	int grid_width, grid_height;
+
+	grid_size(picture.width(), picture.height(), opts, rotate, grid_width, grid_height);
+	area_resize(picture, grid_width, grid_height, rotate, opts.resize.linear, grid, threads);
+}
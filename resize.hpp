@@ -0,0 +1,42 @@
+#ifndef _RESIZE_H_
+#define _RESIZE_H_
+
+/*
+ * Copyright 2017-2022 - Geoffrey Brun <geoffrey@spekadyon.org>
+ *
+ * This file is part of any2coloring.
+ *
+ * any2coloring is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * any2coloring is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * any2coloring. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <CImg.h>
+
+#include "any2col.hpp"
+
+/*
+ * Native fit-to-page resize, instead of G'MIC's "-rotate 90" and
+ * "-r2dy"/"-r2dx" steps: exact area averaging, every grid cell being the
+ * mean of the source pixels it covers, weighted by the covered fraction of
+ * each. Landscape pictures are rotated by 90 degrees clockwise while writing
+ * the grid, like G'MIC does; the source is never copied.
+ *
+ * With linear set, sRGB values are averaged in linear light, then converted
+ * back. Output rows are spread over threads (threads <= 0 means one per core);
+ * the result doesn't depend on their number.
+ */
+void area_resize(cimg_library::CImg<float> const &picture, int width, int height, bool rotate, bool linear, cimg_library::CImg<float> &grid, int threads = 0);
+// Resize picture to the grid of opts, see grid_size()
+void resize_to_grid(cimg_library::CImg<float> const &picture, struct col_opt const &opts, cimg_library::CImg<float> &grid, int threads = 0);
+
+#endif /* _RESIZE_H_ */
@@ -0,0 +1,210 @@
+/*
+ * Copyright 2017-2022 - Geoffrey Brun <geoffrey@spekadyon.org>
+ *
+ * This file is part of any2coloring.
+ *
+ * any2coloring is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * any2coloring is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * any2coloring. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QStandardPaths>
+
+#include <cstring>
+
+#include <gmic.h>
+
+#include "result_cache.hpp"
+
+namespace {
+
+const char RESULT_MAGIC[8] = {'A', '2', 'C', 'I', 'D', 'X', '\r', '\n'};
+// To be increased whenever make_coloring() results change
+const uint32_t RESULT_VERSION = 1;
+const char RESULT_SUFFIX[] = ".a2ci";
+
+/*
+ * Entry layout, in native byte order (the cache is local to the machine): the
+ * header, then the index map rows as stored by IndexMap.
+ */
+struct result_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t width;
+	uint32_t height;
+	uint32_t palette_size;
+	uint64_t data_size;
+};
+
+bool valid_entry(const uchar *data, qint64 size, result_header &header)
+{
+	if (!data || size < (qint64)sizeof(result_header))
+		return false;
+	memcpy(&header, data, sizeof(header));
+	if (memcmp(header.magic, RESULT_MAGIC, sizeof(RESULT_MAGIC)) || header.version != RESULT_VERSION)
+		return false;
+	uint64_t cell_size = header.palette_size > 256 ? 2 : 1;
+	if (header.data_size != (uint64_t)header.width * header.height * cell_size)
+		return false;
+
+	return header.data_size == (uint64_t)size - sizeof(result_header);
+}
+
+}
+
+ResultCache::ResultCache(QString const &directory, qint64 max_bytes) :
+	directory(directory),
+	maxBytes(max_bytes),
+	hitCount(0),
+	missCount(0)
+{
+}
+
+QString ResultCache::default_directory()
+{
+	return QDir(QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation)).filePath("any2coloring/results");
+}
+
+QByteArray ResultCache::key(QByteArray const &picture_digest, QVector<struct color> const &palette, struct col_opt const &opts)
+{
+	QCryptographicHash hash(QCryptographicHash::Sha1);
+
+	hash.addData(QByteArray::number(RESULT_VERSION));
+#ifdef gmic_version
+	hash.addData(QByteArray::number(gmic_version));
+#endif
+	hash.addData(picture_digest);
+
+	// Colors only, names don't change the index map
+	for (auto const &color: palette) {
+		const char rgb[3] = {(char)color.rgb.R, (char)color.rgb.G, (char)color.rgb.B};
+		hash.addData(rgb, sizeof(rgb));
+	}
+
+	// Grid geometry, decoding and palette mapping options
+	hash.addData(QString::asprintf("|%.17g %.17g|%.17g %.17g %.17g %.17g|%.17g|%zu",
+	                               opts.page.width, opts.page.height,
+	                               opts.margin.top, opts.margin.bottom, opts.margin.right, opts.margin.left,
+	                               opts.px_size, opts.max_memory).toLatin1());
+	hash.addData(QString::asprintf("|%d %d", (int)opts.resize.method, opts.resize.linear).toLatin1());
+	hash.addData(QString::asprintf("|%d %d %.17g %.17g %d",
+	                               opts.poster.columns, opts.poster.rows,
+	                               opts.poster.width, opts.poster.height, opts.poster.overlap).toLatin1());
+	hash.addData(QString::asprintf("|%d %d %d %d %d %d",
+	                               opts.quantizer.native, (int)opts.quantizer.metric, opts.quantizer.dithering,
+	                               (int)opts.quantizer.kernel, opts.quantizer.serpentine, opts.quantizer.lut_bits).toLatin1());
+	// Merged regions change the index map
+	if (opts.regions.enabled && opts.regions.min_cells > 1)
+		hash.addData(QString::asprintf("|regions %d", opts.regions.min_cells).toLatin1());
+
+	return hash.result().toHex();
+}
+
+bool ResultCache::load(QByteArray const &key, int palette_size, IndexMap &indexes)
+{
+	QString entryName = QDir(directory).filePath(QString::fromLatin1(key) + RESULT_SUFFIX);
+	QFile entry(entryName);
+
+	if (entry.open(QIODevice::ReadOnly)) {
+		result_header header;
+		qint64 size = entry.size();
+		const uchar *data = entry.map(0, size);
+		if (valid_entry(data, size, header) && header.palette_size == (uint32_t)palette_size) {
+			indexes.assign(header.width, header.height, palette_size);
+			if (header.data_size)
+				memcpy(indexes.row<uint8_t>(0), data + sizeof(header), header.data_size);
+			entry.close();
+			// Most recently used
+			if (entry.open(QIODevice::ReadWrite))
+				entry.setFileTime(QDateTime::currentDateTime(), QFileDevice::FileModificationTime);
+			hitCount += 1;
+			return true;
+		}
+		qDebug() << Q_FUNC_INFO << "invalid cache entry" << entryName;
+	}
+
+	missCount += 1;
+	return false;
+}
+
+bool ResultCache::store(QByteArray const &key, IndexMap const &indexes, int palette_size)
+{
+	QString entryName = QDir(directory).filePath(QString::fromLatin1(key) + RESULT_SUFFIX);
+	result_header header;
+
+	if ((qint64)(sizeof(header) + indexes.bytes()) > maxBytes)
+		return false;
+
+	memcpy(header.magic, RESULT_MAGIC, sizeof(RESULT_MAGIC));
+	header.version = RESULT_VERSION;
+	header.width = indexes.width();
+	header.height = indexes.height();
+	header.palette_size = palette_size;
+	header.data_size = indexes.bytes();
+
+	QSaveFile saveFile(entryName);
+	if (!QDir().mkpath(directory) || !saveFile.open(QIODevice::WriteOnly)) {
+		qDebug() << Q_FUNC_INFO << "unable to write cache entry" << entryName << saveFile.errorString();
+		return false;
+	}
+	saveFile.write(reinterpret_cast<const char *>(&header), sizeof(header));
+	if (header.data_size)
+		saveFile.write(reinterpret_cast<const char *>(indexes.row<uint8_t>(0)), header.data_size);
+	if (!saveFile.commit()) {
+		qDebug() << Q_FUNC_INFO << "unable to write cache entry" << entryName << saveFile.errorString();
+		return false;
+	}
+
+	evict();
+	return true;
+}
+
+void ResultCache::evict() const
+{
+	QDir dir(directory);
+	QFileInfoList entries = dir.entryInfoList(QStringList() << QString("*") + RESULT_SUFFIX, QDir::Files, QDir::Time);
+	qint64 total = 0;
+
+	// Newest first: keep entries while they fit
+	for (QFileInfo const &info: entries) {
+		total += info.size();
+		if (total > maxBytes && !QFile::remove(info.filePath()))
+			qDebug() << Q_FUNC_INFO << "unable to remove" << info.filePath();
+	}
+}
+
+bool ResultCache::clear() const
+{
+	QDir dir(directory);
+	bool ok = true;
+
+	if (!dir.exists())
+		return true;
+
+	QStringList filters;
+	filters << QString("*") + RESULT_SUFFIX << QString("*") + RESULT_SUFFIX + ".*";
+	for (QFileInfo const &info: dir.entryInfoList(filters, QDir::Files)) {
+		if (!QFile::remove(info.filePath())) {
+			qDebug() << Q_FUNC_INFO << "unable to remove" << info.filePath();
+			ok = false;
+		}
+	}
+
+	return ok;
+}
@@ -0,0 +1,73 @@
+#ifndef _RESULT_CACHE_H_
+#define _RESULT_CACHE_H_
+
+/*
+ * Copyright 2017-2022 - Geoffrey Brun <geoffrey@spekadyon.org>
+ *
+ * This file is part of any2coloring.
+ *
+ * any2coloring is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * any2coloring is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * any2coloring. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QByteArray>
+#include <QString>
+#include <QVector>
+
+#include <atomic>
+#include <cstdint>
+
+#include "any2col.hpp"
+
+/*
+ * On-disk cache of make_coloring() results (index maps), so that changing
+ * only the PDF styling (colors, solution) skips decoding, resizing and
+ * palette mapping.
+ *
+ * Entries are named after a hash of the picture bytes, the palette colors
+ * and every option the index map depends on. They are written to a temporary
+ * file renamed over the final name and read back through a memory mapping.
+ * Hits refresh the entry modification time; once the cache is over its size,
+ * the least recently used entries are removed.
+ */
+class ResultCache {
+public:
+	ResultCache(QString const &directory, qint64 max_bytes);
+
+	// Default cache directory (user cache location)
+	static QString default_directory();
+
+	// Key of the coloring of a picture, given the digest of its bytes
+	// (encoded file content or decoded pixels)
+	static QByteArray key(QByteArray const &picture_digest, QVector<struct color> const &palette, struct col_opt const &opts);
+
+	// Index map stored under key, counted as a hit or a miss
+	bool load(QByteArray const &key, int palette_size, IndexMap &indexes);
+	// Store an index map, then evict entries over the size limit
+	bool store(QByteArray const &key, IndexMap const &indexes, int palette_size);
+	// Remove every entry
+	bool clear() const;
+
+	int64_t hits() const { return hitCount; }
+	int64_t misses() const { return missCount; }
+
+private:
+	void evict() const;
+
+	QString directory;
+	qint64 maxBytes;
+	std::atomic<int64_t> hitCount;
+	std::atomic<int64_t> missCount;
+};
+
+#endif /* _RESULT_CACHE_H_ */
@@ -0,0 +1,587 @@
+/*
+ * Copyright 2017-2022 - Geoffrey Brun <geoffrey@spekadyon.org>
+ *
+ * This file is part of any2coloring.
+ *
+ * any2coloring is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * any2coloring is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * any2coloring. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QBuffer>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QPointer>
+#include <QtEndian>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <cstdio>
+
+#include "engine.hpp"
+#include "parallel.hpp"
+#include "preview.hpp"
+#include "serve.hpp"
+
+namespace {
+
+const quint32 MAX_HEADER = 64 * 1024;
+const quint32 MAX_PAYLOAD = 256 * 1024 * 1024;
+// Latencies kept for the percentiles
+const size_t LATENCY_WINDOW = 1024;
+
+struct render_job {
+	QPointer<QLocalSocket> socket;
+	QByteArray input;
+	struct col_opt opts;
+	enum pdf_content content;
+	int preview;	// PNG preview size, 0: PDF
+	int palette;
+	QElapsedTimer timer;	// started when the request is complete
+};
+
+// Per connection state, in the event loop thread
+struct connection {
+	QByteArray buffer;
+	bool busy = false;	// job in flight
+};
+
+QByteArray frame(QJsonObject header, QByteArray const &payload = QByteArray())
+{
+	header["size"] = payload.size();
+	QByteArray json = QJsonDocument(header).toJson(QJsonDocument::Compact);
+	QByteArray data(4, 0);
+
+	qToBigEndian<quint32>(json.size(), data.data());
+	data += json;
+	data += payload;
+
+	return data;
+}
+
+QByteArray error_frame(QString const &error, QString const &message)
+{
+	QJsonObject header;
+
+	header["status"] = "error";
+	header["error"] = error;
+	header["message"] = message;
+
+	return frame(header);
+}
+
+const char *status_name(enum coloring_status status)
+{
+	switch (status) {
+	case coloring_status::Ok:
+		return "ok";
+	case coloring_status::BadPalette:
+		return "bad_palette";
+	case coloring_status::BadPicture:
+		return "bad_picture";
+	case coloring_status::ProcessingFailed:
+		return "processing_failed";
+	case coloring_status::OutputFailed:
+		return "output_failed";
+	}
+
+	return "unknown";
+}
+
+// Job options: the server ones, overridden by the request members named
+// like the command line options
+bool job_options(QJsonObject const &json, struct col_opt &opts, QString &error)
+{
+	struct {
+		const char *name;
+		double *value;
+		double min;
+		double max;
+	} numbers[] = {
+		{"page-width", &opts.page.width, 1, 1e5},
+		{"page-height", &opts.page.height, 1, 1e5},
+		{"margin-top", &opts.margin.top, 0, 1e5},
+		{"margin-bottom", &opts.margin.bottom, 0, 1e5},
+		{"margin-left", &opts.margin.left, 0, 1e5},
+		{"margin-right", &opts.margin.right, 0, 1e5},
+		{"pixel-size", &opts.px_size, 0.1, 1e5},
+	};
+	for (auto const &number: numbers) {
+		if (!json.contains(number.name))
+			continue;
+		double value = json[number.name].toDouble(-1);
+		if (value < number.min || value > number.max) {
+			error = QString("invalid %1").arg(number.name);
+			return false;
+		}
+		*number.value = value;
+	}
+
+	struct {
+		const char *name;
+		uint8_t *value;
+	} grays[] = {
+		{"line-color", &opts.lineColor},
+		{"text-color", &opts.textColor},
+	};
+	for (auto const &gray: grays) {
+		if (!json.contains(gray.name))
+			continue;
+		int value = json[gray.name].toInt(-1);
+		if (value < 0 || value > 255) {
+			error = QString("invalid %1").arg(gray.name);
+			return false;
+		}
+		*gray.value = value;
+	}
+
+	if (json.contains("no-merge"))
+		opts.merge_cells = !json["no-merge"].toBool();
+	if (json.contains("no-dither"))
+		opts.quantizer.dithering = !json["no-dither"].toBool();
+	if (json.contains("dither")) {
+		QString kernel = json["dither"].toString();
+		if (kernel == "fs") {
+			opts.quantizer.kernel = dither_kernel::FloydSteinberg;
+		} else if (kernel == "sierra") {
+			opts.quantizer.kernel = dither_kernel::Sierra;
+		} else {
+			error = "invalid dither";
+			return false;
+		}
+	}
+	if (json.contains("resize")) {
+		QString method = json["resize"].toString();
+		if (method == "native") {
+			opts.resize.method = resize_method::Native;
+		} else if (method == "gmic") {
+			opts.resize.method = resize_method::Gmic;
+		} else {
+			error = "invalid resize";
+			return false;
+		}
+	}
+	if (json.contains("linear-light"))
+		opts.resize.linear = json["linear-light"].toBool();
+	if (opts.resize.linear && opts.resize.method != resize_method::Native) {
+		error = "linear-light needs the native resize";
+		return false;
+	}
+	if (json.contains("serpentine"))
+		opts.quantizer.serpentine = json["serpentine"].toBool();
+	if (json.contains("regions")) {
+		opts.regions.min_cells = json["regions"].toInt();
+		opts.regions.enabled = opts.regions.min_cells >= 1;
+		if (!opts.regions.enabled) {
+			error = "invalid regions";
+			return false;
+		}
+	}
+	if (json.contains("max-memory"))
+		opts.max_memory = std::max(0.0, json["max-memory"].toDouble()) * 1048576.0;
+	if (json.contains("poster-columns") || json.contains("poster-rows")) {
+		opts.poster.columns = json["poster-columns"].toInt();
+		opts.poster.rows = json["poster-rows"].toInt();
+		if (opts.poster.columns <= 0 || opts.poster.rows <= 0) {
+			error = "invalid poster page count";
+			return false;
+		}
+	}
+	if (json.contains("poster-width") || json.contains("poster-height")) {
+		opts.poster.width = json["poster-width"].toDouble();
+		opts.poster.height = json["poster-height"].toDouble();
+		if (opts.poster.width < opts.px_size || opts.poster.height < opts.px_size) {
+			error = "invalid poster size";
+			return false;
+		}
+	}
+	if (json.contains("pdf-writer")) {
+		QString writer = json["pdf-writer"].toString();
+		if (writer != "qt" && writer != "direct") {
+			error = "invalid pdf-writer";
+			return false;
+		}
+#ifdef A2C_HEADLESS
+		if (writer == "qt") {
+			error = "The qt PDF writer is not available in headless builds";
+			return false;
+		}
+#endif
+		opts.pdf = writer == "qt" ? pdf_backend::Qt : pdf_backend::Direct;
+	}
+	if (json.contains("poster-overlap"))
+		opts.poster.overlap = std::max(0, json["poster-overlap"].toInt());
+	if (json.contains("no-marks"))
+		opts.poster.marks = !json["no-marks"].toBool();
+	if (opts.margin.top + opts.margin.bottom >= opts.page.height
+	    || opts.margin.left + opts.margin.right >= opts.page.width) {
+		error = "margins larger than the page";
+		return false;
+	}
+
+	return true;
+}
+
+class RenderServer {
+public:
+	RenderServer(QVector<struct served_palette> const &palettes, struct col_opt const &opts, int threads, int queue_size,
+	             std::shared_ptr<ResultCache> const &results) :
+		palettes(palettes),
+		results(results),
+		opts(opts),
+		threads(threads),
+		queueSize(queue_size),
+		queue(queue_size)
+	{
+		// One engine per palette, their interpreters are shared by the
+		// workers
+		for (auto const &palette: palettes) {
+			engines.emplace_back(new ColoringEngine(opts));
+			engines.back()->set_palette(palette.palette, palette.quantizer);
+			engines.back()->set_result_cache(results);
+		}
+		uptime.start();
+	}
+
+	~RenderServer()
+	{
+		queue.close();
+		for (auto &worker: workers)
+			worker.join();
+	}
+
+	bool listen(QString const &socket_name)
+	{
+		QLocalServer::removeServer(socket_name);
+		server.setSocketOptions(QLocalServer::UserAccessOption);
+		if (!server.listen(socket_name)) {
+			fprintf(stderr, "%s: %s\n", qPrintable(socket_name), qPrintable(server.errorString()));
+			return false;
+		}
+		QObject::connect(&server, &QLocalServer::newConnection, [this]() { accept(); });
+
+		// Interpreters for the palettes that need G'MIC with the server
+		// options, one per worker; the others are created on first use
+		for (int i = 0; i < palettes.size(); i += 1) {
+			if (!palettes[i].quantizer || opts.resize.method == resize_method::Gmic)
+				engines[i]->warm_up(threads);
+		}
+		for (int i = 0; i < threads; i += 1)
+			workers.emplace_back([this]() { work(); });
+
+		return true;
+	}
+
+private:
+	void accept()
+	{
+		while (QLocalSocket *socket = server.nextPendingConnection()) {
+			// Unread requests stay in the socket, blocking the client
+			socket->setReadBufferSize(1024 * 1024);
+			connections[socket] = connection();
+			QObject::connect(socket, &QLocalSocket::readyRead, &server, [this, socket]() { read(socket); });
+			QObject::connect(socket, &QLocalSocket::disconnected, &server, [this, socket]() {
+				connections.erase(socket);
+				socket->deleteLater();
+			});
+		}
+	}
+
+	void read(QLocalSocket *socket)
+	{
+		auto it = connections.find(socket);
+		if (it == connections.end())
+			return;
+		struct connection &conn = it->second;
+
+		while (!conn.busy) {
+			conn.buffer += socket->readAll();
+			if (conn.buffer.size() < 4)
+				return;
+			quint32 header_size = qFromBigEndian<quint32>(conn.buffer.constData());
+			if (header_size > MAX_HEADER) {
+				reject(socket, "bad_request", "header too large");
+				socket->disconnectFromServer();
+				return;
+			}
+			if ((quint32)conn.buffer.size() < 4 + header_size)
+				return;
+			QJsonParseError parseError;
+			QJsonDocument document = QJsonDocument::fromJson(conn.buffer.mid(4, header_size), &parseError);
+			if (!document.isObject()) {
+				reject(socket, "bad_request", parseError.errorString());
+				socket->disconnectFromServer();
+				return;
+			}
+			QJsonObject header = document.object();
+			double size = header["size"].toDouble(0);
+			if (size < 0 || size > MAX_PAYLOAD || size != std::floor(size)) {
+				reject(socket, "bad_request", "invalid payload size");
+				socket->disconnectFromServer();
+				return;
+			}
+			int payload_size = (int)size;
+			if ((quint32)conn.buffer.size() < 4 + header_size + (quint32)payload_size)
+				return;
+			QByteArray payload = conn.buffer.mid(4 + header_size, payload_size);
+			conn.buffer.remove(0, 4 + header_size + payload_size);
+			request(socket, conn, header, payload);
+		}
+	}
+
+	void request(QLocalSocket *socket, struct connection &conn, QJsonObject const &header, QByteArray const &payload)
+	{
+		QString type = header["type"].toString();
+
+		if (type == "stats") {
+			socket->write(frame(stats()));
+			return;
+		}
+		if (type != "render") {
+			reject(socket, "bad_request", QString("unknown request type \"%1\"").arg(type));
+			return;
+		}
+
+		received += 1;
+		struct render_job job;
+		job.timer.start();
+		job.socket = socket;
+		job.input = payload;
+		// true, false or "both": sheet then solution pages
+		if (header["soluce"].toString() == "both")
+			job.content = pdf_content::Both;
+		else
+			job.content = header["soluce"].toBool() ? pdf_content::Soluce : pdf_content::Sheet;
+		job.preview = header.contains("preview") ? header["preview"].toInt(-1) : 0;
+		job.opts = opts;
+		job.palette = -1;
+		QString id = header["palette"].toString();
+		for (int i = 0; i < palettes.size(); i += 1) {
+			if (palettes[i].id == id || (id.isEmpty() && palettes.size() == 1))
+				job.palette = i;
+		}
+		QString error;
+		if (job.palette < 0) {
+			failed += 1;
+			reject(socket, "bad_palette", QString("unknown palette \"%1\"").arg(id));
+			return;
+		}
+		if (!job_options(header["options"].toObject(), job.opts, error)) {
+			failed += 1;
+			reject(socket, "bad_request", error);
+			return;
+		}
+		if (job.preview < 0) {
+			failed += 1;
+			reject(socket, "bad_request", "invalid preview size");
+			return;
+		}
+		if (job.preview && !job.opts.max_memory)
+			job.opts.max_memory = PREVIEW_MEMORY;
+		if (!queue.try_push(job)) {
+			rejected += 1;
+			reject(socket, "busy", "too many jobs waiting");
+			return;
+		}
+		conn.busy = true;
+	}
+
+	void reject(QLocalSocket *socket, QString const &error, QString const &message)
+	{
+		socket->write(error_frame(error, message));
+	}
+
+	// Worker thread
+	void work()
+	{
+		struct render_job job;
+
+		warm_up();
+		while (queue.pop(job)) {
+			running += 1;
+			QByteArray reply = render(job);
+			running -= 1;
+			double ms = job.timer.nsecsElapsed() / 1e6;
+			{
+				std::lock_guard<std::mutex> lock(latencyMutex);
+				if (latencies.size() < LATENCY_WINDOW)
+					latencies.push_back(ms);
+				else
+					latencies[latencyNext] = ms;
+				latencyNext = (latencyNext + 1) % LATENCY_WINDOW;
+			}
+			// Sockets belong to the event loop thread
+			QPointer<QLocalSocket> socket = job.socket;
+			QMetaObject::invokeMethod(&server, [this, socket, reply]() {
+				if (!socket)
+					return;
+				socket->write(reply);
+				auto it = connections.find(socket.data());
+				if (it != connections.end()) {
+					it->second.busy = false;
+					read(socket.data());
+				}
+			}, Qt::QueuedConnection);
+		}
+	}
+
+	// Render a tiny page so that fonts and the PDF engine are ready before
+	// the first request
+	void warm_up()
+	{
+		struct Coloring coloring;
+		QByteArray pdf;
+		QBuffer buffer(&pdf);
+
+		if (palettes.isEmpty())
+			return;
+		coloring.palette = palettes[0].palette;
+		coloring.indexes.assign(2, 2, coloring.palette.size());
+		buffer.open(QIODevice::WriteOnly);
+		coloring2pdf(&buffer, coloring, opts, false);
+	}
+
+	QByteArray render(struct render_job const &job)
+	{
+		struct picture_source source;
+		struct Coloring coloring;
+		enum coloring_status status;
+		QBuffer input;
+		QByteArray pdf;
+		QString error;
+
+		input.setData(job.input);
+		input.open(QIODevice::ReadOnly);
+		source.device = &input;
+		status = engines[job.palette]->make_coloring(source, job.opts, coloring, &error);
+		if (status == coloring_status::Ok) {
+			QBuffer output(&pdf);
+			output.open(QIODevice::WriteOnly);
+			bool written = job.preview ?
+				coloring2preview(&output, coloring, job.opts, job.content == pdf_content::Soluce, job.preview, &coloring.stats) :
+				coloring2pdf(&output, coloring, job.opts, job.content, &coloring.stats);
+			if (!written)
+				status = coloring_status::OutputFailed;
+		}
+		if (status != coloring_status::Ok) {
+			failed += 1;
+			return error_frame(status_name(status), error);
+		}
+
+		completed += 1;
+		QJsonObject header;
+		header["status"] = "ok";
+		header["width"] = coloring.indexes.width();
+		header["height"] = coloring.indexes.height();
+		header["ms"] = job.timer.nsecsElapsed() / 1e6;
+#ifndef A2C_NO_STATS
+		header["stats"] = stats2json(coloring.stats);
+#endif
+		return frame(header, pdf);
+	}
+
+	QJsonObject stats()
+	{
+		QJsonObject json;
+		QJsonObject latency;
+		QJsonArray ids;
+		std::vector<double> sorted;
+
+		{
+			std::lock_guard<std::mutex> lock(latencyMutex);
+			sorted = latencies;
+		}
+		std::sort(sorted.begin(), sorted.end());
+		if (!sorted.empty()) {
+			latency["p50"] = sorted[sorted.size() / 2];
+			latency["p95"] = sorted[std::min(sorted.size() - 1, sorted.size() * 95 / 100)];
+			latency["max"] = sorted.back();
+		}
+		for (auto const &palette: palettes)
+			ids.append(palette.id);
+
+		json["status"] = "ok";
+		json["uptime"] = uptime.elapsed() / 1000.0;
+		json["workers"] = threads;
+		json["queue_capacity"] = queueSize;
+		json["queued"] = (int)queue.size();
+		json["running"] = running.load();
+		json["connections"] = (int)connections.size();
+		json["received"] = received;
+		json["completed"] = completed.load();
+		json["failed"] = failed.load();
+		json["rejected"] = rejected;
+		json["latency_ms"] = latency;
+		json["palettes"] = ids;
+		if (results) {
+			QJsonObject cache;
+			cache["hits"] = (qint64)results->hits();
+			cache["misses"] = (qint64)results->misses();
+			json["result_cache"] = cache;
+		}
+
+		return json;
+	}
+
+	QVector<struct served_palette> palettes;
+	std::vector<std::unique_ptr<ColoringEngine>> engines;
+	std::shared_ptr<ResultCache> results;
+	struct col_opt opts;
+	int threads;
+	int queueSize;
+	QLocalServer server;
+	std::map<QLocalSocket *, struct connection> connections;
+	JobQueue<struct render_job> queue;
+	std::vector<std::thread> workers;
+	QElapsedTimer uptime;
+	// Counters updated by the event loop thread...
+	int received = 0;
+	int rejected = 0;
+	// ... and by the workers
+	std::atomic<int> completed{0};
+	std::atomic<int> failed{0};
+	std::atomic<int> running{0};
+	std::mutex latencyMutex;
+	std::vector<double> latencies;
+	size_t latencyNext = 0;
+};
+
+}
+
+int run_server(QString const &socket_name, QVector<struct served_palette> const &palettes, struct col_opt const &opts, int threads, int queue_size,
+               std::shared_ptr<ResultCache> const &results)
+{
+	if (threads <= 0)
+		threads = ideal_thread_count();
+	if (queue_size <= 0)
+		queue_size = 4 * threads;
+
+	RenderServer server(palettes, opts, threads, queue_size, results);
+	if (!server.listen(socket_name))
+		return EXIT_FAILURE;
+	fprintf(stderr, "Listening on %s (%d workers, %d queued jobs at most)\n",
+	        qPrintable(socket_name), threads, queue_size);
+
+	return QCoreApplication::exec();
+}
@@ -0,0 +1,67 @@
+#ifndef _SERVE_H_
+#define _SERVE_H_
+
+/*
+ * Copyright 2017-2022 - Geoffrey Brun <geoffrey@spekadyon.org>
+ *
+ * This file is part of any2coloring.
+ *
+ * any2coloring is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * any2coloring is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * any2coloring. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QString>
+#include <QVector>
+
+#include <memory>
+
+#include "any2col.hpp"
+#include "quantize.hpp"
+#include "result_cache.hpp"
+
+// Palette loaded once for the server lifetime, referred to by jobs by its id
+struct served_palette {
+	QString id;
+	QVector<struct color> palette;
+	std::shared_ptr<const Quantizer> quantizer;	// null: G'MIC palette mapping
+};
+
+/*
+ * Render daemon: listen on a local socket and color the pictures sent by
+ * clients, using threads workers. Jobs go through one ColoringEngine per
+ * palette, whose G'MIC interpreters are shared by the workers; they are
+ * created at start-up for the palettes that need G'MIC.
+ *
+ * Messages in both directions are a frame: a 32-bit big endian length, a JSON
+ * object of that length, then the number of payload bytes given by its "size"
+ * member (0 if missing).
+ *
+ * Requests: {"type": "render", "palette": id, "soluce": bool, "options": {...}}
+ * with the encoded picture as payload, answered with the PDF as payload; and
+ * {"type": "stats"}. Answers have a "status" member, "ok" or "error" (with
+ * "error" and "message" members).
+ *
+ * A connection has one job in flight at a time, its next requests wait in the
+ * socket. Jobs beyond queue_size waiting for a worker are rejected with the
+ * "busy" error.
+ *
+ * With results, every engine reuses the index maps of earlier jobs (see
+ * ResultCache); the stats request reports its hits and misses.
+ *
+ * Returns when the server can't listen, the exit status of the event loop
+ * otherwise.
+ */
+int run_server(QString const &socket_name, QVector<struct served_palette> const &palettes, struct col_opt const &opts, int threads, int queue_size,
+               std::shared_ptr<ResultCache> const &results = nullptr);
+
+#endif /* _SERVE_H_ */
@@ -0,0 +1,106 @@
+/*
+ * Copyright 2017-2022 - Geoffrey Brun <geoffrey@spekadyon.org>
+ *
+ * This file is part of any2coloring.
+ *
+ * any2coloring is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * any2coloring is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * any2coloring. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QJsonArray>
+
+#include <ctime>
+
+#include <sys/resource.h>
+
+#include "stats.hpp"
+
+#ifndef A2C_NO_STATS
+
+namespace {
+
+int64_t clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+size_t peak_rss()
+{
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage))
+		return 0;
+	// Kilobytes on Linux
+	return (size_t)usage.ru_maxrss * 1024;
+}
+
+}
+
+void run_stats::count(const char *name, int64_t value)
+{
+	for (auto &count: counts) {
+		if (count.first == name) {
+			count.second = value;
+			return;
+		}
+	}
+	counts.push_back(qMakePair(QString(name), value));
+}
+
+StageTimer::StageTimer(struct run_stats *stats, const char *name) :
+	stats(stats),
+	name(name),
+	wall(stats ? clock_ns(CLOCK_MONOTONIC) : 0),
+	cpu(stats ? clock_ns(CLOCK_PROCESS_CPUTIME_ID) : 0)
+{
+}
+
+StageTimer::~StageTimer()
+{
+	if (!stats)
+		return;
+
+	struct stage_stats stage;
+	stage.name = name;
+	stage.wall_ms = (clock_ns(CLOCK_MONOTONIC) - wall) / 1e6;
+	stage.cpu_ms = (clock_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu) / 1e6;
+	stage.peak_rss = peak_rss();
+	stats->stages.push_back(stage);
+}
+
+#endif
+
+QJsonObject stats2json(struct run_stats const &stats)
+{
+	QJsonObject json;
+	QJsonArray stages;
+	QJsonObject counts;
+
+	for (auto const &stage: stats.stages) {
+		QJsonObject object;
+		object["name"] = stage.name;
+		object["wall_ms"] = stage.wall_ms;
+		object["cpu_ms"] = stage.cpu_ms;
+		object["peak_rss"] = (double)stage.peak_rss;
+		stages.append(object);
+	}
+	for (auto const &count: stats.counts)
+		counts[count.first] = (double)count.second;
+	json["stages"] = stages;
+	json["counts"] = counts;
+
+	return json;
+}
@@ -0,0 +1,79 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+/*
+ * Copyright 2017-2022 - Geoffrey Brun <geoffrey@spekadyon.org>
+ *
+ * This file is part of any2coloring.
+ *
+ * any2coloring is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * any2coloring is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * any2coloring. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QJsonObject>
+#include <QPair>
+#include <QString>
+#include <QVector>
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Per stage instrumentation of the pipeline: wall and CPU time, process peak
+ * RSS at the end of the stage, and item counts. CPU time and RSS are process
+ * wide: they include worker threads, and other jobs running at the same time.
+ *
+ * Building with A2C_NO_STATS (CONFIG += no_stats) turns recording into empty
+ * inline functions.
+ */
+
+struct stage_stats {
+	QString name;
+	double wall_ms = 0;
+	double cpu_ms = 0;
+	size_t peak_rss = 0;	// bytes
+};
+
+struct run_stats {
+	QVector<struct stage_stats> stages;
+	QVector<QPair<QString, int64_t>> counts;
+
+#ifdef A2C_NO_STATS
+	void count(const char *, int64_t) {}
+#else
+	// Set (not add) a count
+	void count(const char *name, int64_t value);
+#endif
+};
+
+// Times a stage from construction to destruction, null stats: no-op
+class StageTimer {
+public:
+#ifdef A2C_NO_STATS
+	StageTimer(struct run_stats *, const char *) {}
+#else
+	StageTimer(struct run_stats *stats, const char *name);
+	~StageTimer();
+
+private:
+	struct run_stats *stats;
+	const char *name;
+	int64_t wall;
+	int64_t cpu;
+#endif
+};
+
+// {"stages": [{"name", "wall_ms", "cpu_ms", "peak_rss"}...], "counts": {...}}
+QJsonObject stats2json(struct run_stats const &stats);
+
+#endif /* _STATS_H_ */
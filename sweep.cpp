@@ -0,0 +1,249 @@
+/*
+ * Copyright 2017-2022 - Geoffrey Brun <geoffrey@spekadyon.org>
+ *
+ * This file is part of any2coloring.
+ *
+ * any2coloring is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * any2coloring is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * any2coloring. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QDebug>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QObject>
+
+#ifdef A2C_HEADLESS
+#include <QBuffer>
+#include <QFile>
+#else
+#include <QImageReader>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <cstdio>
+
+#include "decode.hpp"
+#include "parallel.hpp"
+#include "sweep.hpp"
+
+namespace {
+
+struct page_format {
+	const char *name;
+	double width;
+	double height;
+};
+
+const struct page_format PAGE_FORMATS[] = {
+	{"A0", 841, 1189},
+	{"A1", 594, 841},
+	{"A2", 420, 594},
+	{"A3", 297, 420},
+	{"A4", 210, 297},
+	{"A5", 148, 210},
+	{"A6", 105, 148},
+	{"letter", 215.9, 279.4},
+	{"legal", 215.9, 355.6},
+};
+
+bool parse_page(QString const &str, double &width, double &height)
+{
+	for (auto const &format: PAGE_FORMATS) {
+		if (str.compare(QLatin1String(format.name), Qt::CaseInsensitive) == 0) {
+			width = format.width;
+			height = format.height;
+			return true;
+		}
+	}
+
+	QStringList strList = str.split('x');
+	bool widthOk, heightOk;
+	if (strList.size() != 2)
+		return false;
+	width = strList.at(0).toDouble(&widthOk);
+	height = strList.at(1).toDouble(&heightOk);
+
+	return widthOk && heightOk && width > 0 && height > 0;
+}
+
+QString output_name(QString const &output, struct sweep_job const &job)
+{
+	QFileInfo fileInfo(output);
+	QString suffix = fileInfo.suffix().isEmpty() ? QString("pdf") : fileInfo.suffix();
+
+	return QDir(fileInfo.path()).filePath(QString("%1_%2_%3mm.%4")
+	                                      .arg(fileInfo.completeBaseName(), job.page)
+	                                      .arg(job.px_size, 0, 'g', 6).arg(suffix));
+}
+
+}
+
+bool parse_sweep(QString const &spec, QString const &output, struct col_opt const &opts, QVector<struct sweep_job> &jobs, QString &error)
+{
+	for (QString const &item: spec.split(',', Qt::SkipEmptyParts)) {
+		struct sweep_job job;
+		QStringList strList = item.trimmed().split(':');
+		bool ok;
+
+		if (strList.size() != 2) {
+			error = QObject::tr("expected page:pixel-size, got \"%1\"").arg(item);
+			return false;
+		}
+		job.page = strList.at(0).trimmed();
+		if (!parse_page(job.page, job.page_width, job.page_height)) {
+			error = QObject::tr("invalid page format \"%1\"").arg(job.page);
+			return false;
+		}
+		job.px_size = strList.at(1).trimmed().toDouble(&ok);
+		if (!ok || job.px_size <= 0) {
+			error = QObject::tr("invalid pixel size \"%1\"").arg(strList.at(1));
+			return false;
+		}
+		// Same checks as the page size options
+		double printable_width = job.page_width - opts.margin.left - opts.margin.right;
+		double printable_height = job.page_height - opts.margin.top - opts.margin.bottom;
+		if (printable_width <= 0 || printable_height <= 0) {
+			error = QObject::tr("margins exceed page \"%1\"").arg(job.page);
+			return false;
+		}
+		if (job.px_size >= printable_width || job.px_size >= printable_height) {
+			error = QObject::tr("pixel size exceeds the printable area in \"%1\"").arg(item.trimmed());
+			return false;
+		}
+		job.output = output_name(output, job);
+		jobs.push_back(job);
+	}
+
+	if (jobs.isEmpty()) {
+		error = QObject::tr("no combination");
+		return false;
+	}
+
+	return true;
+}
+
+int run_sweep(QString const &input, QVector<struct sweep_job> const &jobs, ColoringEngine const &engine, enum pdf_content content, int threads)
+{
+	std::atomic<int> failed(0);
+	std::vector<std::thread> workers;
+	QElapsedTimer timer;
+
+	timer.start();
+#ifdef A2C_HEADLESS
+	// No pyramid without QtGui: the file is read once, every job decodes it
+	// straight to its grid
+	QFile file(input);
+	if (!file.open(QIODevice::ReadOnly)) {
+		qDebug() << Q_FUNC_INFO << input << "failed:" << file.errorString();
+		return jobs.size();
+	}
+	QByteArray data = file.readAll();
+	file.close();
+	double decodeSeconds = timer.nsecsElapsed() / 1e9;
+
+	QVector<struct col_opt> jobOpts;
+	for (auto const &job: jobs) {
+		struct col_opt opts = engine.options();
+		opts.page.width = job.page_width;
+		opts.page.height = job.page_height;
+		opts.px_size = job.px_size;
+		jobOpts.push_back(opts);
+	}
+#else
+	QImageReader reader(input);
+	QImage image = reader.read();
+	if (image.isNull()) {
+		qDebug() << Q_FUNC_INFO << input << "failed:" << reader.errorString();
+		return jobs.size();
+	}
+	double decodeSeconds = timer.nsecsElapsed() / 1e9;
+
+	// Jobs as col_opt, and the coarsest level any of them needs
+	QVector<struct col_opt> jobOpts;
+	int minSide = std::min(image.width(), image.height());
+	for (auto const &job: jobs) {
+		struct col_opt opts = engine.options();
+		bool rotate;
+		int grid_width, grid_height;
+		opts.page.width = job.page_width;
+		opts.page.height = job.page_height;
+		opts.px_size = job.px_size;
+		jobOpts.push_back(opts);
+		grid_size(image.width(), image.height(), opts, rotate, grid_width, grid_height);
+		minSide = std::min(minSide, SWEEP_OVERSAMPLE * std::min(grid_width, grid_height));
+	}
+	QVector<QImage> levels = downscale_pyramid(image, minSide);
+	image = QImage();
+	double pyramidSeconds = timer.nsecsElapsed() / 1e9 - decodeSeconds;
+#endif
+
+	if (threads <= 0)
+		threads = ideal_thread_count();
+	threads = std::min(threads, std::max(1, jobs.size()));
+
+	JobQueue<int> queue(2 * threads);
+
+	for (int i = 0; i < threads; i += 1) {
+		workers.emplace_back([&]() {
+			int index;
+			while (queue.pop(index)) {
+				struct sweep_job const &job = jobs.at(index);
+				struct col_opt const &opts = jobOpts.at(index);
+				struct picture_source source;
+				struct Coloring coloring;
+				QString error;
+#ifdef A2C_HEADLESS
+				QBuffer buffer;
+				buffer.setData(data);
+				buffer.open(QIODevice::ReadOnly);
+				source.device = &buffer;
+#else
+				source.image = &pyramid_level(levels, opts, SWEEP_OVERSAMPLE);
+#endif
+				if (engine.make_coloring(source, opts, coloring, &error) != coloring_status::Ok) {
+					qDebug() << Q_FUNC_INFO << job.page << job.px_size << "failed:" << error;
+					failed += 1;
+					continue;
+				}
+				if (!coloring2pdf(job.output.toLocal8Bit().constData(), coloring, opts, content)) {
+					qDebug() << Q_FUNC_INFO << job.output << "failed";
+					failed += 1;
+				}
+			}
+		});
+	}
+
+	for (int i = 0; i < jobs.size(); i += 1)
+		queue.push(i);
+	queue.close();
+
+	for (auto &worker: workers)
+		worker.join();
+
+	double seconds = timer.nsecsElapsed() / 1e9;
+	int done = jobs.size() - failed.load();
+#ifdef A2C_HEADLESS
+	fprintf(stderr, "%d files in %.3f s (reading %.3f s, %d threads), %d failed\n",
+	        done, seconds, decodeSeconds, threads, failed.load());
+#else
+	fprintf(stderr, "%d files in %.3f s (decoding %.3f s, %d pyramid levels %.3f s, %d threads), %d failed\n",
+	        done, seconds, decodeSeconds, levels.size(), pyramidSeconds, threads, failed.load());
+#endif
+
+	return failed.load();
+}
@@ -0,0 +1,59 @@
+#ifndef _SWEEP_H_
+#define _SWEEP_H_
+
+/*
+ * Copyright 2017-2022 - Geoffrey Brun <geoffrey@spekadyon.org>
+ *
+ * This file is part of any2coloring.
+ *
+ * any2coloring is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * any2coloring is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * any2coloring. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QString>
+#include <QVector>
+
+#include "any2col.hpp"
+#include "engine.hpp"
+
+/*
+ * Parameter sweep: one picture colored for several page formats and pixel
+ * sizes. The picture is decoded once into a downscale pyramid, every grid is
+ * then derived from the smallest level with at least SWEEP_OVERSAMPLE pixels
+ * per cell, in parallel, each combination to its own file. Headless builds
+ * have no pyramid: the file is read once, and decoded straight to the grid of
+ * every combination (PNG and JPEG only).
+ */
+struct sweep_job {
+	QString page;	// page format, as given (e.g. "A4", "300x400")
+	double page_width;
+	double page_height;
+	double px_size;
+	QString output;
+};
+
+// Source pixels per grid cell, in both directions, of the pyramid level used
+const int SWEEP_OVERSAMPLE = 2;
+
+// Parse "page:px_size[,page:px_size...]" where page is A0-A6, letter, legal
+// or <width>x<height> in millimeters (numbers with a dot as decimal
+// separator). Outputs are named after output, e.g. out.pdf: out_A4_2mm.pdf.
+// Every combination must leave room for a cell within the margins of opts.
+bool parse_sweep(QString const &spec, QString const &output, struct col_opt const &opts, QVector<struct sweep_job> &jobs, QString &error);
+
+// Decode input once and process every job with a pool of worker threads
+// (threads <= 0 means one per core). Page size and pixel size are the job
+// ones, other options those of the engine. Returns the number of failed jobs.
+int run_sweep(QString const &input, QVector<struct sweep_job> const &jobs, ColoringEngine const &engine, enum pdf_content content, int threads);
+
+#endif /* _SWEEP_H_ */